@@ -0,0 +1,673 @@
+// Load generator for the ground control server.
+//
+// Simulates many planes from one thread. Planes arrive at a steady rate;
+// each connects, registers, asks to taxi, polls REQPOS and REQAHEAD
+// (pipelined, one pair per poll interval) until it is cleared, reports
+// INAIR and disconnects. Every reply is timed against the command that
+// asked for it, and a report of throughput and per-command latency is
+// printed at the end. TAKEOFF is timed from the REQTAXI answer.
+//
+// Run the server with a short --separation (or several --runways), or
+// the takeoff queue, not the server, sets the pace. The takeoffs/s line
+// is the other way round: it shows what the runways clear when the queue
+// is always full (make runway-bench).
+//
+// With --upgrade PID, SIGUSR2 goes to the server once half the planes
+// have started, so the run checks an upgrade under load: any command the
+// handover dropped shows up as a failed plane or a protocol error.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 1024
+#define IN_SIZE 4096          // Longer lines (REQAHEAD for a long queue)...
+#define IN_KEEP 64            // ...are cut down to their first IN_KEEP bytes
+#define MAX_PENDING 4         // Commands sent but not answered yet
+
+// What a plane is doing
+#define STEP_CONNECTING 0
+#define STEP_REGISTERING 1
+#define STEP_REQUESTING_TAXI 2
+#define STEP_TAXIING 3
+#define STEP_LEAVING 4
+
+// What gets timed
+#define STAT_REG 0
+#define STAT_REQTAXI 1
+#define STAT_REQPOS 2
+#define STAT_REQAHEAD 3
+#define STAT_INAIR 4
+#define STAT_TAKEOFF 5        // REQTAXI answered until TAKEOFF
+#define STAT_LIFETIME 6       // connect() until the INAIR notice
+#define STAT_COUNT 7
+
+static const char* const stat_names[STAT_COUNT] = {
+    "REG", "REQTAXI", "REQPOS", "REQAHEAD", "INAIR", "TAKEOFF", "lifetime"
+};
+
+// Latency histogram: power-of-two buckets of nanoseconds, each split in
+// SUB_BUCKETS linear steps
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[BUCKETS];
+} histogram;
+
+typedef struct plane {
+    int fd;
+    int number;
+    int step;
+    bool cleared;             // TAKEOFF seen
+    bool closed;              // Done; freed once off the poll list
+    bool polling;             // On the poll list
+    uint64_t connected_at;
+    uint64_t taxi_at;
+    int pending[MAX_PENDING]; // STAT_ of each unanswered command, oldest first
+    uint64_t sent_at[MAX_PENDING];
+    int pending_count;
+    uint64_t poll_at;
+    struct plane* next_poll;  // Also links closed planes waiting to be freed
+    size_t in_used;
+    char in[IN_SIZE];
+} plane;
+
+static struct {
+    const char* host;
+    const char* port;
+    long planes;
+    double rate;              // Arrivals per second; 0 starts them all at once
+    long poll_ms;             // 0 disables polling
+    pid_t upgrade_pid;        // Server to upgrade halfway through, 0 for none
+} options = { "127.0.0.1", "8080", 1000, 1000, 100, 0 };
+
+static int epoll_fd;
+static struct sockaddr_storage server;
+static socklen_t server_len;
+
+static histogram stats[STAT_COUNT];
+static long started, completed, active, failures, errors, late_polls;
+static uint64_t commands;
+static uint64_t first_takeoff, last_takeoff;   // When TAKEOFFs came in
+
+// Polls come due in the order they were scheduled, since the interval is
+// fixed, so a FIFO list is all the timer the planes need
+static plane* poll_head;
+static plane* poll_tail;
+
+// Closed planes are freed between rounds of events, so nothing still
+// holding a pointer to one is left dangling
+static plane* graveyard;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t bucket_index(uint64_t value)
+{
+    if(value < SUB_BUCKETS)
+    {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    return (size_t)(msb - SUB_BITS + 1) * SUB_BUCKETS +
+        ((value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_top(size_t index)
+{
+    if(index < SUB_BUCKETS)
+    {
+        return index;
+    }
+    size_t group = index / SUB_BUCKETS;
+    uint64_t sub = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+static void record(int stat, uint64_t nanoseconds)
+{
+    histogram* h = &stats[stat];
+    h->count++;
+    h->buckets[bucket_index(nanoseconds)]++;
+    if(nanoseconds > h->max)
+    {
+        h->max = nanoseconds;
+    }
+}
+
+static double percentile_us(const histogram* h, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * h->count + 0.5);
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += h->buckets[i];
+        if(seen >= rank)
+        {
+            uint64_t top = bucket_top(i);
+            return (top < h->max ? top : h->max) / 1000.0;
+        }
+    }
+    return h->max / 1000.0;
+}
+
+static void close_plane(plane* p, bool failed)
+{
+    if(p->closed)
+    {
+        return;
+    }
+    p->closed = true;
+    close(p->fd);
+    active--;
+    if(failed)
+    {
+        failures++;
+    }
+    if(!p->polling)
+    {
+        p->next_poll = graveyard;
+        graveyard = p;
+    }
+}
+
+static void bury_closed(void)
+{
+    while(graveyard != NULL)
+    {
+        plane* p = graveyard;
+        graveyard = p->next_poll;
+        free(p);
+    }
+}
+
+/*
+ Sends the text of one or more commands in a single write and notes each
+ command as waiting for its reply.
+*/
+static bool send_commands(plane* p, const char* text, const int* which, int count)
+{
+    size_t len = strlen(text);
+    ssize_t sent = send(p->fd, text, len, MSG_NOSIGNAL);
+    if(sent != (ssize_t)len || p->pending_count + count > MAX_PENDING)
+    {
+        close_plane(p, true);
+        return false;
+    }
+
+    uint64_t now = now_ns();
+    for(int i = 0; i < count; ++i)
+    {
+        p->pending[p->pending_count] = which[i];
+        p->sent_at[p->pending_count] = now;
+        p->pending_count++;
+    }
+    commands += count;
+    return true;
+}
+
+static bool send_command(plane* p, const char* text, int which)
+{
+    return send_commands(p, text, &which, 1);
+}
+
+static void schedule_poll(plane* p)
+{
+    if(options.poll_ms <= 0 || p->polling)
+    {
+        return;
+    }
+    p->poll_at = now_ns() + (uint64_t)options.poll_ms * 1000000;
+    p->polling = true;
+    p->next_poll = NULL;
+    if(poll_tail != NULL)
+    {
+        poll_tail->next_poll = p;
+    }
+    else
+    {
+        poll_head = p;
+    }
+    poll_tail = p;
+}
+
+static void start_plane(void)
+{
+    plane* p = calloc(1, sizeof(plane));
+    if(p == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    p->number = started++;
+    p->step = STEP_CONNECTING;
+    p->connected_at = now_ns();
+    active++;
+
+    p->fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(p->fd < 0)
+    {
+        perror("socket");
+        active--;
+        failures++;
+        free(p);
+        return;
+    }
+    int one = 1;
+    setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(p->fd, (struct sockaddr*)&server, server_len) != 0 && errno != EINPROGRESS)
+    {
+        close_plane(p, true);
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    event.data.ptr = p;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->fd, &event) != 0)
+    {
+        perror("epoll_ctl add");
+        close_plane(p, true);
+    }
+}
+
+// The connection is up: register under an id nobody else uses
+static void on_connected(plane* p)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = p;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p->fd, &event);
+
+    char line[32];
+    snprintf(line, sizeof(line), "REG LG%d\n", p->number);
+    p->step = STEP_REGISTERING;
+    send_command(p, line, STAT_REG);
+}
+
+static void send_inair(plane* p)
+{
+    p->step = STEP_LEAVING;
+    send_command(p, "INAIR\n", STAT_INAIR);
+}
+
+/*
+ Handles one line from the server. Returns false once the plane is gone.
+*/
+static bool on_line(plane* p, const char* line, size_t len, uint64_t now)
+{
+    if(len == 7 && memcmp(line, "TAKEOFF", 7) == 0)
+    {
+        p->cleared = true;
+        record(STAT_TAKEOFF, now - p->taxi_at);
+        if(first_takeoff == 0)
+        {
+            first_takeoff = now;
+        }
+        last_takeoff = now;
+        if(p->pending_count == 0)
+        {
+            send_inair(p);
+        }
+        return !p->closed;
+    }
+
+    if(p->pending_count == 0)
+    {
+        errors++;
+        close_plane(p, true);
+        return false;
+    }
+
+    int which = p->pending[0];
+    record(which, now - p->sent_at[0]);
+    p->pending_count--;
+    memmove(p->pending, p->pending + 1, p->pending_count * sizeof(int));
+    memmove(p->sent_at, p->sent_at + 1, p->pending_count * sizeof(uint64_t));
+
+    bool ok = len >= 2 && memcmp(line, "OK", 2) == 0;
+    if(!ok && (which == STAT_REQPOS || which == STAT_REQAHEAD) && p->cleared)
+    {
+        // Polled in the moment between TAKEOFF being sent and read
+        late_polls++;
+        ok = true;
+    }
+
+    switch(which)
+    {
+    case STAT_REG:
+        if(ok)
+        {
+            p->step = STEP_REQUESTING_TAXI;
+            send_command(p, "REQTAXI\n", STAT_REQTAXI);
+        }
+        break;
+    case STAT_REQTAXI:
+        if(ok)
+        {
+            p->step = STEP_TAXIING;
+            p->taxi_at = now;
+            schedule_poll(p);
+        }
+        break;
+    case STAT_INAIR:
+        ok = len >= 6 && memcmp(line, "NOTICE", 6) == 0;
+        if(ok)
+        {
+            record(STAT_LIFETIME, now - p->connected_at);
+            completed++;
+            close_plane(p, false);
+            return false;
+        }
+        break;
+    }
+
+    if(!ok)
+    {
+        errors++;
+        close_plane(p, true);
+        return false;
+    }
+
+    if(p->cleared && p->pending_count == 0 && p->step == STEP_TAXIING)
+    {
+        send_inair(p);
+    }
+    return !p->closed;
+}
+
+static void on_readable(plane* p)
+{
+    while(1)
+    {
+        ssize_t received = recv(p->fd, p->in + p->in_used, IN_SIZE - p->in_used, 0);
+        if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if(received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(received <= 0)
+        {
+            close_plane(p, true);
+            return;
+        }
+
+        p->in_used += received;
+        uint64_t now = now_ns();
+        char* start = p->in;
+        char* newline;
+        while((newline = memchr(start, '\n', p->in + p->in_used - start)) != NULL)
+        {
+            if(!on_line(p, start, newline - start, now))
+            {
+                return;
+            }
+            start = newline + 1;
+        }
+
+        size_t left = p->in + p->in_used - start;
+        if(left == IN_SIZE)
+        {
+            // Only the start of a reply is looked at
+            left = IN_KEEP;
+        }
+        memmove(p->in, start, left);
+        p->in_used = left;
+    }
+}
+
+static void run_polls(uint64_t now)
+{
+    static const int pair[] = { STAT_REQPOS, STAT_REQAHEAD };
+
+    while(poll_head != NULL && poll_head->poll_at <= now)
+    {
+        plane* p = poll_head;
+        poll_head = p->next_poll;
+        if(poll_head == NULL)
+        {
+            poll_tail = NULL;
+        }
+        p->polling = false;
+
+        if(p->closed)
+        {
+            free(p);
+            continue;
+        }
+        if(p->cleared || p->step != STEP_TAXIING)
+        {
+            continue;
+        }
+        if(p->pending_count == 0 && !send_commands(p, "REQPOS\nREQAHEAD\n", pair, 2))
+        {
+            continue;
+        }
+        schedule_poll(p);
+    }
+}
+
+static void print_report(double seconds)
+{
+    printf("planes: %ld started, %ld completed, %ld failed, %ld protocol errors, "
+        "%ld late polls\n", started, completed, failures, errors, late_polls);
+    printf("elapsed: %.2f s, %.1f planes/s, %.1f commands/s\n", seconds,
+        completed / seconds, commands / seconds);
+    // Between the first and last clearance, so arrivals and the final
+    // INAIRs don't water it down
+    uint64_t takeoffs = stats[STAT_TAKEOFF].count;
+    if(takeoffs > 1)
+    {
+        printf("takeoffs: %llu, %.2f/s\n", (unsigned long long)takeoffs,
+            (takeoffs - 1) / ((last_takeoff - first_takeoff) / 1e9));
+    }
+    printf("%-9s %10s %10s %10s %10s %10s   (microseconds)\n",
+        "", "count", "p50", "p99", "p999", "max");
+    for(int i = 0; i < STAT_COUNT; ++i)
+    {
+        const histogram* h = &stats[i];
+        if(h->count == 0)
+        {
+            printf("%-9s %10d\n", stat_names[i], 0);
+            continue;
+        }
+        printf("%-9s %10llu %10.1f %10.1f %10.1f %10.1f\n", stat_names[i],
+            (unsigned long long)h->count, percentile_us(h, 0.5), percentile_us(h, 0.99),
+            percentile_us(h, 0.999), h->max / 1000.0);
+    }
+}
+
+static void resolve_server(void)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result;
+    int rval = getaddrinfo(options.host, options.port, &hints, &result);
+    if(rval != 0)
+    {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
+        exit(1);
+    }
+    memcpy(&server, result->ai_addr, result->ai_addrlen);
+    server_len = result->ai_addrlen;
+    freeaddrinfo(result);
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--host HOST] [--port PORT] [--planes N]\n"
+        "          [--rate PLANES_PER_SECOND] [--poll-interval MS]\n"
+        "          [--upgrade SERVER_PID]\n", program);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct option long_options[] = {
+        {"host", required_argument, NULL, 'h'},
+        {"port", required_argument, NULL, 'p'},
+        {"planes", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"poll-interval", required_argument, NULL, 'i'},
+        {"upgrade", required_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "h:p:n:r:i:u:", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'n':
+            options.planes = atol(optarg);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 'i':
+            options.poll_ms = atol(optarg);
+            break;
+        case 'u':
+            options.upgrade_pid = (pid_t)atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(options.planes < 1 || options.rate < 0 || options.poll_ms < 0 ||
+        options.upgrade_pid < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    resolve_server();
+    raise_fd_limit();
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t begin = now_ns();
+
+    while(started < options.planes || active > 0)
+    {
+        uint64_t now = now_ns();
+
+        // Start every plane whose arrival time has come
+        while(started < options.planes && (options.rate == 0 ||
+            begin + (uint64_t)(started * 1e9 / options.rate) <= now))
+        {
+            start_plane();
+        }
+        if(options.upgrade_pid > 0 && started >= (options.planes + 1) / 2)
+        {
+            if(kill(options.upgrade_pid, SIGUSR2) != 0)
+            {
+                perror("kill");
+                return 1;
+            }
+            printf("upgrade: signalled with %ld planes started\n", started);
+            options.upgrade_pid = 0;
+        }
+        run_polls(now);
+
+        // Sleep until the next arrival or poll, at most a second
+        uint64_t next = now + 1000000000;
+        if(started < options.planes && options.rate > 0)
+        {
+            uint64_t arrival = begin + (uint64_t)(started * 1e9 / options.rate);
+            next = arrival < next ? arrival : next;
+        }
+        if(poll_head != NULL && poll_head->poll_at < next)
+        {
+            next = poll_head->poll_at;
+        }
+        int timeout = next > now ? (int)((next - now + 999999) / 1000000) : 0;
+
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if(ready < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for(int i = 0; i < ready; ++i)
+        {
+            plane* p = events[i].data.ptr;
+            if(p->step == STEP_CONNECTING)
+            {
+                if(events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    close_plane(p, true);
+                    continue;
+                }
+                on_connected(p);
+            }
+            if(!p->closed && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            {
+                on_readable(p);
+            }
+        }
+        bury_closed();
+    }
+
+    print_report((now_ns() - begin) / 1e9);
+    return failures > 0 || errors > 0;
+}
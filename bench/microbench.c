@@ -0,0 +1,1295 @@
+// Microbenchmarks for the containers and parser on the command path.
+//
+// Links the server's own objects and times them in process: the array
+// list under reader/writer contention, connection threads pushing takeoff
+// events to the one scheduler thread, flight id lookups at several fleet
+// sizes, the takeoff queue (enqueue, find_position, find_taxi_list) at
+// depths from 10 up to --max-depth and the taxi queue under mid-queue
+// churn, connect and REG with a clearance outstanding, the line scanner
+// against the parsing it replaced, docommand on its own, a plane's
+// REQTAXI through a scheduler pass with the journal off and on, and the
+// journal: a group commit and recovery from a long journal. Each result
+// is one CSV line on stdout:
+//
+//   benchmark,size,threads,ops,ns_per_op
+//
+// Save a run and pass it back with --baseline to compare: every result
+// more than --threshold percent slower than its baseline is reported on
+// stderr and the exit status is 1.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "alist.h"
+#include "airplane.h"
+#include "airs_protocol.h"
+#include "eventring.h"
+#include "flightlist.h"
+#include "journal.h"
+#include "linescan.h"
+#include "takeoffqueue.h"
+#include "taxiqueue.h"
+#include "separation.h"
+#include "timers.h"
+#include "util.h"
+
+#define MAX_RESULTS 256
+#define MAX_THREADS 8
+#define ALIST_ITEMS 1000
+
+typedef struct {
+    char benchmark[48];
+    long size;
+    int threads;
+    uint64_t ops;
+    double ns_per_op;
+} result;
+
+static struct {
+    long max_depth;
+    uint64_t target_ns;       // How long each measurement runs
+    const char* filter;
+    const char* baseline;
+    double threshold;         // Percent slower that counts as a regression
+} options = { 1000000, 100000000, NULL, NULL, 10.0 };
+
+static result results[MAX_RESULTS];
+static int result_count;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64: cheap enough not to show up in what it picks for
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static bool selected(const char* benchmark)
+{
+    return options.filter == NULL || strstr(benchmark, options.filter) != NULL;
+}
+
+static void report(const char* benchmark, long size, int threads, uint64_t ops, uint64_t ns)
+{
+    if(result_count == MAX_RESULTS)
+    {
+        fprintf(stderr, "Too many results\n");
+        exit(1);
+    }
+    result* r = &results[result_count++];
+    snprintf(r->benchmark, sizeof(r->benchmark), "%s", benchmark);
+    r->size = size;
+    r->threads = threads;
+    r->ops = ops;
+    r->ns_per_op = ops > 0 ? (double)ns * threads / ops : 0;
+    printf("%s,%ld,%d,%llu,%.1f\n", r->benchmark, r->size, r->threads,
+        (unsigned long long)r->ops, r->ns_per_op);
+    fflush(stdout);
+}
+
+// Reads a CSV line as report prints it
+static bool parse_result(const char* line, result* r, unsigned long long* ops)
+{
+    return sscanf(line, "%47[^,],%ld,%d,%llu,%lf", r->benchmark, &r->size,
+        &r->threads, ops, &r->ns_per_op) == 5;
+}
+
+/*
+ Runs "op" in growing batches until a batch takes at least the target
+ time, then reports that batch.
+*/
+static void measure(const char* benchmark, long size, void (*op)(void* context,
+    uint64_t i), void* context)
+{
+    if(!selected(benchmark))
+    {
+        return;
+    }
+
+    uint64_t iterations = 1;
+    while(1)
+    {
+        uint64_t start = now_ns();
+        for(uint64_t i = 0; i < iterations; ++i)
+        {
+            op(context, i);
+        }
+        uint64_t elapsed = now_ns() - start;
+        if(elapsed >= options.target_ns || iterations >= (1ull << 32))
+        {
+            report(benchmark, size, 1, iterations, elapsed);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+/************************************************************************
+ * alist: readers and writers sharing one list through its rwlock.
+ */
+
+typedef struct {
+    alist* list;
+    int mode;                 // ALIST_GET, ALIST_ADD_REMOVE or ALIST_MIXED
+    atomic_bool* stop;
+    uint64_t ops;
+    uint64_t seed;
+} alist_worker;
+
+#define ALIST_GET 0
+#define ALIST_ADD_REMOVE 1
+#define ALIST_MIXED 2         // One write in ten
+
+static void no_free(void* data)
+{
+}
+
+static void* alist_worker_start(void* arg)
+{
+    alist_worker* w = arg;
+    uint64_t ops = 0;
+    while(!atomic_load_explicit(w->stop, memory_order_relaxed))
+    {
+        uint64_t r = next_random(&w->seed);
+        bool write = w->mode == ALIST_ADD_REMOVE || (w->mode == ALIST_MIXED && r % 10 == 0);
+        if(write)
+        {
+            // Add and take away again so the list keeps its size
+            alist_add(w->list, (void*)(uintptr_t)r);
+            alist_remove(w->list, ALIST_ITEMS);
+            ops += 2;
+        }
+        else
+        {
+            alist_get(w->list, r % ALIST_ITEMS);
+            ops++;
+        }
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+static void bench_alist(const char* benchmark, int mode)
+{
+    if(!selected(benchmark))
+    {
+        return;
+    }
+
+    for(int threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        alist list;
+        alist_init(&list, no_free);
+        for(int i = 0; i < ALIST_ITEMS; ++i)
+        {
+            alist_add(&list, (void*)(uintptr_t)(i + 1));
+        }
+
+        atomic_bool stop;
+        atomic_init(&stop, false);
+        alist_worker workers[MAX_THREADS];
+        pthread_t ids[MAX_THREADS];
+
+        uint64_t start = now_ns();
+        for(int i = 0; i < threads; ++i)
+        {
+            workers[i] = (alist_worker){ &list, mode, &stop, 0, 0x9E3779B97F4A7C15ull * (i + 1) };
+            pthread_create(&ids[i], NULL, alist_worker_start, &workers[i]);
+        }
+        struct timespec wait = { options.target_ns / 1000000000, options.target_ns % 1000000000 };
+        nanosleep(&wait, NULL);
+        atomic_store(&stop, true);
+
+        uint64_t ops = 0;
+        for(int i = 0; i < threads; ++i)
+        {
+            pthread_join(ids[i], NULL);
+            ops += workers[i].ops;
+        }
+        report(benchmark, ALIST_ITEMS, threads, ops, now_ns() - start);
+        alist_destroy(&list);
+    }
+}
+
+/************************************************************************
+ * Event ring: connection threads pushing takeoff events while the one
+ * scheduler thread pops them. The ops are events through the ring.
+ */
+
+typedef struct {
+    eventring* ring;
+    atomic_bool* stop;
+    uint64_t ops;
+} ring_producer;
+
+typedef struct {
+    eventring* ring;
+    atomic_bool* done;        // Set once every producer has stopped
+} ring_consumer;
+
+static void* ring_producer_start(void* arg)
+{
+    ring_producer* p = arg;
+    takeoff_event event = { .type = EVENT_ENQUEUE };
+    flight_id_set(&event.id, "PUSH", 4);
+    uint64_t ops = 0;
+    while(!atomic_load_explicit(p->stop, memory_order_relaxed))
+    {
+        event.ticket = ops;
+        eventring_push(p->ring, &event);
+        ops++;
+    }
+    p->ops = ops;
+    return NULL;
+}
+
+static void* ring_consumer_start(void* arg)
+{
+    ring_consumer* c = arg;
+    takeoff_event event;
+    while(1)
+    {
+        if(eventring_pop(c->ring, &event))
+        {
+            continue;
+        }
+        if(atomic_load(c->done) && eventring_empty(c->ring))
+        {
+            return NULL;
+        }
+        sched_yield();
+    }
+}
+
+static void bench_eventring(void)
+{
+    if(!selected("eventring_push"))
+    {
+        return;
+    }
+
+    eventring* ring = aligned_alloc(64, sizeof(eventring));
+    if(ring == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(int threads = 1; threads <= MAX_THREADS; threads *= 2)
+    {
+        eventring_init(ring);
+        atomic_bool stop;
+        atomic_bool done;
+        atomic_init(&stop, false);
+        atomic_init(&done, false);
+        ring_producer producers[MAX_THREADS];
+        pthread_t ids[MAX_THREADS];
+        ring_consumer consumer = { ring, &done };
+        pthread_t consumer_id;
+
+        uint64_t start = now_ns();
+        pthread_create(&consumer_id, NULL, ring_consumer_start, &consumer);
+        for(int i = 0; i < threads; ++i)
+        {
+            producers[i] = (ring_producer){ ring, &stop, 0 };
+            pthread_create(&ids[i], NULL, ring_producer_start, &producers[i]);
+        }
+        struct timespec wait = { options.target_ns / 1000000000, options.target_ns % 1000000000 };
+        nanosleep(&wait, NULL);
+        atomic_store(&stop, true);
+
+        uint64_t ops = 0;
+        for(int i = 0; i < threads; ++i)
+        {
+            pthread_join(ids[i], NULL);
+            ops += producers[i].ops;
+        }
+        // Every event pushed counts once the scheduler side has it
+        atomic_store(&done, true);
+        pthread_join(consumer_id, NULL);
+        report("eventring_push", EVENTRING_CAPACITY, threads, ops, now_ns() - start);
+    }
+    free(ring);
+}
+
+/************************************************************************
+ * Flight list: looking a plane up by its id, as REG and the takeoff
+ * scheduler do.
+ */
+
+static long fleet_size;
+static flight_id* fleet_ids;
+
+static void grow_fleet(long size)
+{
+    fleet_ids = realloc(fleet_ids, size * sizeof(*fleet_ids));
+    if(fleet_ids == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for(; fleet_size < size; ++fleet_size)
+    {
+        plane_handle handle = flightlist_addplane(-1);
+        pthread_mutex_lock(&flightlist_lock);
+        airplane* p = flightlist_get(handle);
+        pthread_mutex_unlock(&flightlist_lock);
+
+        char id[32];
+        int len = snprintf(id, sizeof(id), "FL%ld", fleet_size);
+        flight_id_set(&fleet_ids[fleet_size], id, len);
+        flightlist_register(p, &fleet_ids[fleet_size]);
+    }
+}
+
+static void find_id_op(void* context, uint64_t i)
+{
+    uint64_t* seed = context;
+    pthread_mutex_lock(&flightlist_lock);
+    airplane* p = flightlist_find_id(&fleet_ids[next_random(seed) % fleet_size]);
+    pthread_mutex_unlock(&flightlist_lock);
+    if(p == NULL)
+    {
+        fprintf(stderr, "Lost a plane\n");
+        exit(1);
+    }
+}
+
+// A plane connecting and going away again while the fleet stays up
+static void churn_op(void* context, uint64_t i)
+{
+    flightlist_removeplane(flightlist_addplane(-1));
+}
+
+static void bench_flightlist(void)
+{
+    uint64_t seed = 88172645463325252ull;
+    for(long size = 10; size <= 100000; size *= 10)
+    {
+        grow_fleet(size);
+        measure("flightlist_find_id", size, find_id_op, &seed);
+        measure("flightlist_churn", size, churn_op, NULL);
+    }
+}
+
+/************************************************************************
+ * Takeoff queue. One real plane at the front is cleared and never goes
+ * in air, so its runway stays taken and everyone behind it waits: the
+ * queue holds exactly the planes put in it. Before timing anything the
+ * taxi queue's positions and REQAHEAD text are checked against ones
+ * worked out entry by entry, after every change through out-of-order
+ * inserts and planes leaving from the front and the middle. Tickets not
+ * inserted yet are checked as well.
+ *
+ * taxiqueue_churn times the taxi queue on its own at a steady depth: per
+ * operation the front plane leaves, one leaves from a random place in
+ * line, and two join out of order (the later ticket first, reserving the
+ * earlier one).
+ */
+
+#define CHECK_TICKETS 4096
+#define CHECK_CHANGES 16000
+
+static void check_id(flight_id* id, uint64_t ticket)
+{
+    char text[32];
+    flight_id_set(id, text, snprintf(text, sizeof(text), "C%llu",
+        (unsigned long long)ticket));
+}
+
+static bool check_insert(taxiqueue* q, uint64_t ticket)
+{
+    flight_id id;
+    check_id(&id, ticket);
+    taxiqueue_insert(q, ticket, &id, (plane_handle){ 0 }, 0);
+    return taxiqueue_get(q, ticket) != NULL;
+}
+
+static bool same_queue(taxiqueue* q)
+{
+    static char expected[CHECK_TICKETS * (PLANE_MAXID + 2)];
+    static char got[CHECK_TICKETS * (PLANE_MAXID + 2)];
+    size_t expected_len = 0;
+    long position = 0;
+
+    // Pending tickets, reserved or past the tail, are where they would go
+    // if they were inserted now
+    for(uint64_t t = q->head; t <= q->tail + 1; ++t)
+    {
+        taxi_entry* e = taxiqueue_get(q, t);
+        if(e == NULL && t < q->tail && !taxiqueue_is_reserved(q, t))
+        {
+            continue;
+        }
+
+        long len = taxiqueue_ahead(q, t, got, sizeof(got));
+        if(taxiqueue_position(q, t) != position || len != (long)expected_len ||
+            memcmp(got, expected, expected_len) != 0)
+        {
+            fprintf(stderr, "taxiqueue: ticket %llu is at %ld behind \"%.*s\", "
+                "expected %ld behind \"%.*s\"\n", (unsigned long long)t,
+                taxiqueue_position(q, t), len < 0 ? 0 : (int)len, got, position,
+                (int)expected_len, expected);
+            return false;
+        }
+        if(e == NULL)
+        {
+            continue;
+        }
+
+        if(position > 0)
+        {
+            memcpy(expected + expected_len, ", ", 2);
+            expected_len += 2;
+        }
+        memcpy(expected + expected_len, e->id.text, e->id.len);
+        expected_len += e->id.len;
+        position++;
+    }
+    return true;
+}
+
+static bool check_taxiqueue(void)
+{
+    taxiqueue q;
+    bool ok = true;
+
+    // Ticket 1 is reserved by 2 and filled after 3, then the head leaves
+    taxiqueue_init(&q);
+    ok = check_insert(&q, 0) && check_insert(&q, 2) && check_insert(&q, 3);
+    ok = ok && same_queue(&q) && check_insert(&q, 1) && taxiqueue_remove(&q, 0);
+    ok = ok && same_queue(&q);
+    taxiqueue_destroy(&q);
+
+    // Random changes: tickets are handed out in order and inserted in any
+    // order, planes leave from the front or anywhere
+    uint64_t seed = 88172645463325252ull;
+    uint64_t pending[64];
+    int pending_count = 0;
+    uint64_t issued = 0;
+    taxiqueue_init(&q);
+    for(int change = 0; ok && change < CHECK_CHANGES && issued < CHECK_TICKETS; ++change)
+    {
+        uint64_t r = next_random(&seed);
+        switch(r % 4)
+        {
+        case 0:
+            if(pending_count < 64 && issued < CHECK_TICKETS)
+            {
+                pending[pending_count++] = issued++;
+            }
+            break;
+        case 1:
+            if(pending_count > 0)
+            {
+                int i = (r >> 8) % pending_count;
+                ok = check_insert(&q, pending[i]);
+                pending[i] = pending[--pending_count];
+            }
+            break;
+        case 2:
+            taxiqueue_remove(&q, q.head);
+            break;
+        case 3:
+            if(q.tail > q.head)
+            {
+                taxiqueue_remove(&q, q.head + (r >> 8) % (q.tail - q.head));
+            }
+            break;
+        }
+        ok = ok && same_queue(&q);
+    }
+    taxiqueue_destroy(&q);
+    return ok;
+}
+
+static long queue_depth;
+static uint64_t first_ticket;   // Ticket of the first waiting plane
+static char* taxi_list;
+static size_t taxi_list_cap;
+
+static airplane* holding;      // Cleared, and never reports INAIR
+
+/*
+ Starts the scheduler with one runway and a plane that holds it: the
+ plane is cleared but never takes off, so from then on a clearance is
+ always outstanding. With a "journal_dir" the scheduler journals there,
+ as with gndcontrol --journal.
+*/
+static void start_queue(const char* journal_dir)
+{
+    if(holding != NULL)
+    {
+        return;
+    }
+    separation_init(0);
+    timers_init();
+    init_takeOff();
+    if(journal_dir != NULL && takeoff_recover(journal_dir, 0) != 0)
+    {
+        exit(1);
+    }
+    takeoff_thread_init(1);
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    plane_handle handle = flightlist_addplane(fd);
+    pthread_mutex_lock(&flightlist_lock);
+    airplane* p = flightlist_get(handle);
+    pthread_mutex_unlock(&flightlist_lock);
+
+    flight_id hold;
+    flight_id_set(&hold, "HOLD", 4);
+    flightlist_register(p, &hold);
+    set_state(p, PLANE_TAXIING);
+    p->taxi_ticket = enqueue(p);
+    first_ticket = p->taxi_ticket + 1;
+
+    holding = p;
+    struct timespec wait = { 0, 1000000 };
+    while(read_state(holding) != PLANE_CLEAR)
+    {
+        nanosleep(&wait, NULL);
+    }
+}
+
+/*
+ Adds planes until the queue is "depth" deep, and returns the time per
+ plane from the first enqueue until the scheduler has applied the last.
+*/
+static double grow_queue(long depth)
+{
+    long added = depth - queue_depth;
+    uint64_t start = now_ns();
+    char id[32];
+    // Queued planes are never cleared, so they need no place in the flight list
+    static airplane queued;
+    for(; queue_depth < depth; ++queue_depth)
+    {
+        int len = snprintf(id, sizeof(id), "Q%ld", queue_depth);
+        flight_id_set(&queued.id, id, len);
+        enqueue(&queued);
+    }
+    // Returns once the scheduler has applied everything posted so far
+    takeoff_pause();
+    takeoff_resume();
+    uint64_t elapsed = now_ns() - start;
+
+    taxi_list_cap = depth * (PLANE_MAXID + 2) + 64;
+    taxi_list = realloc(taxi_list, taxi_list_cap);
+    if(taxi_list == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    return added > 0 ? (double)elapsed / added : 0;
+}
+
+typedef struct {
+    taxiqueue queue;
+    uint64_t seed;
+} churn_case;
+
+static void taxiqueue_churn_op(void* context, uint64_t i)
+{
+    churn_case* c = context;
+    taxiqueue* q = &c->queue;
+    taxiqueue_remove(q, q->head);
+    while(!taxiqueue_remove(q, q->head + next_random(&c->seed) % (q->tail - q->head)))
+    {
+    }
+
+    uint64_t ticket = q->tail;
+    check_insert(q, ticket + 1);
+    check_insert(q, ticket);
+}
+
+static void bench_taxiqueue_churn(void)
+{
+    if(!selected("taxiqueue_churn"))
+    {
+        return;
+    }
+
+    churn_case c = { .seed = 2463534242ull };
+    for(long depth = 1000; depth <= options.max_depth; depth *= 10)
+    {
+        taxiqueue_init(&c.queue);
+        for(long i = 0; i < depth; ++i)
+        {
+            check_insert(&c.queue, i);
+        }
+        measure("taxiqueue_churn", depth, taxiqueue_churn_op, &c);
+        taxiqueue_destroy(&c.queue);
+    }
+}
+
+static void find_position_op(void* context, uint64_t i)
+{
+    uint64_t* seed = context;
+    find_position(first_ticket + next_random(seed) % queue_depth);
+}
+
+static void find_taxi_list_op(void* context, uint64_t i)
+{
+    uint64_t* seed = context;
+    find_taxi_list(first_ticket + next_random(seed) % queue_depth, taxi_list, taxi_list_cap);
+}
+
+static bool bench_takeoffqueue(void)
+{
+    if(!selected("enqueue") && !selected("find_position") && !selected("find_taxi_list") &&
+        !selected("taxiqueue_churn"))
+    {
+        return true;
+    }
+    if(!check_taxiqueue())
+    {
+        return false;
+    }
+    bench_taxiqueue_churn();
+    if(!selected("enqueue") && !selected("find_position") && !selected("find_taxi_list"))
+    {
+        return true;
+    }
+
+    start_queue(NULL);
+
+    uint64_t seed = 2463534242ull;
+    for(long depth = 10; depth <= options.max_depth; depth *= 10)
+    {
+        long added = depth - queue_depth;
+        double per_plane = grow_queue(depth);
+        if(selected("enqueue"))
+        {
+            report("enqueue", depth, 1, added, (uint64_t)(per_plane * added));
+        }
+        measure("find_position", depth, find_position_op, &seed);
+        measure("find_taxi_list", depth, find_taxi_list_op, &seed);
+    }
+    return true;
+}
+
+/************************************************************************
+ * Connect and REG: a plane connecting, registering and disconnecting,
+ * first with the runway idle, then while a clearance is outstanding.
+ * Neither may wait on the plane that was cleared.
+ */
+
+typedef struct {
+    int fd;                   // Each plane gets its own copy; removal closes it
+    char line[32];
+} reg_case;
+
+static void reg_connect_op(void* context, uint64_t i)
+{
+    reg_case* c = context;
+    int fd = dup(c->fd);
+    if(fd < 0)
+    {
+        perror("dup");
+        exit(1);
+    }
+    plane_handle handle = flightlist_addplane(fd);
+    pthread_mutex_lock(&flightlist_lock);
+    airplane* p = flightlist_get(handle);
+    pthread_mutex_unlock(&flightlist_lock);
+
+    int len = snprintf(c->line, sizeof(c->line), "REG R%llu", (unsigned long long)i);
+    docommand(p, c->line, len);
+    flightlist_removeplane(handle);
+}
+
+static void bench_reg_connect(void)
+{
+    if(!selected("reg_connect"))
+    {
+        return;
+    }
+
+    reg_case c;
+    c.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    measure("reg_connect", 0, reg_connect_op, &c);
+    if(selected("reg_connect_cleared"))
+    {
+        start_queue(NULL);
+        measure("reg_connect_cleared", 0, reg_connect_op, &c);
+    }
+    close(c.fd);
+}
+
+/************************************************************************
+ * docommand: parse, dispatch and queue the reply, with no socket write.
+ */
+
+typedef struct {
+    airplane* plane;
+    const char* line;
+    char buffer[64];
+} command_case;
+
+static void docommand_op(void* context, uint64_t i)
+{
+    command_case* c = context;
+    // docommand parses in place, so every run gets a fresh copy
+    size_t len = strlen(c->line);
+    memcpy(c->buffer, c->line, len + 1);
+    docommand(c->plane, c->buffer, len);
+
+    if((i & 1023) == 1023)
+    {
+        outbuf_flush(&c->plane->cold->out);
+    }
+}
+
+static void bench_docommand(void)
+{
+    static const struct {
+        const char* benchmark;
+        const char* line;
+        bool registered;
+    } cases[] = {
+        { "docommand_unknown", "  FROBNICATE now please", false },
+        { "docommand_unregistered", "REQPOS", false },
+        { "docommand_reg_again", "REG  AB1234  ", true },
+    };
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        plane_handle handle = flightlist_addplane(fd);
+        pthread_mutex_lock(&flightlist_lock);
+        airplane* p = flightlist_get(handle);
+        pthread_mutex_unlock(&flightlist_lock);
+
+        if(cases[i].registered)
+        {
+            char text[PLANE_MAXID+1];
+            flight_id id;
+            flight_id_set(&id, text, snprintf(text, sizeof(text), "DC%zu", i));
+            flightlist_register(p, &id);
+            set_state(p, PLANE_ATTERMINAL);
+        }
+
+        command_case c = { p, cases[i].line };
+        measure(cases[i].benchmark, 0, docommand_op, &c);
+        outbuf_flush(&p->cold->out);
+    }
+}
+
+/************************************************************************
+ * A plane's REQTAXI through a scheduler pass, with the journal off and
+ * on. docommand queues the plane, it leaves the line again as on a
+ * disconnect, and the op waits until the scheduler has applied both: for
+ * a journaling scheduler that includes appending and committing the two
+ * records, so the difference between the two results is what the journal
+ * adds for each plane. The scheduler can only be started once in a
+ * process, so each case runs in a child forked before this process
+ * starts its own, and the child's CSV line comes back through a pipe.
+ */
+
+// Makes a scratch directory for a journal from a "/tmp/...XXXXXX" template
+static void journal_dir_create(char* dir)
+{
+    if(mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+}
+
+static void journal_dir_remove(const char* dir)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s/journal", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/snapshot", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+typedef struct {
+    airplane* plane;
+    char line[16];
+} pass_case;
+
+static void reqtaxi_pass_op(void* context, uint64_t i)
+{
+    pass_case* c = context;
+    airplane* p = c->plane;
+    memcpy(c->line, "REQTAXI", 8);
+    docommand(p, c->line, 7);
+
+    uint64_t ticket = p->taxi_ticket;
+    set_state(p, PLANE_ATTERMINAL);
+    leave_queue(ticket);
+    // A queued or pending ticket has a place until the LEAVE is applied
+    while(find_position(ticket) >= 0)
+    {
+        sched_yield();
+    }
+
+    if((i & 1023) == 1023)
+    {
+        outbuf_flush(&p->cold->out);
+    }
+}
+
+static void reqtaxi_pass_child(const char* benchmark, bool journal)
+{
+    char dir[] = "/tmp/gcjournal.XXXXXX";
+    if(journal)
+    {
+        journal_dir_create(dir);
+    }
+    start_queue(journal ? dir : NULL);
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    plane_handle handle = flightlist_addplane(fd);
+    pthread_mutex_lock(&flightlist_lock);
+    airplane* p = flightlist_get(handle);
+    pthread_mutex_unlock(&flightlist_lock);
+
+    flight_id id;
+    flight_id_set(&id, "PASS", 4);
+    flightlist_register(p, &id);
+    set_state(p, PLANE_ATTERMINAL);
+
+    pass_case c = { p };
+    measure(benchmark, 0, reqtaxi_pass_op, &c);
+    outbuf_flush(&p->cold->out);
+
+    takeOffDestroy();
+    if(journal)
+    {
+        journal_dir_remove(dir);
+    }
+}
+
+static void bench_reqtaxi_pass(void)
+{
+    static const struct {
+        const char* benchmark;
+        bool journal;
+    } cases[] = {
+        { "reqtaxi_pass", false },
+        { "reqtaxi_pass_journal", true },
+    };
+
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        if(!selected(cases[i].benchmark))
+        {
+            continue;
+        }
+
+        int fds[2];
+        if(pipe(fds) != 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if(pid == 0)
+        {
+            close(fds[0]);
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[1]);
+            reqtaxi_pass_child(cases[i].benchmark, cases[i].journal);
+            fflush(stdout);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        FILE* f = fdopen(fds[0], "r");
+        if(f == NULL)
+        {
+            perror("fdopen");
+            exit(1);
+        }
+        result r;
+        unsigned long long ops = 0;
+        bool measured = false;
+        char line[256];
+        while(fgets(line, sizeof(line), f) != NULL)
+        {
+            measured |= parse_result(line, &r, &ops);
+        }
+        fclose(f);
+
+        int status;
+        if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0 || !measured)
+        {
+            fprintf(stderr, "%s: the measuring process failed\n", cases[i].benchmark);
+            exit(1);
+        }
+        report(r.benchmark, r.size, r.threads, ops, (uint64_t)(r.ns_per_op * ops / r.threads));
+    }
+}
+
+/************************************************************************
+ * Line scanner. The reference is how docommand used to split a line:
+ * isspace walks, trim and an isalnum loop. Before timing anything the
+ * two are checked against each other on fixed and random lines.
+ */
+
+static bool reference_scan(linescan* scan, char* line, size_t len)
+{
+    char* end = line + len;
+    while(line < end && isspace((unsigned char)*line))
+        line++;
+    if(line == end)
+    {
+        return false;
+    }
+
+    scan->cmd = line;
+    while(line < end && !isspace((unsigned char)*line))
+        line++;
+    scan->cmd_len = line - scan->cmd;
+
+    scan->args = NULL;
+    scan->args_len = 0;
+    scan->args_alnum = false;
+    if(line < end)
+    {
+        *end = '\0';
+        scan->args = trim(line);
+        scan->args_len = strlen(scan->args);
+        scan->args_alnum = true;
+        for(char* p = scan->args; *p != '\0'; ++p)
+        {
+            scan->args_alnum &= isalnum((unsigned char)*p) != 0;
+        }
+    }
+    return true;
+}
+
+static const char* const line_mix[] = {
+    "REQPOS", "REQPOS", "REQPOS", "REQAHEAD", "REQAHEAD", "REQTAXI",
+    "REG AB1234", "REG  KL7731  ", "INAIR", "BYE\r", "REG ABCDEFGHIJKLMNOPQRSTU",
+    "REG AB-12", "  FROBNICATE now please", "REQPOS   ", "",
+};
+
+#define LINE_MIX_COUNT (sizeof(line_mix) / sizeof(line_mix[0]))
+
+static bool same_scan(const char* text, size_t len)
+{
+    char a[1024 + LINESCAN_SLACK], b[1024 + LINESCAN_SLACK];
+    memcpy(a, text, len);
+    memcpy(b, text, len);
+    linescan got, want;
+    bool got_line = linescan_parse(&got, a, len);
+    bool want_line = reference_scan(&want, b, len);
+
+    bool same = got_line == want_line;
+    if(same && got_line)
+    {
+        same = got.cmd - a == want.cmd - b && got.cmd_len == want.cmd_len &&
+            (got.args == NULL) == (want.args == NULL);
+        if(same && got.args != NULL)
+        {
+            // Empty arguments may sit anywhere after the command
+            same = got.args_len == want.args_len && got.args_alnum == want.args_alnum &&
+                (got.args_len == 0 || got.args - a == want.args - b);
+        }
+    }
+    if(!same)
+    {
+        fprintf(stderr, "linescan disagrees with the reference on \"%.*s\"\n",
+            (int)len, text);
+    }
+    return same;
+}
+
+// Random lines over bytes that matter to the scanner; no NULs, which
+// trim would stop at
+static bool check_linescan(void)
+{
+    static const char alphabet[] = " \t\r\v\fAZaz09-_~\x80\xff";
+    uint64_t seed = 2463534242ull;
+    char text[1024];
+
+    for(size_t i = 0; i < LINE_MIX_COUNT; ++i)
+    {
+        if(!same_scan(line_mix[i], strlen(line_mix[i])))
+        {
+            return false;
+        }
+    }
+    for(int i = 0; i < 200000; ++i)
+    {
+        size_t len = next_random(&seed) % (i < 1000 ? sizeof(text) : 100);
+        for(size_t j = 0; j < len; ++j)
+        {
+            text[j] = alphabet[next_random(&seed) % (sizeof(alphabet) - 1)];
+        }
+        if(!same_scan(text, len))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    bool (*scan)(linescan* scan, char* line, size_t len);
+    char buffer[64];
+} scan_case;
+
+static void scan_op(void* context, uint64_t i)
+{
+    scan_case* c = context;
+    const char* line = line_mix[i % LINE_MIX_COUNT];
+    size_t len = strlen(line);
+    memcpy(c->buffer, line, len + 1);
+    linescan scan;
+    c->scan(&scan, c->buffer, len);
+    __asm__ volatile("" : : "r"(&scan) : "memory");
+}
+
+static bool bench_linescan(void)
+{
+    if(selected("linescan") && !check_linescan())
+    {
+        return false;
+    }
+    scan_case scanner = { linescan_parse };
+    scan_case reference = { reference_scan };
+    measure("linescan", 0, scan_op, &scanner);
+    measure("linescan_reference", 0, scan_op, &reference);
+    return true;
+}
+
+/************************************************************************
+ * Journal, in a scratch directory under /tmp. Recovery replays a journal
+ * of JOURNAL_BENCH_RECORDS records (half registrations, half joins) and
+ * rewrites the snapshot; a group commit is JOURNAL_GROUP joins and
+ * departures made durable with one sync.
+ */
+
+#define JOURNAL_BENCH_RECORDS 1000000
+#define JOURNAL_GROUP 256
+
+static void journal_group_op(void* context, uint64_t i)
+{
+    flight_id* ids = context;
+    for(int r = 0; r < JOURNAL_GROUP; r += 2)
+    {
+        uint64_t ticket = i * JOURNAL_GROUP + r;
+        journal_append(JOURNAL_ENQUEUE, &ids[r], ticket);
+        journal_append(JOURNAL_DEQUEUE, &ids[r], ticket);
+    }
+    journal_sync();
+}
+
+static void bench_journal(void)
+{
+    if(!selected("journal_recover") && !selected("journal_group_commit"))
+    {
+        return;
+    }
+
+    char dir[] = "/tmp/gcjournal.XXXXXX";
+    journal_dir_create(dir);
+
+    journal_plane* planes;
+    size_t count;
+    flight_id id;
+    char text[32];
+    if(journal_open(dir, &planes, &count) != 0)
+    {
+        exit(1);
+    }
+    free(planes);
+    for(long i = 0; i < JOURNAL_BENCH_RECORDS / 2; ++i)
+    {
+        int len = snprintf(text, sizeof(text), "J%ld", i);
+        flight_id_set(&id, text, len);
+        journal_append(JOURNAL_REGISTER, &id, i + 1);
+        journal_append(JOURNAL_ENQUEUE, &id, i);
+        if((i & 4095) == 4095)
+        {
+            journal_commit();
+        }
+    }
+    journal_close();
+
+    uint64_t start = now_ns();
+    if(journal_open(dir, &planes, &count) != 0 || count != JOURNAL_BENCH_RECORDS / 2)
+    {
+        fprintf(stderr, "journal recovered %zu planes\n", count);
+        exit(1);
+    }
+    if(selected("journal_recover"))
+    {
+        report("journal_recover", JOURNAL_BENCH_RECORDS, 1, 1, now_ns() - start);
+    }
+
+    flight_id ids[JOURNAL_GROUP];
+    for(int r = 0; r < JOURNAL_GROUP; ++r)
+    {
+        ids[r] = planes[r].id;
+    }
+    free(planes);
+    measure("journal_group_commit", JOURNAL_GROUP, journal_group_op, ids);
+    journal_close();
+    journal_dir_remove(dir);
+}
+
+/************************************************************************
+ * Baseline comparison.
+ */
+
+static int compare_baseline(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    int regressions = 0;
+    char line[256];
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        result base;
+        unsigned long long ops;
+        if(!parse_result(line, &base, &ops))
+        {
+            continue;
+        }
+
+        for(int i = 0; i < result_count; ++i)
+        {
+            result* r = &results[i];
+            if(strcmp(r->benchmark, base.benchmark) != 0 || r->size != base.size ||
+                r->threads != base.threads)
+            {
+                continue;
+            }
+            double change = base.ns_per_op > 0 ?
+                (r->ns_per_op - base.ns_per_op) * 100 / base.ns_per_op : 0;
+            bool regressed = change > options.threshold;
+            fprintf(stderr, "%-24s %8ld %2d  %10.1f -> %10.1f ns  %+6.1f%%%s\n",
+                r->benchmark, r->size, r->threads, base.ns_per_op, r->ns_per_op,
+                change, regressed ? "  REGRESSION" : "");
+            regressions += regressed;
+        }
+    }
+    fclose(f);
+
+    if(regressions > 0)
+    {
+        fprintf(stderr, "%d result(s) more than %.0f%% slower than %s\n",
+            regressions, options.threshold, path);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--filter NAME] [--max-depth N] [--time MS]\n"
+        "          [--baseline FILE] [--threshold PERCENT]\n", program);
+}
+
+int main(int argc, char* argv[])
+{
+    static const struct option long_options[] = {
+        {"filter", required_argument, NULL, 'f'},
+        {"max-depth", required_argument, NULL, 'd'},
+        {"time", required_argument, NULL, 't'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"threshold", required_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "f:d:t:b:T:", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+        case 'f':
+            options.filter = optarg;
+            break;
+        case 'd':
+            options.max_depth = atol(optarg);
+            break;
+        case 't':
+            options.target_ns = (uint64_t)atol(optarg) * 1000000;
+            break;
+        case 'b':
+            options.baseline = optarg;
+            break;
+        case 'T':
+            options.threshold = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(options.max_depth < 10 || options.target_ns == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    airs_protocol_init();
+    flightlist_init();
+
+    printf("benchmark,size,threads,ops,ns_per_op\n");
+    bench_alist("alist_get", ALIST_GET);
+    bench_alist("alist_add_remove", ALIST_ADD_REMOVE);
+    bench_alist("alist_mixed", ALIST_MIXED);
+    bench_eventring();
+    bench_flightlist();
+    if(!bench_linescan())
+    {
+        return 1;
+    }
+    bench_docommand();
+    // Forks, so it goes before anything here starts the scheduler
+    bench_reqtaxi_pass();
+    bench_reg_connect();
+    bench_journal();
+    if(!bench_takeoffqueue())
+    {
+        return 1;
+    }
+
+    return options.baseline != NULL ? compare_baseline(options.baseline) : 0;
+}
@@ -0,0 +1,156 @@
+// Handles connections to the admin listener.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "admin.h"
+#include "linereader.h"
+#include "outbuf.h"
+#include "metrics.h"
+#include "log.h"
+
+#define ADMIN_EVENTS (EPOLLIN | EPOLLRDHUP)
+
+#define ADMIN_ERR_UNKNOWN "ERR Unknown command\n"
+#define ADMIN_ERR_TOO_LONG "ERR Command too long\n"
+
+typedef struct {
+    reactor_handler handler;
+    reactor* owner;
+    int fd;
+    char peerIpAddress[INET_ADDRSTRLEN];
+    linereader reader;
+    outbuf out;
+} admin_connection;
+
+static void close_admin(admin_connection* conn)
+{
+    outbuf_set_blocked_hook(&conn->out, NULL, NULL);
+    outbuf_flush(&conn->out);
+    reactor_unwatch(conn->owner, conn->fd);
+    outbuf_destroy(&conn->out);
+    close(conn->fd);
+    LOG_INFO(conn->peerIpAddress, "admin disconnected");
+    free(conn);
+}
+
+static void send_text(admin_connection* conn, const char* text, size_t len)
+{
+    struct iovec part = { (void*)text, len };
+    outbuf_append(&conn->out, &part, 1);
+}
+
+static void do_admin_command(admin_connection* conn, char* line, size_t len)
+{
+    while(len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' '))
+    {
+        len--;
+    }
+    line[len] = '\0';
+
+    int format;
+    if(strcasecmp(line, "STATS") == 0)
+    {
+        format = METRICS_TEXT;
+    }
+    else if(strcasecmp(line, "STATS PROMETHEUS") == 0)
+    {
+        format = METRICS_PROMETHEUS;
+    }
+    else
+    {
+        send_text(conn, ADMIN_ERR_UNKNOWN, sizeof(ADMIN_ERR_UNKNOWN) - 1);
+        return;
+    }
+
+    size_t report_len;
+    char* report = metrics_render(format, &report_len);
+    send_text(conn, report, report_len);
+    free(report);
+}
+
+// Output buffer hook: wait for the socket to drain, or stop waiting
+static void on_admin_blocked(void* context, bool blocked)
+{
+    admin_connection* conn = context;
+    reactor_modify(conn->owner, conn->fd,
+        blocked ? ADMIN_EVENTS | EPOLLOUT : ADMIN_EVENTS, &conn->handler);
+}
+
+static void on_admin_event(void* context, uint32_t events)
+{
+    admin_connection* conn = context;
+
+    if(events & EPOLLOUT)
+    {
+        outbuf_flush(&conn->out);
+        if(!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        {
+            return;
+        }
+    }
+
+    ssize_t received = linereader_fill(&conn->reader, conn->fd);
+    if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return;
+    }
+    if(received <= 0)
+    {
+        close_admin(conn);
+        return;
+    }
+
+    char* line;
+    size_t len;
+    int status;
+    while((status = linereader_next(&conn->reader, &line, &len)) != LINE_NONE)
+    {
+        if(status == LINE_TOO_LONG)
+        {
+            send_text(conn, ADMIN_ERR_TOO_LONG, sizeof(ADMIN_ERR_TOO_LONG) - 1);
+            continue;
+        }
+        do_admin_command(conn, line, len);
+    }
+
+    outbuf_flush(&conn->out);
+}
+
+void launch_admin_handler(reactor* owner, int clientSocket,
+    struct sockaddr_in peerAddress)
+{
+    admin_connection* conn = malloc(sizeof(admin_connection));
+    if(conn == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        close(clientSocket);
+        return;
+    }
+
+    conn->owner = owner;
+    conn->fd = clientSocket;
+    linereader_init(&conn->reader);
+    outbuf_init(&conn->out, clientSocket);
+    conn->handler.callback = on_admin_event;
+    conn->handler.context = conn;
+    inet_ntop(AF_INET, &peerAddress.sin_addr, conn->peerIpAddress,
+    sizeof(conn->peerIpAddress));
+    outbuf_set_blocked_hook(&conn->out, on_admin_blocked, conn);
+
+    if(reactor_watch(owner, clientSocket, ADMIN_EVENTS, &conn->handler) != 0)
+    {
+        outbuf_destroy(&conn->out);
+        close(clientSocket);
+        free(conn);
+        return;
+    }
+
+    LOG_INFO(conn->peerIpAddress, "admin connected");
+}
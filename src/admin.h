@@ -0,0 +1,19 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <netinet/in.h>
+
+#include "reactor.h"
+
+// The admin listener serves operations tooling, separately from the
+// planes. It speaks the same line protocol:
+//
+//   STATS             every metric as text, ending with "END"
+//   STATS PROMETHEUS  the same in Prometheus exposition format, ending
+//                     with "# EOF"
+
+#define ADMIN_PORT "8081"
+
+void launch_admin_handler(reactor* owner, int clientSocket, struct sockaddr_in);
+
+#endif
@@ -2,11 +2,11 @@
 #define _AIRPLANE_H
 
 #include <stdio.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
-// The maximum length of a plane id
-
-#define PLANE_MAXID 20
+#include "outbuf.h"
+#include "flightid.h"
 
 // These are the valid states of an airplane. The numbers don't mean
 // anything, and just need to be all different. Note that a more "modern"
@@ -20,21 +20,48 @@
 #define PLANE_CLEAR 4
 #define PLANE_INAIR 5
 
+// Ticket value for a plane that is not in the taxi queue
+
+#define PLANE_NO_TICKET UINT64_MAX
+
+// A reference to a plane in the flight list: the slot it lives in and the
+// generation of that slot. Handles go stale once the plane is removed.
+
+typedef struct {
+    uint32_t index;
+    uint32_t generation;
+} plane_handle;
+
+// The parts of a plane only needed when replies are written or the plane
+// is torn down. They are kept apart from the rest so that the fields
+// every command looks at fit in one cache line (see planepool.c).
+
+struct connection;
+
+typedef struct airplane_cold {
+    int fd;
+    outbuf out;       // Replies waiting to be written to fd
+    struct connection* conn;      // Serving fd; NULL for a recovered plane
+    struct airplane* next_free;   // Pool free list, while the plane is unused
+} airplane_cold;
+
 // The struct to keep track of all information about an airplane in
-// the system.
+// the system. Airplanes are only made by the plane pool, which pairs
+// each one with its cold half.
 
 typedef struct airplane {
-    int state;
-    FILE *fp_send;
-    FILE *fp_recv;
-    char id[PLANE_MAXID+1];
+    _Alignas(64) atomic_int state;
     int  plane_number;
-    pthread_mutex_t mutex;
+    plane_handle handle;
+    uint64_t taxi_ticket;
+    flight_id id;
+    airplane_cold* cold;
 } airplane;
 
-// Basic initializer and destructor functions
+// Basic initializer and destructor functions. They work in place on a
+// plane from the pool.
 
-void airplane_init(airplane *plane, FILE *fp_send, FILE *fp_recv);
+void airplane_init(airplane *plane, int fd);
 int read_state(airplane* plane);
 void set_state(airplane* plane, int state);
 void airplane_destroy(airplane *plane);
@@ -8,87 +8,84 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <stdlib.h>
 
-#include "util.h"
+#include "linescan.h"
 #include "airplane.h"
 #include "airs_protocol.h"
 #include "flightlist.h"
 #include "takeoffqueue.h"
-#include "debug.h"
+#include "log.h"
+#include "metrics.h"
+
+#define TAXI_LIST_STACK_SIZE 1024
+
+#define ALREADY_REGISTERED "ERR Plane already registered as "
+
+// Every fixed reply, written out in full ahead of time so sending one is
+// a plain copy with no format parsing.
+static const reply replies[] = {
+#define REPLY_TEXT(name, text) { text "\n", sizeof(text) },
+    AIRS_REPLIES(REPLY_TEXT)
+#undef REPLY_TEXT
+};
+
 /************************************************************************
- * Call this response function if a command was accepted
+ * Queues one of the fixed replies (REPLY_OK, REPLY_ERR_...) on the
+ * plane's output buffer. It goes out with the rest of the batch.
  */
-void send_ok(airplane *plane) {
-    fprintf(plane->fp_send, "OK\n");
+void send_reply(airplane *plane, int which) {
+    struct iovec part = { (void *)replies[which].text, replies[which].len };
+    outbuf_append(&plane->cold->out, &part, 1);
 }
 
 /************************************************************************
- * Call this response function if an error can be described by a simple
- * string.
+ * Moves the plane from state "from" to "to" and writes one of the fixed
+ * replies to it right away, for messages that don't answer a command
+ * (TAKEOFF). A command that finds the plane in the new state has its reply
+ * go out after this message, never before. Returns false, sending nothing,
+ * if the plane has left "from" (a BYE) in the meantime.
  */
-void send_err(airplane *plane, char *desc) {
-    fprintf(plane->fp_send, "ERR %s\n", desc);
+bool send_reply_now(airplane *plane, int from, int to, int which) {
+    struct iovec part = { (void *)replies[which].text, replies[which].len };
+    return outbuf_write_now_setting(&plane->cold->out, &part, 1, &plane->state, from, to);
 }
 
 /************************************************************************
- * Call this response function if you want to embed a specific string
- * argument (sarg) into an error reply (which is now a format string).
+ * Queues "prefix", the given text and a newline as one reply.
  */
-void send_err_sarg(airplane *plane, char *fmtstring, char *sarg) {
-    fprintf(plane->fp_send, "ERR ");
-    fprintf(plane->fp_send, fmtstring, sarg);
-    fprintf(plane->fp_send, "\n");
-}
-
-static bool is_alphanumeric(char* rest)
-{
-    while (*rest != '\0') {
-        if (!isalnum(*rest)) {
-            return false; 
-        }
-        rest++;
-    }
-    return true;
-}
-
-bool hasPlaneID(airplane* plane, void* context)
-{
-    // don't need a cast in C, because C implicitly gains the type information, 
-    // regardless if the type info is correct, because C is unsafe like that
-    char* plane_id = context;
-    return strcmp(plane->id, plane_id) == 0;
-}
-
-static bool isInUse(char* plane_id)
-{
-    airplane *plane = find_plane(hasPlaneID, (void*)plane_id);
-    return plane != NULL;
+static void send_parts(airplane *plane, const char *prefix, size_t prefixlen,
+    const char *text, size_t len) {
+    struct iovec parts[] = {
+        { (void *)prefix, prefixlen },
+        { (void *)text, len },
+        { "\n", 1 },
+    };
+    outbuf_append(&plane->cold->out, parts, 3);
 }
 
 /************************************************************************
  * Handle the "REG" command.
  */
-static void cmd_reg(airplane *plane, char *rest) {
-    if(rest == NULL)
+static void cmd_reg(airplane *plane, const linescan *line) {
+    if(line->args == NULL)
     {
-        send_err(plane, "Please enter a valid registration ID\n");
+        send_reply(plane, REPLY_ERR_NO_ID);
         return;
     }
 
     if(read_state(plane) != PLANE_UNREG)
     {
-        char copy[PLANE_MAXID+1];
+        flight_id copy;
         if(pthread_mutex_lock(&flightlist_lock) != 0)
         {
             fprintf(stderr, "Could not lock mutex in gndcontrol-reg\n");
             return;
         }
 
-        memcpy(copy, plane->id, PLANE_MAXID+1);
+        copy = plane->id;
 
         if(pthread_mutex_unlock(&flightlist_lock) != 0)
         {
@@ -96,220 +93,252 @@ static void cmd_reg(airplane *plane, char *rest) {
             return;
         }
 
-        send_err_sarg(plane, "Plane already registered as %s", copy);
+        send_parts(plane, ALREADY_REGISTERED, sizeof(ALREADY_REGISTERED) - 1,
+            copy.text, copy.len);
         return;
     }
     
-    size_t length = strlen(rest);
+    size_t length = line->args_len;
     if(length == 0)
     {
-        send_err(plane, "REG missing flight id");
+        send_reply(plane, REPLY_ERR_MISSING_ID);
         return;
     } else if(length > PLANE_MAXID)
     {
-        send_err(plane, "Invalid flight id -- too long");
+        send_reply(plane, REPLY_ERR_ID_TOO_LONG);
         return;
     }
 
-    if(is_alphanumeric(rest))
+    if(line->args_alnum)
     {
-        if(pthread_mutex_lock(&flightlist_lock) != 0)
-        {
-            fprintf(stderr, "Could not lock mutex in gndcontrol-reg\n");
-            return;
-        }
-        
-        if(isInUse(rest))
+        flight_id id;
+        flight_id_set(&id, line->args, length);
+        if(!flightlist_register(plane, &id))
         {
-            send_err(plane, "ID already in use.\n");
-            if(pthread_mutex_unlock(&flightlist_lock) != 0)
-            {
-                fprintf(stderr, "Could not unlock mutex in gndcontrol-reg\n");
-                return;
-            }
-            return;            
-        }
-
-        strcpy(plane->id, rest);
-
-        if(pthread_mutex_unlock(&flightlist_lock) != 0)
-        {
-            fprintf(stderr, "Could not unlock mutex in gndcontrol-reg\n");
+            send_reply(plane, REPLY_ERR_ID_IN_USE);
             return;
         }
 
-        send_ok(plane);
-        set_state(plane, PLANE_ATTERMINAL);
+        // A plane that was in line before a restart is back in line. As
+        // with REQTAXI, the OK goes out before the scheduler can clear it.
+        set_state(plane, plane->taxi_ticket != PLANE_NO_TICKET ?
+            PLANE_TAXIING : PLANE_ATTERMINAL);
+        send_reply(plane, REPLY_OK);
+        report_registered(plane);
     }
     else
     {
-        send_err(plane, "Invalid flight id -- only alphanumeric characters allowec");
+        send_reply(plane, REPLY_ERR_ID_CHARS);
     }
 }
 
 /************************************************************************
  * Handle the "REQTAXI" command.
  */
-static void cmd_reqtaxi(airplane *plane) 
+static void cmd_reqtaxi(airplane *plane, const linescan *line)
 {
-    if(read_state(plane) == PLANE_ATTERMINAL)
-    {
-        enqueue(plane->id);
-        set_state(plane, PLANE_TAXIING);
-        send_ok(plane);
-    }
-    else
-    {
-        send_err(plane, "Plane is not at the terminal");
-    }
+    // The takeoff thread may clear the plane as soon as it is queued,
+    // so the state change and the OK have to happen first.
+    set_state(plane, PLANE_TAXIING);
+    send_reply(plane, REPLY_OK);
+    plane->taxi_ticket = enqueue(plane);
 }
 
 /************************************************************************
  * Handle the "REQPOS" command.
  */
-static void cmd_reqpos(airplane *plane)
+static void cmd_reqpos(airplane *plane, const linescan *line)
 {
-    if(plane->state == PLANE_TAXIING)
+    int index = find_position(plane->taxi_ticket);
+    //assert(index != -1); //in case of bug
+    if(index == -1)
     {
-        int index = find_position(plane->id);
-        //assert(index != -1); //in case of bug
-        if(index == -1)
-        {
-            DEBUG_PRINT("plane id doesn't exist: %s, plane number: %d, plane state: %d", 
-            plane->id, plane->plane_number, plane->state);
-        }
-        fprintf(plane->fp_send, "OK %d\n", index+1);       
-    }
-    else
-    {
-        send_err(plane, "REQPOS can only be issued when plane is taxiing");
+        LOG_DEBUG(plane->id.text, "not in the taxi queue, plane number %d, state %d",
+            plane->plane_number, plane->state);
     }
+    char number[16];
+    int len = snprintf(number, sizeof(number), "%d", index+1);
+    send_parts(plane, "OK ", 3, number, len);
 }
 
 /************************************************************************
  * Handle the "REQAHEAD" command.
  */
-static void cmd_reqahead(airplane *plane)
+static void cmd_reqahead(airplane *plane, const linescan *line)
 {
-    if(plane->state == PLANE_TAXIING)
+    // Most lists fit on the stack; a very long line of planes falls
+    // back to the heap, retrying in case it grew in between.
+    char stack_buffer[TAXI_LIST_STACK_SIZE];
+    char* taxi_list = stack_buffer;
+    size_t cap = sizeof(stack_buffer);
+    long len;
+    while((len = find_taxi_list(plane->taxi_ticket, taxi_list, cap)) > (long)cap)
     {
-        char* taxi_list = find_taxi_list(plane->id);
-        //assert(taxi_list != NULL);
-        fprintf(plane->fp_send, "OK %s\n", taxi_list == NULL ? "" : taxi_list);
-        free(taxi_list);
+        if(taxi_list != stack_buffer)
+        {
+            free(taxi_list);
+        }
+        cap = len;
+        taxi_list = malloc(cap);
+        if(taxi_list == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
     }
-    else
+
+    send_parts(plane, "OK ", 3, taxi_list, len < 0 ? 0 : len);
+    if(taxi_list != stack_buffer)
     {
-        send_err(plane, "REQAHEAD can only be issued when plane is taxiing");
+        free(taxi_list);
     }
-
 }
 
 /************************************************************************
  * Handle the "INAIR" command.
  */
-static void cmd_inair(airplane *plane)
+static void cmd_inair(airplane *plane, const linescan *line)
 {
-    if(read_state(plane) == PLANE_CLEAR)
-    {
-        set_state(plane, PLANE_INAIR);
-        signal_inair_condition();
-        printf("Plane %s is in air\n", plane->id);
-        fprintf(plane->fp_send, "NOTICE: Disconnecting from ground control -" 
-        "please connect to air control\n");
-    }
-    else
-    {
-        send_err(plane, "INAIR can only be issued when clear");
-    }
+    set_state(plane, PLANE_INAIR);
+    report_inair(plane->taxi_ticket);
+    LOG_INFO(plane->id.text, "in air");
+    send_reply(plane, REPLY_NOTICE_INAIR);
+    set_state(plane, PLANE_DONE);
 }
 
 /************************************************************************
  * Handle the "BYE" command.
  */
-static void cmd_bye(airplane *plane) {
+static void cmd_bye(airplane *plane, const linescan *line) {
     set_state(plane, PLANE_DONE);
 }
 
-static bool is_registered(airplane *plane)
+/************************************************************************
+ * The command table. Each command lists the states it may be issued in
+ * and the reply for any other state; a plane that isn't registered yet
+ * always gets REPLY_ERR_UNREGISTERED instead. Handlers only run once the
+ * state check has passed.
+ */
+
+#define STATE(s) (1u << (s))
+#define ANY_STATE (~0u)
+
+//  name      allowed states           reply otherwise            handler
+#define AIRS_COMMANDS(X) \
+    X(REG,      ANY_STATE,               0,                         cmd_reg) \
+    X(REQTAXI,  STATE(PLANE_ATTERMINAL), REPLY_ERR_NOT_AT_TERMINAL, cmd_reqtaxi) \
+    X(REQPOS,   STATE(PLANE_TAXIING),    REPLY_ERR_REQPOS_STATE,    cmd_reqpos) \
+    X(REQAHEAD, STATE(PLANE_TAXIING),    REPLY_ERR_REQAHEAD_STATE,  cmd_reqahead) \
+    X(INAIR,    STATE(PLANE_CLEAR),      REPLY_ERR_INAIR_STATE,     cmd_inair) \
+    X(BYE,      ANY_STATE,               0,                         cmd_bye)
+
+typedef struct {
+    int opcode;
+    const char *name;
+    size_t len;
+    unsigned states;
+    int wrong_state;
+    void (*handler)(airplane *plane, const linescan *line);
+} command;
+
+enum {
+#define COMMAND_OPCODE(name, states, wrong_state, handler) CMD_##name,
+    AIRS_COMMANDS(COMMAND_OPCODE)
+#undef COMMAND_OPCODE
+    CMD_COUNT
+};
+
+static const command commands[CMD_COUNT] = {
+#define COMMAND_ENTRY(name, states, wrong_state, handler) \
+    { CMD_##name, #name, sizeof(#name) - 1, states, wrong_state, handler },
+    AIRS_COMMANDS(COMMAND_ENTRY)
+#undef COMMAND_ENTRY
+};
+
+// Commands are found by a perfect hash of the first word: its length plus
+// its first and last characters picks a distinct slot for every command.
+// airs_protocol_init fills the slots and refuses to start on a collision,
+// so a new command that collides has to come with a new hash.
+
+#define COMMAND_SLOTS 16
+
+static const command *command_slots[COMMAND_SLOTS];
+
+// Latency histogram of each command, by opcode
+static int command_histograms[CMD_COUNT];
+
+static const char *const command_labels[CMD_COUNT] = {
+#define COMMAND_LABEL(name, states, wrong_state, handler) "command=\"" #name "\"",
+    AIRS_COMMANDS(COMMAND_LABEL)
+#undef COMMAND_LABEL
+};
+
+static size_t command_hash(const char *word, size_t len)
 {
-    return read_state(plane) != PLANE_UNREG;
+    return (len + (unsigned char)word[0] + (unsigned char)word[len - 1]) &
+        (COMMAND_SLOTS - 1);
+}
+
+void airs_protocol_init(void)
+{
+    for(int i = 0; i < CMD_COUNT; ++i)
+    {
+        size_t slot = command_hash(commands[i].name, commands[i].len);
+        if(command_slots[slot] != NULL)
+        {
+            fprintf(stderr, "Commands %s and %s hash to the same slot\n",
+                command_slots[slot]->name, commands[i].name);
+            exit(1);
+        }
+        command_slots[slot] = &commands[i];
+        command_histograms[i] = metrics_histogram("command_duration",
+            command_labels[i], "Time to handle a command");
+    }
+}
+
+static const command *find_command(const char *word, size_t len)
+{
+    const command *c = command_slots[command_hash(word, len)];
+    if(c == NULL || c->len != len || memcmp(c->name, word, len) != 0)
+    {
+        return NULL;
+    }
+    return c;
 }
 
 /************************************************************************
- * Parses and performs the actions in the line of text (command and
- * optionally arguments) passed in as "command".
+ * Parses and performs the actions in the "len" bytes of text at "line"
+ * (command and optionally arguments). The line is parsed where it lies:
+ * it must be writable, line[len] may be overwritten with a NUL, and it
+ * needs LINESCAN_SLACK readable bytes from line[len] on.
  */
-void docommand(airplane *plane, char *command) {
-    char *saveptr;
-    char *cmd = strtok_r(command, " \t\r\n", &saveptr);
-    if (cmd == NULL) 
+void docommand(airplane *plane, char *line, size_t len) {
+    uint64_t started = metrics_now();
+    linescan scan;
+    if (!linescan_parse(&scan, line, len))
     {  // Empty line (no command) -- just ignore line
         return;
     }
 
-    // Get arguments (everything after command, trimmed)
-    char *args = strtok_r(NULL, "\r\n", &saveptr);
-    if (args != NULL) 
+    const command *c = find_command(scan.cmd, scan.cmd_len);
+    if (c == NULL)
     {
-        args = trim(args);
+        LOG_DEBUG(plane->id.text, "unknown command from plane %d", plane->plane_number);
+        metrics_count(COUNTER_UNKNOWN_COMMANDS);
+        send_reply(plane, REPLY_ERR_UNKNOWN);
+        return;
     }
 
-    // TODO: Only some commands are recognized below. Must include all
-    if (strcmp(cmd, "REG") == 0) 
-    {
-        cmd_reg(plane, args);
-    } 
-    else if (strcmp(cmd, "REQTAXI") == 0) 
-    {
-        if( !is_registered(plane) )
-        {
-            send_err(plane, "Unregistered plane -- cannot process request");
-        }
-        else
-        {
-            cmd_reqtaxi(plane);
-        }
-    } 
-    else if (strcmp(cmd, "REQPOS") == 0)
+    int state = read_state(plane);
+    if (!(c->states & STATE(state)))
     {
-        if( !is_registered(plane) )
-        {
-            send_err(plane, "Unregistered plane -- cannot process request");
-        }
-        else
-        {
-            cmd_reqpos(plane);
-        }
-    } 
-    else if(strcmp(cmd, "REQAHEAD") == 0)
-    {
-        if( !is_registered(plane) )
-        {
-            send_err(plane, "Unregistered plane -- cannot process request");
-        }
-        else
-        {
-            cmd_reqahead(plane);
-        }
-    } 
-    else if(strcmp(cmd, "INAIR") == 0)
-    {
-        if( !is_registered(plane) )
-        {
-            send_err(plane, "Unregistered plane -- cannot process request");
-        }
-        else
-        {
-            cmd_inair(plane);
-        }
-    } 
-    else if (strcmp(cmd, "BYE") == 0) 
-    {
-        cmd_bye(plane);
-    } else 
+        metrics_count(COUNTER_REJECTED_COMMANDS);
+        send_reply(plane, state == PLANE_UNREG ? REPLY_ERR_UNREGISTERED : c->wrong_state);
+    }
+    else
     {
-        DEBUG_PRINT("cmd: %s, args: %s", cmd, args == NULL ? "" : args);
-        send_err(plane, "Unknown command");
+        c->handler(plane, &scan);
     }
+
+    metrics_record(command_histograms[c->opcode], metrics_now() - started);
 }
@@ -4,14 +4,48 @@
 #define _AIRS_COMMANDS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #define PORT "8080"
 
-void send_ok(airplane *plane);
-void send_err(airplane *plane, char *desc);
-bool hasPlaneID(airplane* plane, void* context);
-void send_err_sarg(airplane *plane, char *fmtstring, char *sarg);
+// Every reply that never changes, without its trailing newline. The list
+// is expanded into the REPLY_ names below and into the preformatted reply
+// table in airs_protocol.c.
 
-void docommand(airplane *plane, char *command);
+#define AIRS_REPLIES(X) \
+    X(REPLY_OK, "OK") \
+    X(REPLY_ERR_UNKNOWN, "ERR Unknown command") \
+    X(REPLY_ERR_TOO_LONG, "ERR Command too long") \
+    X(REPLY_ERR_UNREGISTERED, "ERR Unregistered plane -- cannot process request") \
+    X(REPLY_ERR_NO_ID, "ERR Please enter a valid registration ID") \
+    X(REPLY_ERR_MISSING_ID, "ERR REG missing flight id") \
+    X(REPLY_ERR_ID_TOO_LONG, "ERR Invalid flight id -- too long") \
+    X(REPLY_ERR_ID_CHARS, "ERR Invalid flight id -- only alphanumeric characters allowed") \
+    X(REPLY_ERR_ID_IN_USE, "ERR ID already in use.") \
+    X(REPLY_ERR_NOT_AT_TERMINAL, "ERR Plane is not at the terminal") \
+    X(REPLY_ERR_REQPOS_STATE, "ERR REQPOS can only be issued when plane is taxiing") \
+    X(REPLY_ERR_REQAHEAD_STATE, "ERR REQAHEAD can only be issued when plane is taxiing") \
+    X(REPLY_ERR_INAIR_STATE, "ERR INAIR can only be issued when clear") \
+    X(REPLY_NOTICE_INAIR, "NOTICE: Disconnecting from ground control -please connect to air control") \
+    X(REPLY_TAKEOFF, "TAKEOFF")
+
+enum {
+#define REPLY_NAME(name, text) name,
+    AIRS_REPLIES(REPLY_NAME)
+#undef REPLY_NAME
+    REPLY_COUNT
+};
+
+// A reply as the bytes that go on the wire
+typedef struct {
+    const char *text;
+    size_t len;
+} reply;
+
+void airs_protocol_init(void);
+void send_reply(airplane *plane, int which);
+bool send_reply_now(airplane *plane, int from, int to, int which);
+
+void docommand(airplane *plane, char *line, size_t len);
 
 #endif  // _AIRS_COMMANDS_H
@@ -1,133 +1,630 @@
 #include <stdio.h>
-#include <pthread.h>
-#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "clienthandler.h"
 #include "airplane.h"
 #include "flightlist.h"
 #include "airs_protocol.h"
+#include "reactor.h"
+#include "takeoffqueue.h"
+#include "linereader.h"
+#include "log.h"
+#include "metrics.h"
 
-typedef struct{
-    struct sockaddr_in peerAddress;
-    int planeNumber;
-} ThreadInfo;
+// Commands are short, so a fixed receive buffer per connection is plenty;
+// a longer line is dropped and answered with an error.
+//
+// Clients may pipeline: every complete line received is run in order and
+// the replies are gathered in the plane's output buffer, then written
+// together. At most PIPELINE_DEPTH commands run between writes. If the
+// client isn't reading its replies, the connection pauses: the remaining
+// lines wait in the receive buffer and nothing more is read until the
+// socket drains.
+//
+// A connection's socket is watched with EPOLLONESHOT, and an event only
+// schedules the connection as a work item on the reactor pool, so any
+// worker may run it. The schedule state makes sure only one worker runs
+// it at a time, so its commands still run in order. An event that comes
+// in while it runs is saved in "pending" and makes the worker queue it
+// again. The socket is rearmed at the end of each run.
+//
+// On an io_uring reactor a connection is run by completion instead, and
+// always on its owner's thread. One receive at a time is kept armed; its
+// completion feeds the line reader and runs the pipeline, and the next
+// receive is only started if the connection isn't paused. Replies are
+// sent by the owner's ring too (see outbuf_set_sender), and a finished
+// send resumes a paused connection. Operations and posted items hold
+// references, so the connection is freed when the last of them is done.
 
-//callback function
-bool hasPlaneNumber(airplane* plane, void* context)
+#define CLIENT_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+#define PIPELINE_DEPTH 32
+
+#define PIPELINE_CLOSED 0   // The plane is done; the connection must close
+#define PIPELINE_EMPTY 1    // Every complete line has been run
+#define PIPELINE_FULL 2     // PIPELINE_DEPTH lines ran and more are waiting
+
+#define CONN_IDLE 0         // Waiting for its socket
+#define CONN_QUEUED 1       // In a reactor's deque
+#define CONN_RUNNING 2      // A worker is running it
+#define CONN_RERUN 3        // Running, and an event came in meanwhile
+#define CONN_CLOSED 4
+
+typedef struct connection {
+    reactor_handler handler;
+    reactor* owner;
+    int fd;
+    airplane* plane;
+    char peerIpAddress[INET_ADDRSTRLEN];
+    linereader reader;
+    atomic_bool paused;   // Replies are backed up; stop reading
+    atomic_int schedule;  // CONN_IDLE, CONN_QUEUED, ...
+    atomic_uint pending;  // Events not yet handled
+    work_item work;       // Runs the connection on the pool
+    work_item retire;     // Frees it on the owning reactor
+    // io_uring only
+    reactor_op recv_op;
+    reactor_op send_op;
+    work_item send_item;  // Starts a send handed over by another thread
+    char* send_data;      // Bytes the output buffer handed over
+    size_t send_len;
+    size_t send_done;
+    bool receiving;       // recv_op is armed
+    atomic_int refs;
+} connection;
+
+static bool uses_uring(connection* conn)
 {
-    int planeNumber = (int)(intptr_t)context;
-    return planeNumber == plane->plane_number;
+    return reactor_backend(conn->owner) == REACTOR_URING;
 }
 
-void* pthread_start(void* arg)
+static void get_connection(connection* conn)
 {
-    ThreadInfo* threadInfo = (ThreadInfo*)arg;
-    int planeNumber = threadInfo->planeNumber;
-    struct sockaddr_in peerAddress = threadInfo->peerAddress;
-    free(threadInfo);
+    atomic_fetch_add(&conn->refs, 1);
+}
 
-    char peerIpAddressBuffer[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &peerAddress.sin_addr, peerIpAddressBuffer, 
-    sizeof(peerIpAddressBuffer));
+static void put_connection(connection* conn)
+{
+    if(atomic_fetch_sub(&conn->refs, 1) == 1)
+    {
+        free(conn);
+    }
+}
 
-    pthread_t id = pthread_self();
+static bool is_closed(connection* conn)
+{
+    return atomic_load(&conn->schedule) == CONN_CLOSED;
+}
 
-    printf("Got connection from %s (client %ld)\n", peerIpAddressBuffer, id);
+static void close_connection(connection* conn)
+{
+    atomic_store(&conn->schedule, CONN_CLOSED);
 
-    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    // Last replies (like the INAIR notice) go out if the socket takes them
+    if(uses_uring(conn))
+    {
+        // The socket must be named in a submission before it is closed
+        outbuf_flush(&conn->plane->cold->out);
+        reactor_cancel(conn->owner, &conn->recv_op);
+        reactor_cancel(conn->owner, &conn->send_op);
+        reactor_flush(conn->owner);
+    }
+    else
     {
-        fprintf(stderr, "Could not lock in pthread_start\n");
-        return (void*)-1;
+        outbuf_set_blocked_hook(&conn->plane->cold->out, NULL, NULL);
+        outbuf_flush(&conn->plane->cold->out);
+        reactor_unwatch(conn->owner, conn->fd);
     }
 
-    //using callback function here
-    airplane* plane = find_plane(hasPlaneNumber, (void*)(intptr_t)planeNumber);
+    // Removing the plane hands it back to the pool, so copy out what is
+    // still needed first. It leaves the flight list before its LEAVE is
+    // posted: a clearance racing with this either went out before the
+    // removal or fails its lookup in send_takeoff, so no TAKEOFF is sent
+    // after the scheduler has applied the LEAVE and reopened the runway.
+    uint64_t ticket = conn->plane->taxi_ticket;
+    int plane_number = conn->plane->plane_number;
+    flight_id id = conn->plane->id;
+    flightlist_removeplane(conn->plane->handle);
+    if(ticket != PLANE_NO_TICKET)
+    {
+        leave_queue(ticket);
+    }
+    if(!flight_id_empty(&id))
+    {
+        report_disconnected(&id, plane_number);
+    }
 
-    if(pthread_mutex_unlock(&flightlist_lock) != 0)
+    metrics_count(COUNTER_DISCONNECTS);
+    LOG_INFO(conn->peerIpAddress, "plane %d disconnected", plane_number);
+
+    if(uses_uring(conn))
+    {
+        put_connection(conn);
+    }
+    else
     {
-        fprintf(stderr, "Could not unlock in pthread_start\n");
-        return (void*)-1;
+        // The owning reactor may still have an event for it in hand
+        reactor_retire(conn->owner, &conn->retire);
     }
+}
 
-    char *lineptr = NULL;
-    size_t linesize = 0;
+/*
+ Runs up to PIPELINE_DEPTH of the complete lines sitting in the receive
+ buffer through docommand, in order.
+*/
+static int process_lines(connection* conn)
+{
+    char* line;
+    size_t len;
+    int status;
 
-    while (read_state(plane) != PLANE_DONE) 
+    for(int run = 0; run < PIPELINE_DEPTH; ++run)
     {
-        //getline will allocate memory for the line buffer
-        if (getline(&lineptr, &linesize, plane->fp_recv) < 0) 
+        status = linereader_next(&conn->reader, &line, &len);
+        if(status == LINE_NONE)
+        {
+            return PIPELINE_EMPTY;
+        }
+        if(status == LINE_TOO_LONG)
+        {
+            send_reply(conn->plane, REPLY_ERR_TOO_LONG);
+            continue;
+        }
+
+        docommand(conn->plane, line, len);
+        if(read_state(conn->plane) == PLANE_DONE)
         {
-            // Failed getline means the client disconnected
-            break;
+            return PIPELINE_CLOSED;
         }
-        docommand(plane, lineptr);
     }
-    flightlist_removeplane(plane->plane_number);
 
-    printf("Client %ld disconnected.\n", id);
-    free(lineptr);
-    //success
-    return (void*)0;
+    return PIPELINE_FULL;
 }
 
-void launch_client_handler(int clientSocket, struct sockaddr_in peerAddress)
+/*
+ Output buffer hook: wait for the socket to drain, or stop waiting. While
+ the connection is paused only the drain is waited for.
+*/
+static void on_output_blocked(void* context, bool blocked)
 {
-    int fd_send = dup(clientSocket);
-    if(fd_send == -1)
+    connection* conn = context;
+    uint32_t events = CLIENT_EVENTS;
+    if(blocked)
     {
-        perror("dup failed");
-        exit(1);
+        events = atomic_load(&conn->paused) ? EPOLLOUT | EPOLLONESHOT :
+            CLIENT_EVENTS | EPOLLOUT;
     }
-    int fd_recv = clientSocket;
+    reactor_modify(conn->owner, conn->fd, events, &conn->handler);
+}
 
-    FILE* fsend = fdopen(fd_send, "w");
-    if(fsend == NULL)
+static void set_paused(connection* conn, bool paused)
+{
+    if(atomic_load(&conn->paused) != paused)
     {
-        perror("fsend failed");
-        close(fd_recv);
-        close(fd_send);
-        exit(1);
+        atomic_store(&conn->paused, paused);
+        outbuf_notify(&conn->plane->cold->out);
     }
+}
 
-    if (setvbuf(fsend, NULL, _IOLBF, 0) != 0) 
+/*
+ Runs the buffered commands a group at a time, writing each group's
+ replies before starting the next. Pauses the connection if the replies
+ back up. Returns false once the connection has been closed.
+*/
+static bool run_pipeline(connection* conn)
+{
+    while(true)
     {
-        fprintf(stderr, "Couldn't enable line bufferent for ???. Sad.\n");
+        int status = process_lines(conn);
+        if(status == PIPELINE_CLOSED)
+        {
+            close_connection(conn);
+            return false;
+        }
+
+        bool sent = outbuf_flush(&conn->plane->cold->out);
+        if(status == PIPELINE_EMPTY)
+        {
+            set_paused(conn, false);
+            return true;
+        }
+        if(!sent)
+        {
+            set_paused(conn, true);
+            return true;
+        }
     }
+}
 
-    FILE* frecv = fdopen(fd_recv, "r");
-    if(frecv == NULL)
+/*
+ Handles the events a run picked up. Returns false once the connection
+ has been closed.
+*/
+static bool handle_events(connection* conn, uint32_t events)
+{
+    if(atomic_load(&conn->paused))
     {
-        perror("frecv failed");
-        fclose(fsend);
-        close(fd_recv);
-        close(fd_send);
-        exit(1);
+        // Finish the lines already received before reading more
+        if(!outbuf_flush(&conn->plane->cold->out))
+        {
+            return true;
+        }
+        if(!run_pipeline(conn))
+        {
+            return false;
+        }
+        if(atomic_load(&conn->paused))
+        {
+            return true;
+        }
+    }
+    else if(events & EPOLLOUT)
+    {
+        outbuf_flush(&conn->plane->cold->out);
+    }
+
+    if(!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+    {
+        return true;
+    }
+
+    ssize_t received = linereader_fill(&conn->reader, conn->fd);
+
+    if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return true;
+    }
+
+    if(received <= 0)
+    {
+        // A failed or empty read means the client disconnected
+        close_connection(conn);
+        return false;
+    }
+
+    return run_pipeline(conn);
+}
+
+// Work item: one run of a connection, on whichever worker took it
+static void run_connection(void* context)
+{
+    connection* conn = context;
+    atomic_store(&conn->schedule, CONN_RUNNING);
+    if(!handle_events(conn, atomic_exchange(&conn->pending, 0)))
+    {
+        return;
+    }
+
+    // Rearm before letting go, so an event can't slip in unseen between
+    // the two
+    outbuf_notify(&conn->plane->cold->out);
+    int state = CONN_RUNNING;
+    if(!atomic_compare_exchange_strong(&conn->schedule, &state, CONN_IDLE))
+    {
+        atomic_store(&conn->schedule, CONN_QUEUED);
+        reactor_submit(&conn->work);
+    }
+}
+
+// Reactor callback: note the events and get the connection run
+static void on_client_event(void* context, uint32_t events)
+{
+    connection* conn = context;
+    atomic_fetch_or(&conn->pending, events);
+
+    while(true)
+    {
+        int state = atomic_load(&conn->schedule);
+        if(state == CONN_IDLE)
+        {
+            if(atomic_compare_exchange_strong(&conn->schedule, &state, CONN_QUEUED))
+            {
+                reactor_submit(&conn->work);
+                return;
+            }
+        }
+        else if(state == CONN_RUNNING)
+        {
+            if(atomic_compare_exchange_strong(&conn->schedule, &state, CONN_RERUN))
+            {
+                return;
+            }
+        }
+        else
+        {
+            return;   // Already going to run, or closed
+        }
+    }
+}
+
+static void start_recv(connection* conn)
+{
+    if(conn->receiving)
+    {
+        return;
+    }
+    conn->receiving = true;
+    get_connection(conn);
+    reactor_recv(conn->owner, conn->fd, linereader_space(&conn->reader), &conn->recv_op);
+}
+
+// Completion of recv_op: take the bytes, run them, receive again
+static void on_received(void* context, int result, uint32_t flags)
+{
+    connection* conn = context;
+    conn->receiving = false;
+
+    char* data = reactor_recv_buffer(conn->owner, flags);
+    if(data != NULL && result > 0 && !is_closed(conn))
+    {
+        linereader_feed(&conn->reader, data, result);
+    }
+    reactor_recv_release(conn->owner, flags);
+
+    if(!is_closed(conn))
+    {
+        if(result == -ENOBUFS || result == -EINTR)
+        {
+            start_recv(conn);
+        }
+        else if(result <= 0)
+        {
+            // A failed or empty read means the client disconnected
+            close_connection(conn);
+        }
+        else if(run_pipeline(conn) && !atomic_load(&conn->paused))
+        {
+            start_recv(conn);
+        }
+    }
+    put_connection(conn);
+}
+
+static void start_send(connection* conn)
+{
+    reactor_send(conn->owner, conn->fd, conn->send_data + conn->send_done,
+        conn->send_len - conn->send_done, &conn->send_op);
+}
+
+// Completion of send_op: finish a short send, or go on to what's next
+static void on_sent(void* context, int result, uint32_t flags)
+{
+    connection* conn = context;
+    if(is_closed(conn))
+    {
+        free(conn->send_data);
+        put_connection(conn);
+        return;
     }
 
-    if (setvbuf(frecv, NULL, _IOLBF, 0) != 0) 
+    if(result > 0 && conn->send_done + result < conn->send_len)
     {
-        fprintf(stderr, "Couldn't enable line bufferent for ???. Sad.\n");
+        conn->send_done += result;
+        start_send(conn);
+        return;
     }
 
-    airplane plane;
-    airplane_init(&plane, fsend, frecv);
+    // A send that fails means the client is gone; the receive sees it too
+    bool drained = outbuf_sent(&conn->plane->cold->out, conn->send_data, result <= 0);
+    if(drained && atomic_load(&conn->paused) &&
+        run_pipeline(conn) && !atomic_load(&conn->paused))
+    {
+        start_recv(conn);
+    }
+    put_connection(conn);
+}
 
-    flightlist_addplane(plane);
+// Work item: a send handed over by another thread, on the owner
+static void run_send(void* context)
+{
+    connection* conn = context;
+    if(is_closed(conn))
+    {
+        free(conn->send_data);
+        put_connection(conn);
+        return;
+    }
+    start_send(conn);
+}
 
-    ThreadInfo* threadInfo = malloc(sizeof(ThreadInfo));
-    if(threadInfo == NULL)
+// Output buffer sender. Runs on whichever thread flushed.
+static void on_send(void* context, char* data, size_t len)
+{
+    connection* conn = context;
+    conn->send_data = data;
+    conn->send_len = len;
+    conn->send_done = 0;
+    get_connection(conn);
+    if(reactor_is_current(conn->owner))
+    {
+        start_send(conn);
+    }
+    else
+    {
+        reactor_post(conn->owner, &conn->send_item);
+    }
+}
+
+/*
+ Makes a connection, and a plane in the flight list, for a new socket.
+ Returns NULL if there is no memory for it.
+*/
+static connection* create_connection(reactor* owner, int clientSocket)
+{
+    connection* conn = malloc(sizeof(connection));
+    if(conn == NULL)
     {
         fprintf(stderr, "Out of memory.\n");
+        return NULL;
+    }
+
+    // Replies already go out one write per batch; Nagle would only hold
+    // a TAKEOFF back until the previous reply had been acknowledged
+    int one = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    plane_handle handle = flightlist_addplane(clientSocket);
+
+    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "Could not lock in create_connection\n");
+        exit(1);
+    }
+
+    conn->plane = flightlist_get(handle);
+    conn->plane->cold->conn = conn;
+
+    if(pthread_mutex_unlock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "Could not unlock in create_connection\n");
+        exit(1);
+    }
+
+    conn->owner = owner;
+    conn->fd = clientSocket;
+    linereader_init(&conn->reader);
+    atomic_init(&conn->paused, false);
+    atomic_init(&conn->schedule, CONN_IDLE);
+    atomic_init(&conn->pending, 0);
+    conn->work.run = run_connection;
+    conn->work.context = conn;
+    conn->retire.run = free;
+    conn->retire.context = conn;
+    conn->handler.callback = on_client_event;
+    conn->handler.context = conn;
+    conn->recv_op.callback = on_received;
+    conn->recv_op.context = conn;
+    conn->send_op.callback = on_sent;
+    conn->send_op.context = conn;
+    conn->send_item.run = run_send;
+    conn->send_item.context = conn;
+    conn->receiving = false;
+    atomic_init(&conn->refs, 1);
+    return conn;
+}
+
+/*
+ Starts serving a connection: the first receive on an io_uring reactor,
+ or a watch for "events". Returns false, having dropped the connection
+ and its plane, if the reactor won't have it.
+*/
+static bool start_connection(connection* conn, uint32_t events)
+{
+    if(uses_uring(conn))
+    {
+        outbuf_set_sender(&conn->plane->cold->out, on_send, conn);
+        start_recv(conn);
+    }
+    else
+    {
+        outbuf_set_blocked_hook(&conn->plane->cold->out, on_output_blocked, conn);
+        if(reactor_watch(conn->owner, conn->fd, events, &conn->handler) != 0)
+        {
+            flightlist_removeplane(conn->plane->handle);
+            free(conn);
+            return false;
+        }
+    }
+    return true;
+}
+
+void launch_client_handler(reactor* owner, int clientSocket,
+    struct sockaddr_in peerAddress)
+{
+    connection* conn = create_connection(owner, clientSocket);
+    if(conn == NULL)
+    {
+        close(clientSocket);
         return;
     }
-    threadInfo->peerAddress = peerAddress;
-    threadInfo->planeNumber = plane.plane_number;
 
-    pthread_t pthread;
-    pthread_create(&pthread, NULL, &pthread_start, threadInfo);
-    pthread_detach(pthread); 
-}
\ No newline at end of file
+    inet_ntop(AF_INET, &peerAddress.sin_addr, conn->peerIpAddress,
+    sizeof(conn->peerIpAddress));
+
+    LOG_INFO(conn->peerIpAddress, "connected as plane %d", conn->plane->plane_number);
+
+    if(start_connection(conn, CLIENT_EVENTS))
+    {
+        metrics_count(COUNTER_CONNECTS);
+    }
+}
+
+/*
+ Fills in what a new instance of the server needs to carry on with the
+ plane's connection. Returns false for a plane that has none. Only
+ meaningful with every reactor paused (reactor_pause_all), and called
+ with flightlist_lock held.
+*/
+bool client_export(airplane* plane, client_state* state)
+{
+    connection* conn = plane->cold->conn;
+    if(conn == NULL)
+    {
+        return false;
+    }
+
+    state->fd = conn->fd;
+    memcpy(state->peer, conn->peerIpAddress, sizeof(state->peer));
+    state->id = plane->id;
+    state->state = read_state(plane);
+    state->ticket = plane->taxi_ticket;
+    state->input = conn->reader.buffer + conn->reader.start;
+    state->input_len = conn->reader.used - conn->reader.start;
+    state->discarding = conn->reader.discarding;
+    state->output_len = outbuf_peek(&conn->plane->cold->out, &state->output);
+    state->paused = atomic_load(&conn->paused);
+    return true;
+}
+
+/*
+ Carries on with a connection the instance this one replaced was
+ serving, as client_export described it: the plane gets its flight id
+ and state back, and the input and replies it hadn't got to. Its place
+ in line is up to takeoff_adopt. Called before the reactors run. Returns
+ the plane, or NULL if the connection had to be dropped.
+*/
+airplane* client_adopt(reactor* owner, const client_state* state)
+{
+    connection* conn = create_connection(owner, state->fd);
+    if(conn == NULL)
+    {
+        close(state->fd);
+        return NULL;
+    }
+    airplane* plane = conn->plane;
+
+    memcpy(conn->peerIpAddress, state->peer, sizeof(conn->peerIpAddress));
+    conn->peerIpAddress[sizeof(conn->peerIpAddress) - 1] = '\0';
+    if(!flight_id_empty(&state->id) && !flightlist_register(plane, &state->id))
+    {
+        LOG_WARN(state->id.text, "flight id taken during upgrade, plane %d dropped",
+            plane->plane_number);
+        flightlist_removeplane(plane->handle);
+        free(conn);
+        return NULL;
+    }
+    set_state(plane, state->state);
+
+    linereader_feed(&conn->reader, state->input, state->input_len);
+    conn->reader.discarding = state->discarding;
+    struct iovec output = { (void*)state->output, state->output_len };
+    outbuf_append(&plane->cold->out, &output, 1);
+    atomic_store(&conn->paused, state->paused);
+
+    // The first run writes what was waiting and picks up where the old
+    // instance stopped
+    if(!start_connection(conn, CLIENT_EVENTS | EPOLLOUT))
+    {
+        return NULL;
+    }
+    LOG_INFO(conn->peerIpAddress, "handed over as plane %d", plane->plane_number);
+    return plane;
+}
@@ -1,6 +1,34 @@
 #ifndef CLIENT_HANDLER_H
 #define CLIENT_HANDLER_H
 
-void launch_client_handler(int clientSocket, struct sockaddr_in);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "airplane.h"
+#include "reactor.h"
+
+// A connection as it is handed to a new instance of the server (see
+// upgrade.h). "input" and "output" point into the connection they were
+// exported from.
+typedef struct {
+    int fd;
+    char peer[INET_ADDRSTRLEN];
+    flight_id id;             // Empty if the plane hadn't registered
+    int state;                // PLANE_*
+    uint64_t ticket;          // In the old instance, for the order
+    const char* input;        // Received, not run yet
+    size_t input_len;
+    bool discarding;          // The input is the rest of an overlong line
+    const char* output;       // Replies not written yet
+    size_t output_len;
+    bool paused;
+} client_state;
+
+void launch_client_handler(reactor* owner, int clientSocket, struct sockaddr_in);
+bool client_export(airplane* plane, client_state* state);
+airplane* client_adopt(reactor* owner, const client_state* state);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+// Vyukov-style bounded queue, specialised to a single consumer.
+
+#include <sched.h>
+
+#include "eventring.h"
+
+#define MASK (EVENTRING_CAPACITY - 1)
+
+void eventring_init(eventring* ring)
+{
+    for(size_t i = 0; i < EVENTRING_CAPACITY; ++i)
+    {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+}
+
+/*
+ Adds an event. Never fails: if the ring is full, waits for the consumer
+ to free the cell this producer claimed.
+*/
+void eventring_push(eventring* ring, const takeoff_event* event)
+{
+    size_t pos = atomic_fetch_add_explicit(&ring->tail, 1, memory_order_relaxed);
+    eventring_cell* cell = &ring->cells[pos & MASK];
+
+    // The cell is free once the consumer has moved its sequence up to pos
+    while(atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos)
+    {
+        sched_yield();
+    }
+
+    cell->event = *event;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+}
+
+/*
+ Takes the oldest event. Returns false if there is none yet, which includes
+ a producer that has claimed the next cell but not finished writing it.
+ Only the consumer thread may call this.
+*/
+bool eventring_pop(eventring* ring, takeoff_event* event)
+{
+    eventring_cell* cell = &ring->cells[ring->head & MASK];
+    if(atomic_load_explicit(&cell->sequence, memory_order_acquire) != ring->head + 1)
+    {
+        return false;
+    }
+
+    *event = cell->event;
+    atomic_store_explicit(&cell->sequence, ring->head + EVENTRING_CAPACITY,
+        memory_order_release);
+    ring->head++;
+    return true;
+}
+
+/*
+ True if the consumer would find nothing to pop. Only the consumer thread
+ may call this.
+*/
+bool eventring_empty(eventring* ring)
+{
+    eventring_cell* cell = &ring->cells[ring->head & MASK];
+    return atomic_load_explicit(&cell->sequence, memory_order_acquire) != ring->head + 1;
+}
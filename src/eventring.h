@@ -0,0 +1,58 @@
+#ifndef EVENT_RING_H
+#define EVENT_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "airplane.h"
+
+// Bounded lock-free multi-producer/single-consumer ring of takeoff events.
+// Connection threads (and the timer thread) push; only the takeoff
+// scheduler pops. Each cell carries a sequence number that says whether
+// it is free for the producer that claimed it or full for the consumer,
+// so a push is one fetch-add on the tail plus a release store, and a pop
+// is an acquire load plus a plain store. Events from any one producer
+// come out in the order it pushed them. A full ring makes producers yield
+// until the scheduler catches up.
+
+#define EVENTRING_CAPACITY 4096   // Must be a power of two
+
+#define EVENT_ENQUEUE 0   // Plane joined the line under "ticket"
+#define EVENT_INAIR 1     // Plane holding "ticket" took off
+#define EVENT_LEAVE 2     // Plane holding "ticket" disconnected
+#define EVENT_TICK 3      // A runway's separation time is over
+#define EVENT_STOP 4      // Shut the scheduler down
+#define EVENT_REGISTER 5  // Plane registered "id" (journal only)
+#define EVENT_DISCONNECT 6   // Plane that had "id" disconnected (journal only)
+#define EVENT_ATTACH 7    // Plane came back for recovered "ticket"
+#define EVENT_PAUSE 8     // Stop after this pass until takeoff_resume
+
+typedef struct {
+    int type;
+    uint64_t ticket;
+    int wake;                  // EVENT_ENQUEUE only
+    uint64_t joined;           // EVENT_ENQUEUE only: metrics_now() at enqueue
+    flight_id id;              // EVENT_ENQUEUE, EVENT_REGISTER, EVENT_DISCONNECT
+    plane_handle plane;        // EVENT_ENQUEUE, EVENT_ATTACH
+    int plane_number;          // EVENT_REGISTER, EVENT_DISCONNECT
+} takeoff_event;
+
+typedef struct {
+    atomic_size_t sequence;
+    takeoff_event event;
+} eventring_cell;
+
+typedef struct {
+    eventring_cell cells[EVENTRING_CAPACITY];
+    _Alignas(64) atomic_size_t tail;   // Next cell a producer claims
+    _Alignas(64) size_t head;          // Next cell the consumer reads
+} eventring;
+
+void eventring_init(eventring* ring);
+void eventring_push(eventring* ring, const takeoff_event* event);
+bool eventring_pop(eventring* ring, takeoff_event* event);
+bool eventring_empty(eventring* ring);
+
+#endif
@@ -0,0 +1,153 @@
+// Hash index keyed on flight id, used by the flight list so that REG
+// uniqueness checks and takeoff lookups don't have to scan every plane,
+// and by the journal for the registrations it keeps.
+
+// Linear probing keeps a lookup to one or two cache lines, and deletion
+// shifts later entries back instead of leaving tombstones, so the table
+// never degrades under register/disconnect churn.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flighthash.h"
+
+#define FLIGHTHASH_MIN_CAPACITY 64
+
+static flighthash_slot* alloc_slots(size_t capacity)
+{
+    flighthash_slot* slots = calloc(capacity, sizeof(flighthash_slot));
+    if(slots == NULL)
+    {
+        perror("flighthash - allocating slots");
+        exit(1);
+    }
+    return slots;
+}
+
+static const flight_id* key(const flighthash* h, const void* item)
+{
+    return (const flight_id*)((const char*)item + h->key_offset);
+}
+
+static void place(flighthash* h, uint32_t hash, void* item)
+{
+    size_t mask = h->capacity - 1;
+    size_t i = hash & mask;
+    while(h->slots[i].item != NULL)
+    {
+        i = (i + 1) & mask;
+    }
+    h->slots[i].hash = hash;
+    h->slots[i].item = item;
+}
+
+static void resize(flighthash* h, size_t capacity)
+{
+    flighthash_slot* old = h->slots;
+    size_t old_capacity = h->capacity;
+
+    h->capacity = capacity;
+    h->slots = alloc_slots(h->capacity);
+    for(size_t i = 0; i < old_capacity; ++i)
+    {
+        if(old[i].item != NULL)
+        {
+            place(h, old[i].hash, old[i].item);
+        }
+    }
+    free(old);
+}
+
+void flighthash_init(flighthash* h, size_t key_offset)
+{
+    h->key_offset = key_offset;
+    h->capacity = FLIGHTHASH_MIN_CAPACITY;
+    h->count = 0;
+    h->slots = alloc_slots(h->capacity);
+}
+
+void* flighthash_find(flighthash* h, const flight_id* id)
+{
+    uint32_t hash = id->hash;
+    size_t mask = h->capacity - 1;
+
+    for(size_t i = hash & mask; h->slots[i].item != NULL; i = (i + 1) & mask)
+    {
+        if(h->slots[i].hash == hash && flight_id_equal(key(h, h->slots[i].item), id))
+        {
+            return h->slots[i].item;
+        }
+    }
+    return NULL;
+}
+
+// Grows the table ahead of time so it holds "count" items without
+// rehashing again
+void flighthash_reserve(flighthash* h, size_t count)
+{
+    size_t capacity = h->capacity;
+    while(2 * count > capacity)
+    {
+        capacity *= 2;
+    }
+    if(capacity != h->capacity)
+    {
+        resize(h, capacity);
+    }
+}
+
+void flighthash_insert(flighthash* h, void* item)
+{
+    // Keep the load factor at or below 1/2 so probe runs stay short
+    flighthash_reserve(h, h->count + 1);
+
+    place(h, key(h, item)->hash, item);
+    h->count++;
+}
+
+void flighthash_remove(flighthash* h, void* item)
+{
+    size_t mask = h->capacity - 1;
+    size_t i = key(h, item)->hash & mask;
+
+    while(h->slots[i].item != item)
+    {
+        if(h->slots[i].item == NULL)
+        {
+            return;  // Not indexed
+        }
+        i = (i + 1) & mask;
+    }
+
+    // Backward-shift deletion: pull forward any entry in the following
+    // run whose home slot is at or before the hole.
+    size_t hole = i;
+    size_t j = i;
+    while(1)
+    {
+        j = (j + 1) & mask;
+        if(h->slots[j].item == NULL)
+        {
+            break;
+        }
+
+        size_t home = h->slots[j].hash & mask;
+        if(((j - home) & mask) >= ((j - hole) & mask))
+        {
+            h->slots[hole] = h->slots[j];
+            hole = j;
+        }
+    }
+
+    h->slots[hole].item = NULL;
+    h->count--;
+}
+
+void flighthash_destroy(flighthash* h)
+{
+    free(h->slots);
+    h->slots = NULL;
+    h->capacity = 0;
+    h->count = 0;
+}
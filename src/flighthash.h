@@ -0,0 +1,35 @@
+#ifndef FLIGHT_HASH_H
+#define FLIGHT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flightid.h"
+
+// Open-addressing hash index from flight id to the item that holds it,
+// such as an airplane. Keys are not copied: the index points at the
+// flight_id found "key_offset" bytes into each item, so an item must be
+// removed before its id changes or it is freed. Slots keep the id's
+// precomputed hash, so a probe only touches an item whose hash matches.
+// Not thread-safe on its own.
+
+typedef struct {
+    uint32_t hash;
+    void* item;        // NULL marks an empty slot
+} flighthash_slot;
+
+typedef struct {
+    flighthash_slot* slots;
+    size_t capacity;   // Always a power of two
+    size_t count;
+    size_t key_offset; // Where the flight_id is in an item
+} flighthash;
+
+void flighthash_init(flighthash* h, size_t key_offset);
+void* flighthash_find(flighthash* h, const flight_id* id);
+void flighthash_reserve(flighthash* h, size_t count);
+void flighthash_insert(flighthash* h, void* item);
+void flighthash_remove(flighthash* h, void* item);
+void flighthash_destroy(flighthash* h);
+
+#endif
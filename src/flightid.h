@@ -0,0 +1,75 @@
+#ifndef FLIGHT_ID_H
+#define FLIGHT_ID_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// The maximum length of a plane id
+
+#define PLANE_MAXID 20
+
+// A flight id stored inline as a fixed-width key: the text is zero-padded
+// to FLIGHT_ID_SIZE bytes, so two ids are equal exactly when their words
+// are, and the hash is worked out once when the id is set. Copying one is
+// a plain struct copy.
+
+#define FLIGHT_ID_WORDS 3
+#define FLIGHT_ID_SIZE (FLIGHT_ID_WORDS * 8)
+
+typedef struct {
+    union {
+        char text[FLIGHT_ID_SIZE];       // NUL-terminated and zero-padded
+        uint64_t words[FLIGHT_ID_WORDS];
+    };
+    uint32_t hash;
+    uint32_t len;
+} flight_id;
+
+_Static_assert(PLANE_MAXID < FLIGHT_ID_SIZE, "a flight id must fit with its terminator");
+
+// One step of the multiplicative hash the ids use, for anything else
+// that hashes a run of words
+static inline uint64_t flight_id_mix(uint64_t h, uint64_t word)
+{
+    return (h ^ word) * 0x9e3779b97f4a7c15ull;
+}
+
+static inline uint32_t flight_id_hash_words(const uint64_t* words)
+{
+    uint64_t h = 0;
+    for(int i = 0; i < FLIGHT_ID_WORDS; ++i)
+    {
+        h = flight_id_mix(h, words[i]);
+    }
+    return (uint32_t)(h >> 32);
+}
+
+// Sets the id from text of at most PLANE_MAXID bytes (not checked)
+static inline void flight_id_set(flight_id* id, const char* text, size_t len)
+{
+    memset(id->words, 0, sizeof(id->words));
+    memcpy(id->text, text, len);
+    id->len = len;
+    id->hash = flight_id_hash_words(id->words);
+}
+
+static inline void flight_id_clear(flight_id* id)
+{
+    flight_id_set(id, "", 0);
+}
+
+static inline bool flight_id_empty(const flight_id* id)
+{
+    return id->len == 0;
+}
+
+static inline bool flight_id_equal(const flight_id* a, const flight_id* b)
+{
+    return a->hash == b->hash &&
+        ((a->words[0] ^ b->words[0]) | (a->words[1] ^ b->words[1]) |
+         (a->words[2] ^ b->words[2])) == 0;
+}
+
+#endif
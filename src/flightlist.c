@@ -1,103 +1,322 @@
 #include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "flightlist.h"
-#include "alist.h"
 #include "airplane.h"
+#include "flighthash.h"
+#include "planepool.h"
 
-static alist list; 
+#define DEF_SLOTS 64
+#define NO_FREE_SLOT UINT32_MAX
+
+/*
+ Planes recovered from the journal at startup are added with no
+ connection (a descriptor of -1). Each holds its flight id, and its
+ ticket if it was taxiing, until a plane that registers the same id
+ takes both over, or the grace period after startup ends and
+ flightlist_drop_recovered removes it.
+
+ Planes live in a slot table. A handle names a slot by index and carries
+ the generation the slot had when the plane was added; removing the plane
+ bumps the generation, so an old handle can never reach whatever plane
+ reuses the slot later. Freed slots are chained through next_free.
+*/
+typedef struct {
+    airplane* plane;
+    uint32_t generation;
+    uint32_t next_free;
+} slot;
+
+static slot* slots;
+static uint32_t slot_capacity;
+static uint32_t slots_used;     // High-water mark of slots ever handed out
+static uint32_t free_head = NO_FREE_SLOT;
+static int next_plane_number;
+static flighthash id_index;
 
 pthread_mutex_t flightlist_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void airplane_free(void *plane)
+// Must be called with flightlist_lock held
+static void airplane_free(airplane* plane)
 {
-    airplane_destroy((airplane*)plane);
-    free(plane);
+    airplane_destroy(plane);
+    planepool_free(plane);
 }
 
 void flightlist_init(void)
 {
-    alist_init(&list, airplane_free);
+    slots = calloc(DEF_SLOTS, sizeof(slot));
+    if(slots == NULL)
+    {
+        perror("flightlist_init");
+        exit(1);
+    }
+    slot_capacity = DEF_SLOTS;
+    flighthash_init(&id_index, offsetof(airplane, id));
 }
 
 void flightlist_destroy(void)
 {
     pthread_mutex_destroy(&flightlist_lock);
-    alist_destroy(&list);    
+    flighthash_destroy(&id_index);
+    for(uint32_t i = 0; i < slots_used; ++i)
+    {
+        if(slots[i].plane != NULL)
+        {
+            airplane_free(slots[i].plane);
+        }
+    }
+    free(slots);
+    slots = NULL;
+    planepool_destroy();
 }
 
-void flightlist_addplane(airplane plane)
+// Must be called with flightlist_lock held
+static uint32_t allocate_slot(void)
 {
-    airplane* newPlane = malloc(sizeof(airplane));
-    if(newPlane == NULL)
+    if(free_head != NO_FREE_SLOT)
     {
-        perror("cannot add plane. Out of memory");       
-        exit(1);
+        uint32_t index = free_head;
+        free_head = slots[index].next_free;
+        return index;
+    }
+
+    if(slots_used == slot_capacity)
+    {
+        slot* newslots = realloc(slots, 2*slot_capacity*sizeof(slot));
+        if(newslots == NULL)
+        {
+            perror("flightlist - growing slot table");
+            exit(1);
+        }
+        memset(newslots + slot_capacity, 0, slot_capacity*sizeof(slot));
+        slots = newslots;
+        slot_capacity *= 2;
     }
 
-    //copy plane into new plane
-    memcpy(newPlane, &plane, sizeof(plane));
+    return slots_used++;
+}
 
+/*
+ Adds a plane for the connection on fd, built in place in the plane
+ pool, assigns it the next plane number and returns the handle that
+ refers to it from now on.
+*/
+plane_handle flightlist_addplane(int fd)
+{
     if(pthread_mutex_lock(&flightlist_lock) != 0)
     {
         fprintf(stderr, "cannot lock mutex in add");
         exit(1);
     }
-    alist_add(&list, newPlane);
+
+    airplane* newPlane = planepool_alloc();
+    airplane_init(newPlane, fd);
+
+    uint32_t index = allocate_slot();
+    slot* s = &slots[index];
+    s->plane = newPlane;
+    if(s->generation == 0)
+    {
+        s->generation = 1;  // Generation 0 is never valid
+    }
+
+    newPlane->handle.index = index;
+    newPlane->handle.generation = s->generation;
+    newPlane->plane_number = ++next_plane_number;
+    plane_handle handle = newPlane->handle;
+
     if(pthread_mutex_unlock(&flightlist_lock) != 0)
     {
         fprintf(stderr, "cannot unlock mutex in add");
         exit(1);
     }    
+
+    return handle;
 }
 
 /*
- plane number does not correspond to the index in the list, because planes can 
- be added or deleted. That's why the loop is necessary.
-*/ 
-airplane* find_plane(FindCallback callback, void* context)
+ Returns the plane a handle refers to, or NULL if the handle is stale.
+ The caller must hold flightlist_lock.
+*/
+airplane* flightlist_get(plane_handle handle)
 {
+    if(handle.index >= slots_used)
+    {
+        return NULL;
+    }
+
+    slot* s = &slots[handle.index];
+    if(s->generation != handle.generation)
+    {
+        return NULL;
+    }
+
+    return s->plane;
+}
+
+static bool is_recovered(const airplane* plane)
+{
+    return plane->cold->fd < 0;
+}
 
-    int size = alist_size(&list);
+// Must be called with flightlist_lock held
+static void remove_plane(airplane* plane)
+{
+    if(!flight_id_empty(&plane->id))
+    {
+        flighthash_remove(&id_index, plane);
+    }
 
-    for(int i = 0; i < size; ++i)
+    slot* s = &slots[plane->handle.index];
+    s->plane = NULL;
+    s->generation++;
+    if(s->generation == 0)
+    {
+        s->generation = 1;
+    }
+    s->next_free = free_head;
+    free_head = plane->handle.index;
+
+    airplane_free(plane);
+}
+
+/*
+ Adds a plane recovered from the journal: registered as "id", with no
+ connection, and waiting under "ticket" unless that is PLANE_NO_TICKET.
+*/
+plane_handle flightlist_add_recovered(const flight_id* id, uint64_t ticket)
+{
+    plane_handle handle = flightlist_addplane(-1);
+
+    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "cannot lock mutex in add recovered");
+        exit(1);
+    }
+
+    airplane* plane = flightlist_get(handle);
+    plane->id = *id;
+    plane->taxi_ticket = ticket;
+    set_state(plane, ticket != PLANE_NO_TICKET ? PLANE_TAXIING : PLANE_ATTERMINAL);
+    flighthash_insert(&id_index, plane);
+
+    if(pthread_mutex_unlock(&flightlist_lock) != 0)
     {
-        void* p = alist_get(&list, i);
-        airplane* plane = (airplane*)p;
-        if(callback(plane, context))
+        fprintf(stderr, "cannot unlock mutex in add recovered");
+        exit(1);
+    }
+
+    return handle;
+}
+
+/*
+ Removes the recovered plane holding "id", if it is still waiting for
+ its connection. Returns whether there was one.
+*/
+bool flightlist_drop_recovered(const flight_id* id)
+{
+    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "cannot lock mutex in drop recovered");
+        exit(1);
+    }
+
+    airplane* plane = flighthash_find(&id_index, id);
+    bool dropped = plane != NULL && is_recovered(plane);
+    if(dropped)
+    {
+        remove_plane(plane);
+    }
+
+    if(pthread_mutex_unlock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "cannot unlock mutex in drop recovered");
+        exit(1);
+    }
+
+    return dropped;
+}
+
+/*
+ Returns the plane in the first used slot at or after *cursor and moves
+ *cursor past it, or NULL when there are no more. Start from 0. Must be
+ called with flightlist_lock held.
+*/
+airplane* flightlist_next(uint32_t* cursor)
+{
+    while(*cursor < slots_used)
+    {
+        airplane* plane = slots[(*cursor)++].plane;
+        if(plane != NULL)
         {
             return plane;
         }
     }
-
     return NULL;
 }
 
-void flightlist_removeplane(int plane_number)
+/*
+ Looks up a registered plane by flight id through the hash index. The
+ caller must hold flightlist_lock.
+*/
+airplane* flightlist_find_id(const flight_id* id)
+{
+    return flighthash_find(&id_index, id);
+}
+
+/*
+ Gives the plane its flight id, unless another plane already has it.
+ The check and the update happen under one lock so that two planes can't
+ race to register the same id. If the id is held by a plane recovered
+ from the journal, this plane takes its place, and its ticket.
+*/
+bool flightlist_register(airplane* plane, const flight_id* id)
 {
     if(pthread_mutex_lock(&flightlist_lock) != 0)
     {
-        fprintf(stderr, "cannot lock mutex in remove");
+        fprintf(stderr, "cannot lock mutex in register");
         exit(1);
     }
 
-    int size = alist_size(&list);
+    airplane* holder = flighthash_find(&id_index, id);
+    if(holder != NULL && is_recovered(holder))
+    {
+        plane->taxi_ticket = holder->taxi_ticket;
+        remove_plane(holder);
+        holder = NULL;
+    }
 
-    for(int i = 0; i < size; ++i)
+    bool registered = holder == NULL;
+    if(registered)
     {
-        void* p = alist_get(&list, i);
-        airplane* plane = (airplane*)p;
-        if(plane->plane_number == plane_number)
-        {
-            alist_remove(&list, i);
-            if(pthread_mutex_unlock(&flightlist_lock) != 0)
-            {
-                fprintf(stderr, "cannot unlock mutex in remove");
-                exit(1);
-            } 
-            return;
-        }
+        plane->id = *id;
+        flighthash_insert(&id_index, plane);
+    }
+
+    if(pthread_mutex_unlock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "cannot unlock mutex in register");
+        exit(1);
+    }
+
+    return registered;
+}
+
+void flightlist_removeplane(plane_handle handle)
+{
+    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "cannot lock mutex in remove");
+        exit(1);
+    }
+
+    airplane* plane = flightlist_get(handle);
+    if(plane != NULL)
+    {
+        remove_plane(plane);
     }
 
     if(pthread_mutex_unlock(&flightlist_lock) != 0)
@@ -105,4 +324,4 @@ void flightlist_removeplane(int plane_number)
         fprintf(stderr, "cannot unlock mutex in remove");
         exit(1);
     } 
-}
\ No newline at end of file
+}
@@ -2,20 +2,24 @@
 #define FLIGHT_LIST_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "airplane.h"
 
-typedef bool (*FindCallback) (airplane*, void *);
-
 //exporting global variable
 extern pthread_mutex_t flightlist_lock;
 
 void flightlist_init(void);
 
 void flightlist_destroy(void);
-void flightlist_addplane(airplane plane);
-airplane* find_plane(FindCallback callback, void* context);
-void flightlist_removeplane(int plane_number);
+plane_handle flightlist_addplane(int fd);
+airplane* flightlist_get(plane_handle handle);
+airplane* flightlist_find_id(const flight_id* id);
+airplane* flightlist_next(uint32_t* cursor);
+bool flightlist_register(airplane* plane, const flight_id* id);
+void flightlist_removeplane(plane_handle handle);
+plane_handle flightlist_add_recovered(const flight_id* id, uint64_t ticket);
+bool flightlist_drop_recovered(const flight_id* id);
 
-#endif
\ No newline at end of file
+#endif
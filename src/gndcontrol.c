@@ -4,6 +4,8 @@
 // to the airs_protocol module which will handle the actual communication
 // protocol between clients (airplanes) and the server.
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,16 +17,28 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 #include "airplane.h"
 #include "airs_protocol.h"
 #include "clienthandler.h"
+#include "admin.h"
 #include "flightlist.h"
 #include "takeoffqueue.h"
+#include "reactor.h"
+#include "timers.h"
+#include "separation.h"
+#include "log.h"
+#include "upgrade.h"
 
 int create_listener(char *port) {
     int sock_fd;
-    if ((sock_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0) 
+    if ((sock_fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) 
     {
         perror("socket");
         return -1;
@@ -80,34 +94,409 @@ int create_listener(char *port) {
     return sock_fd;
 }
 
-/************************************************************************
- * Part 1 main: Only 1 airplane, doing I/O via stdin and stdout.
- */
+/*
+ Every plane holds a socket open for as long as it is on the ground, so
+ the default soft descriptor limit (often 1024) caps the airport size.
+ Raise it as far as the hard limit allows.
+*/
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        perror("getrlimit");
+        return;
+    }
+
+    limit.rlim_cur = limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        perror("setrlimit");
+    }
+}
+
+/*
+ A shard is one worker core's share of the server: its own SO_REUSEPORT
+ listener, its own reactor, and every connection the kernel hands to that
+ listener. Shared state (flight list, takeoff queue) is protected by the
+ locks inside those modules. An idle shard steals connections that are
+ waiting to run on a busy one (see reactor.h); that is the only way
+ shards interact. With --io uring, a shard whose reactor got an io_uring
+ accepts with one multishot operation and keeps its connections.
+*/
+typedef struct {
+    reactor* reactor;
+    int listener;
+    reactor_handler accept_handler;
+    reactor_op accept_op;     // Multishot accept, on an io_uring reactor
+    pthread_t thread;
+} shard;
+
+// The admin listener lives on shard 0's reactor
+typedef struct {
+    reactor* reactor;
+    int listener;
+    reactor_handler accept_handler;
+} admin_listener;
+
+/*
+ Accepts the next pending connection on a non-blocking listener. Returns
+ -1 once there are none left.
+*/
+static int accept_next(int listener, struct sockaddr_in* peerAddress)
+{
+    while(1)
+    {
+        socklen_t peerAddressLength = (socklen_t)sizeof(*peerAddress);
+        int clientSocket = accept4(listener, (struct sockaddr*)peerAddress,
+            &peerAddressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientSocket >= 0)
+        {
+            return clientSocket;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+            errno != ECONNABORTED)
+        {
+            perror("accept");
+        }
+        if(errno != EINTR && errno != ECONNABORTED)
+        {
+            return -1;
+        }
+    }
+}
+
+static void on_listener_ready(void* context, uint32_t events)
+{
+    shard* s = context;
+    struct sockaddr_in peerAddress;
+    int clientSocket;
+
+    while((clientSocket = accept_next(s->listener, &peerAddress)) >= 0)
+    {
+        launch_client_handler(s->reactor, clientSocket, peerAddress);
+    }
+}
+
+// Completion of the multishot accept on an io_uring reactor
+static void on_accepted(void* context, int result, uint32_t flags)
+{
+    shard* s = context;
+    if(!(flags & REACTOR_MORE))
+    {
+        reactor_accept(s->reactor, s->listener, &s->accept_op);
+    }
+    if(result < 0)
+    {
+        if(result != -ECONNABORTED && result != -EINTR)
+        {
+            fprintf(stderr, "accept: %s\n", strerror(-result));
+        }
+        return;
+    }
+
+    struct sockaddr_in peerAddress;
+    socklen_t peerAddressLength = (socklen_t)sizeof(peerAddress);
+    if(getpeername(result, (struct sockaddr*)&peerAddress, &peerAddressLength) != 0)
+    {
+        memset(&peerAddress, 0, sizeof(peerAddress));
+    }
+    launch_client_handler(s->reactor, result, peerAddress);
+}
+
+static void on_admin_ready(void* context, uint32_t events)
+{
+    admin_listener* a = context;
+    struct sockaddr_in peerAddress;
+    int clientSocket;
+
+    while((clientSocket = accept_next(a->listener, &peerAddress)) >= 0)
+    {
+        launch_admin_handler(a->reactor, clientSocket, peerAddress);
+    }
+}
+
+static void* shard_start(void* arg)
+{
+    shard* s = arg;
+    reactor_run(s->reactor);
+    return NULL;
+}
+
+/*
+ Sets up a shard listening on "listener", handed over by the instance
+ this one replaced, or on a new listener if that is -1.
+*/
+static int shard_init(shard* s, int io, int listener)
+{
+    // queue is created when you call listen(). That is done in create_listener
+    s->listener = listener >= 0 ? listener : create_listener(PORT);
+    if(s->listener == -1)
+    {
+        return -1;
+    }
+
+    int flags = fcntl(s->listener, F_GETFL, 0);
+    if(flags < 0 || fcntl(s->listener, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("fcntl");
+        close(s->listener);
+        return -1;
+    }
+
+    s->reactor = reactor_create(io);
+    if(reactor_backend(s->reactor) == REACTOR_URING)
+    {
+        s->accept_op.callback = on_accepted;
+        s->accept_op.context = s;
+        reactor_accept(s->reactor, s->listener, &s->accept_op);
+        return 0;
+    }
+
+    s->accept_handler.callback = on_listener_ready;
+    s->accept_handler.context = s;
+    if(reactor_watch(s->reactor, s->listener, EPOLLIN, &s->accept_handler) != 0)
+    {
+        reactor_destroy(s->reactor);
+        close(s->listener);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int admin_init(admin_listener* a, reactor* r, char* port, int listener)
+{
+    a->listener = listener >= 0 ? listener : create_listener(port);
+    if(a->listener == -1)
+    {
+        return -1;
+    }
+
+    int flags = fcntl(a->listener, F_GETFL, 0);
+    if(flags < 0 || fcntl(a->listener, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("fcntl");
+        close(a->listener);
+        return -1;
+    }
+
+    a->reactor = r;
+    a->accept_handler.callback = on_admin_ready;
+    a->accept_handler.context = a;
+    if(reactor_watch(r, a->listener, EPOLLIN, &a->accept_handler) != 0)
+    {
+        close(a->listener);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--workers N] [--runways N] [--separation SECONDS]\n"
+        "          [--separation-file PATH] [--admin-port PORT] [--io epoll|uring]\n"
+        "          [--journal DIR] [--journal-grace SECONDS]\n"
+        "SIGUSR2 upgrades the server in place (see upgrade.h).\n",
+        program);
+}
+
 int main(int argc, char *argv[]) 
 {
-    int listener = create_listener(PORT);
-    if(listener == -1)
+    upgrade_init(argc, argv);
+
+    // One shard per core: the shards are the whole worker pool
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers < 1)
+    {
+        workers = 1;
+    }
+    int runways = 1;
+    int separation = 4;
+    const char* separation_file = NULL;
+    char* admin_port = ADMIN_PORT;
+    int io = REACTOR_EPOLL;
+    const char* journal_dir = NULL;
+    int journal_grace = 10;
+    int upgrade_fd = -1;
+
+    static const struct option options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"runways", required_argument, NULL, 'r'},
+        {"separation", required_argument, NULL, 's'},
+        {"separation-file", required_argument, NULL, 'S'},
+        {"admin-port", required_argument, NULL, 'a'},
+        {"io", required_argument, NULL, 'i'},
+        {"journal", required_argument, NULL, 'j'},
+        {"journal-grace", required_argument, NULL, 'g'},
+        {"upgrade-fd", required_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "w:r:s:S:a:i:j:g:", options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+        case 'w':
+            workers = atoi(optarg);
+            if(workers < 1)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            runways = atoi(optarg);
+            if(runways < 1)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            separation = atoi(optarg);
+            if(separation < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':
+            separation_file = optarg;
+            break;
+        case 'a':
+            admin_port = optarg;
+            break;
+        case 'i':
+            if(strcmp(optarg, "epoll") == 0)
+            {
+                io = REACTOR_EPOLL;
+            }
+            else if(strcmp(optarg, "uring") == 0)
+            {
+                io = REACTOR_URING;
+            }
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'j':
+            journal_dir = optarg;
+            break;
+        case 'g':
+            journal_grace = atoi(optarg);
+            if(journal_grace < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'U':
+            upgrade_fd = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Started by an upgrade: the old instance's listeners decide the shards
+    int* inherited = NULL;
+    int admin_inherited = -1;
+    if(upgrade_fd >= 0)
+    {
+        if(upgrade_receive(upgrade_fd, &inherited, &workers, &admin_inherited) != 0)
+        {
+            return 1;
+        }
+    }
+
+    shard* shards = calloc(workers, sizeof(shard));
+    reactor** reactors = calloc(workers, sizeof(reactor*));
+    int* listeners = calloc(workers, sizeof(int));
+    if(shards == NULL || reactors == NULL || listeners == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    bool upgradable = true;
+    for(int i = 0; i < workers; ++i)
+    {
+        if(shard_init(&shards[i], io, inherited != NULL ? inherited[i] : -1) != 0)
+        {
+            return 1;
+        }
+        reactors[i] = shards[i].reactor;
+        listeners[i] = shards[i].listener;
+        upgradable = upgradable && reactor_backend(shards[i].reactor) == REACTOR_EPOLL;
+    }
+    free(inherited);
+
+    admin_listener admin;
+    if(admin_init(&admin, shards[0].reactor, admin_port, admin_inherited) != 0)
+    {
+        return 1;
+    }
+
+    separation_init((uint64_t)separation * 1000);
+    if(separation_file != NULL && separation_load(separation_file) != 0)
     {
         return 1;
     }
 
+    raise_fd_limit();
+    log_init();
+    airs_protocol_init();
+    timers_init();
     flightlist_init();
     init_takeOff();
-    takeoff_thread_init();
-    int clientSocket;
+    if(journal_dir != NULL && takeoff_recover(journal_dir, journal_grace) != 0)
+    {
+        return 1;
+    }
+    if(upgrade_fd >= 0)
+    {
+        upgrade_adopt(reactors, workers);
+    }
+    takeoff_thread_init(runways);
+    upgrade_listen(shards[0].reactor, listeners, workers, admin.listener, upgradable);
 
-    struct sockaddr_in peerAddress;
-    socklen_t peerAddressLength = (socklen_t)sizeof(peerAddress);
-    // queue is created when you call listen(). THat is done in create_listener
-    while((clientSocket = accept(listener, (struct sockaddr*)&peerAddress, 
-            &peerAddressLength)) != -1)
+    // Shard 0 runs on the main thread; every other shard gets its own.
+    for(int i = 1; i < workers; ++i)
     {
-        launch_client_handler(clientSocket, peerAddress);
+        if(pthread_create(&shards[i].thread, NULL, shard_start, &shards[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create worker thread");
+            exit(1);
+        }
     }
 
-    flightlist_destroy();
+    shard_start(&shards[0]);
+
+    for(int i = 1; i < workers; ++i)
+    {
+        pthread_join(shards[i].thread, NULL);
+    }
+
+    for(int i = 0; i < workers; ++i)
+    {
+        reactor_destroy(shards[i].reactor);
+        shutdown(shards[i].listener, SHUT_RD);
+        close(shards[i].listener);
+    }
+    close(admin.listener);
+    free(listeners);
+    free(reactors);
+    free(shards);
+
     takeOffDestroy();
-    shutdown(listener, SHUT_RD);
-    close(listener);
+    timers_destroy();
+    flightlist_destroy();
+    log_destroy();
     return 0;
 }
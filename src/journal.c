@@ -0,0 +1,770 @@
+// The journal module: a write-ahead log of registrations and the taxi
+// queue, with group commit and periodic snapshots.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "flighthash.h"
+#include "metrics.h"
+
+#define JOURNAL_FILE "journal"
+#define SNAPSHOT_FILE "snapshot"
+#define SNAPSHOT_TEMP "snapshot.tmp"
+#define SNAPSHOT_MAGIC "GCSNAP01"
+
+// Journal length that makes the writer compact it into a snapshot
+#define JOURNAL_COMPACT_RECORDS (1 << 20)
+
+#define STAGE_MIN_CAPACITY 256
+
+typedef struct {
+    char magic[8];
+    uint32_t entry_size;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t lsn;              // Last journal record the snapshot includes
+    uint64_t checksum;         // Over the fields above and every entry
+} snapshot_header;
+
+typedef struct {
+    char id[FLIGHT_ID_SIZE];
+    uint32_t id_len;
+    uint32_t owner;            // Plane number, 0 if recovered
+    uint64_t ticket;
+} snapshot_entry;
+
+_Static_assert(sizeof(snapshot_header) == 40, "snapshot header is 40 bytes on disk");
+_Static_assert(sizeof(snapshot_entry) == 40, "snapshot entries are 40 bytes on disk");
+
+// The durable state as the writer sees it: one entry per registered
+// flight id, indexed by id->hash in the same table the flight list uses
+typedef struct {
+    flight_id id;
+    uint64_t ticket;
+    uint32_t owner;
+} image_entry;
+
+typedef flighthash image;
+
+static struct {
+    int dir_fd;
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t work;       // Records pending, or stopping
+    pthread_cond_t durable;    // durable_lsn moved
+
+    // Appending thread only
+    journal_record* staged;
+    size_t staged_count;
+    size_t staged_cap;
+    uint64_t next_lsn;
+
+    // Under lock
+    journal_record* pending;
+    size_t pending_count;
+    size_t pending_cap;
+    uint64_t committed_lsn;    // Last record handed to the writer
+    uint64_t durable_lsn;      // Last record synced
+    bool stopping;
+
+    // Writer only
+    journal_record* writing;
+    size_t writing_cap;
+    image state;
+    uint64_t journal_records;  // In the journal file since the snapshot
+
+    int commit_histogram;
+} journal;
+
+static void lock(void)
+{
+    if(pthread_mutex_lock(&journal.lock) != 0)
+    {
+        fprintf(stderr, "Could not lock journal");
+        exit(1);
+    }
+}
+
+static void unlock(void)
+{
+    if(pthread_mutex_unlock(&journal.lock) != 0)
+    {
+        fprintf(stderr, "Could not unlock journal");
+        exit(1);
+    }
+}
+
+static void* allocate(void* old, size_t size)
+{
+    void* data = realloc(old, size);
+    if(data == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return data;
+}
+
+static uint32_t record_checksum(const journal_record* r)
+{
+    uint64_t words[5];
+    memcpy(words, r, sizeof(words));
+    uint64_t h = 0xc2b2ae3d27d4eb4full;
+    for(int i = 0; i < 5; ++i)
+    {
+        h = flight_id_mix(h, words[i]);
+    }
+    h = flight_id_mix(h, (uint64_t)r->type << 16 | r->id_len);
+    return (uint32_t)(h >> 32);
+}
+
+static uint64_t snapshot_checksum(const snapshot_header* header,
+    const snapshot_entry* entries)
+{
+    uint64_t h = 0xc2b2ae3d27d4eb4full;
+    uint64_t magic;
+    memcpy(&magic, header->magic, sizeof(magic));
+    h = flight_id_mix(h, magic);
+    h = flight_id_mix(h, header->entry_size);
+    h = flight_id_mix(h, header->count);
+    h = flight_id_mix(h, header->lsn);
+    for(uint64_t i = 0; i < header->count; ++i)
+    {
+        uint64_t words[sizeof(snapshot_entry) / 8];
+        memcpy(words, &entries[i], sizeof(words));
+        for(size_t w = 0; w < sizeof(words) / 8; ++w)
+        {
+            h = flight_id_mix(h, words[w]);
+        }
+    }
+    return h;
+}
+
+/************************************************************************
+ * The image.
+ */
+
+static void image_init(image* im)
+{
+    flighthash_init(im, offsetof(image_entry, id));
+}
+
+static image_entry* image_find(image* im, const flight_id* id)
+{
+    return flighthash_find(im, id);
+}
+
+// Finds the entry for "id", adding an empty one if there is none
+static image_entry* image_insert(image* im, const flight_id* id)
+{
+    image_entry* e = flighthash_find(im, id);
+    if(e == NULL)
+    {
+        e = allocate(NULL, sizeof(image_entry));
+        e->id = *id;
+        e->ticket = JOURNAL_NO_TICKET;
+        e->owner = 0;
+        flighthash_insert(im, e);
+    }
+    return e;
+}
+
+static void image_remove(image* im, image_entry* e)
+{
+    flighthash_remove(im, e);
+    free(e);
+}
+
+static void image_destroy(image* im)
+{
+    for(size_t i = 0; i < im->capacity; ++i)
+    {
+        free(im->slots[i].item);
+    }
+    flighthash_destroy(im);
+}
+
+static void image_apply(image* im, const journal_record* r)
+{
+    if(r->id_len > PLANE_MAXID)
+    {
+        return;
+    }
+    flight_id id;
+    flight_id_set(&id, r->id, r->id_len);
+
+    image_entry* e;
+    switch(r->type)
+    {
+    case JOURNAL_REGISTER:
+        image_insert(im, &id)->owner = (uint32_t)r->value;
+        break;
+    case JOURNAL_ENQUEUE:
+        image_insert(im, &id)->ticket = r->value;
+        break;
+    case JOURNAL_DEQUEUE:
+        e = image_find(im, &id);
+        if(e != NULL && e->ticket == r->value)
+        {
+            e->ticket = JOURNAL_NO_TICKET;
+        }
+        break;
+    case JOURNAL_DISCONNECT:
+        // A plane that took the id over since keeps it
+        e = image_find(im, &id);
+        if(e != NULL && e->owner == (uint32_t)r->value)
+        {
+            image_remove(im, e);
+        }
+        break;
+    }
+}
+
+// Where an entry is in the image, and its ticket to sort by
+typedef struct {
+    uint64_t ticket;
+    image_entry* entry;
+} image_slot;
+
+/*
+ Returns the image's entries in ticket order, registrations without one
+ last. A radix sort a byte at a time that skips the bytes every ticket
+ shares: waiting tickets span a narrow range, so only the low two or
+ three bytes take a pass.
+*/
+static image_slot* image_order(image* im)
+{
+    image_slot* order = allocate(NULL, (im->count + 1) * sizeof(image_slot));
+    size_t n = 0;
+    uint64_t all_or = 0;
+    uint64_t all_and = UINT64_MAX;
+    for(size_t i = 0; i < im->capacity; ++i)
+    {
+        image_entry* e = im->slots[i].item;
+        if(e != NULL)
+        {
+            uint64_t ticket = e->ticket;
+            order[n].ticket = ticket;
+            order[n].entry = e;
+            all_or |= ticket;
+            all_and &= ticket;
+            n++;
+        }
+    }
+
+    image_slot* other = allocate(NULL, (n + 1) * sizeof(image_slot));
+    for(int shift = 0; shift < 64; shift += 8)
+    {
+        if((((all_or ^ all_and) >> shift) & 0xff) == 0)
+        {
+            continue;
+        }
+
+        size_t offsets[256] = { 0 };
+        for(size_t i = 0; i < n; ++i)
+        {
+            offsets[(order[i].ticket >> shift) & 0xff]++;
+        }
+        size_t total = 0;
+        for(int b = 0; b < 256; ++b)
+        {
+            size_t c = offsets[b];
+            offsets[b] = total;
+            total += c;
+        }
+        for(size_t i = 0; i < n; ++i)
+        {
+            other[offsets[(order[i].ticket >> shift) & 0xff]++] = order[i];
+        }
+
+        image_slot* sorted = other;
+        other = order;
+        order = sorted;
+    }
+    free(other);
+    return order;
+}
+
+static void snapshot_entry_set(snapshot_entry* s, const image_entry* e)
+{
+    memcpy(s->id, e->id.text, FLIGHT_ID_SIZE);
+    s->id_len = e->id.len;
+    s->owner = e->owner;
+    s->ticket = e->ticket;
+}
+
+// The image as snapshot entries, in ticket order
+static snapshot_entry* image_entries(image* im)
+{
+    image_slot* order = image_order(im);
+    snapshot_entry* entries = allocate(NULL, (im->count + 1) * sizeof(snapshot_entry));
+    for(size_t i = 0; i < im->count; ++i)
+    {
+        snapshot_entry_set(&entries[i], order[i].entry);
+    }
+    free(order);
+    return entries;
+}
+
+/************************************************************************
+ * Files.
+ */
+
+static void fail(const char* what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void write_all(int fd, const void* data, size_t len)
+{
+    const char* p = data;
+    while(len > 0)
+    {
+        ssize_t written = write(fd, p, len);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            fail("journal write");
+        }
+        p += written;
+        len -= written;
+    }
+}
+
+/*
+ Replaces the snapshot with "count" entries that include every record up
+ to "lsn". Written beside it and renamed over it, so a crash leaves one
+ or the other whole.
+*/
+static void write_snapshot(const snapshot_entry* entries, size_t count, uint64_t lsn)
+{
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.entry_size = sizeof(snapshot_entry);
+    header.count = count;
+    header.lsn = lsn;
+    header.checksum = snapshot_checksum(&header, entries);
+
+    int fd = openat(journal.dir_fd, SNAPSHOT_TEMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        fail("open " SNAPSHOT_TEMP);
+    }
+    write_all(fd, &header, sizeof(header));
+    write_all(fd, entries, count * sizeof(snapshot_entry));
+    if(fsync(fd) != 0)
+    {
+        fail("fsync " SNAPSHOT_TEMP);
+    }
+    close(fd);
+
+    if(renameat(journal.dir_fd, SNAPSHOT_TEMP, journal.dir_fd, SNAPSHOT_FILE) != 0)
+    {
+        fail("rename " SNAPSHOT_TEMP);
+    }
+    if(fsync(journal.dir_fd) != 0)
+    {
+        fail("fsync journal directory");
+    }
+}
+
+/*
+ Loads the snapshot, if there is one, into the image. Returns the last
+ record it includes (0 without a snapshot), or -1 if it is damaged.
+*/
+static int64_t load_snapshot(image* im)
+{
+    int fd = openat(journal.dir_fd, SNAPSHOT_FILE, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        if(errno == ENOENT)
+        {
+            return 0;
+        }
+        fail("open " SNAPSHOT_FILE);
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        fail("fstat " SNAPSHOT_FILE);
+    }
+    if((size_t)st.st_size < sizeof(snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        fail("mmap " SNAPSHOT_FILE);
+    }
+
+    const snapshot_header* header = map;
+    const snapshot_entry* entries = (const snapshot_entry*)(header + 1);
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->entry_size != sizeof(snapshot_entry) ||
+        header->count * sizeof(snapshot_entry) + sizeof(snapshot_header) != (size_t)st.st_size ||
+        header->checksum != snapshot_checksum(header, entries))
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    flighthash_reserve(im, header->count);
+    for(uint64_t i = 0; i < header->count; ++i)
+    {
+        const snapshot_entry* s = &entries[i];
+        if(s->id_len > PLANE_MAXID)
+        {
+            continue;
+        }
+        flight_id id;
+        flight_id_set(&id, s->id, s->id_len);
+        image_entry* e = image_insert(im, &id);
+        e->ticket = s->ticket;
+        e->owner = s->owner;
+    }
+
+    int64_t lsn = header->lsn;
+    munmap(map, st.st_size);
+    return lsn;
+}
+
+/*
+ Applies the journal's records after "lsn" to the image, and cuts the
+ file off at the first one that is torn, corrupt or out of sequence.
+ Returns the last record applied.
+*/
+static uint64_t replay(image* im, uint64_t lsn)
+{
+    struct stat st;
+    if(fstat(journal.fd, &st) != 0)
+    {
+        fail("fstat " JOURNAL_FILE);
+    }
+    size_t size = st.st_size;
+    if(size == 0)
+    {
+        return lsn;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, journal.fd, 0);
+    if(map == MAP_FAILED)
+    {
+        fail("mmap " JOURNAL_FILE);
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    // A guess: most planes that show up in the journal leave two records
+    const journal_record* records = map;
+    size_t count = size / sizeof(journal_record);
+    flighthash_reserve(im, im->count + count / 2);
+    size_t valid = 0;
+    for(; valid < count; ++valid)
+    {
+        const journal_record* r = &records[valid];
+        if(r->checksum != record_checksum(r))
+        {
+            break;
+        }
+        // Records from before a snapshot whose compaction was cut short
+        if(r->lsn <= lsn)
+        {
+            continue;
+        }
+        if(r->lsn != lsn + 1)
+        {
+            break;
+        }
+        image_apply(im, r);
+        lsn = r->lsn;
+    }
+    munmap(map, size);
+
+    if(valid < count || size % sizeof(journal_record) != 0)
+    {
+        fprintf(stderr, "journal: dropping %zu bytes after record %llu\n",
+            size - valid * sizeof(journal_record), (unsigned long long)lsn);
+    }
+    return lsn;
+}
+
+/************************************************************************
+ * The writer.
+ */
+
+// Writes the image out as the snapshot and empties the journal
+static void compact(uint64_t lsn)
+{
+    snapshot_entry* entries = image_entries(&journal.state);
+    write_snapshot(entries, journal.state.count, lsn);
+    free(entries);
+
+    if(ftruncate(journal.fd, 0) != 0)
+    {
+        fail("ftruncate " JOURNAL_FILE);
+    }
+    journal.journal_records = 0;
+}
+
+static void* writer_start(void* arg)
+{
+    lock();
+    while(1)
+    {
+        while(journal.pending_count == 0 && !journal.stopping)
+        {
+            pthread_cond_wait(&journal.work, &journal.lock);
+        }
+        if(journal.pending_count == 0)
+        {
+            break;
+        }
+
+        // Take everything pending; the appender refills the other buffer
+        journal_record* records = journal.pending;
+        size_t count = journal.pending_count;
+        size_t cap = journal.pending_cap;
+        journal.pending = journal.writing;
+        journal.pending_cap = journal.writing_cap;
+        journal.pending_count = 0;
+        journal.writing = records;
+        journal.writing_cap = cap;
+        uint64_t lsn = journal.committed_lsn;
+        unlock();
+
+        uint64_t started = metrics_now();
+        write_all(journal.fd, records, count * sizeof(journal_record));
+        if(fdatasync(journal.fd) != 0)
+        {
+            fail("fdatasync " JOURNAL_FILE);
+        }
+        metrics_record(journal.commit_histogram, metrics_now() - started);
+        metrics_count(COUNTER_JOURNAL_SYNCS);
+        for(size_t i = 0; i < count; ++i)
+        {
+            metrics_count(COUNTER_JOURNAL_RECORDS);
+            image_apply(&journal.state, &records[i]);
+        }
+
+        journal.journal_records += count;
+        if(journal.journal_records >= JOURNAL_COMPACT_RECORDS)
+        {
+            compact(lsn);
+        }
+
+        lock();
+        journal.durable_lsn = lsn;
+        pthread_cond_broadcast(&journal.durable);
+    }
+    unlock();
+    return NULL;
+}
+
+/************************************************************************
+ * The public calls.
+ */
+
+/*
+ Opens (or creates) the journal in "dir" and recovers what it holds.
+ "planes" gets every registration that was live, in queue order, with
+ waiting tickets numbered again from 0; the caller frees it. Every later
+ record continues from that state. Returns 0, or -1 if the directory
+ can't be used.
+*/
+int journal_open(const char* dir, journal_plane** planes, size_t* count)
+{
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror(dir);
+        return -1;
+    }
+    journal.dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(journal.dir_fd < 0)
+    {
+        perror(dir);
+        return -1;
+    }
+    journal.fd = openat(journal.dir_fd, JOURNAL_FILE,
+        O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(journal.fd < 0)
+    {
+        perror(JOURNAL_FILE);
+        return -1;
+    }
+
+    image recovered;
+    image_init(&recovered);
+    int64_t snapshot_lsn = load_snapshot(&recovered);
+    if(snapshot_lsn < 0)
+    {
+        fprintf(stderr, "journal: %s/%s is damaged\n", dir, SNAPSHOT_FILE);
+        return -1;
+    }
+    uint64_t lsn = replay(&recovered, snapshot_lsn);
+
+    // Waiting planes get consecutive tickets, so the queue has no gaps.
+    // The recovered image, renumbered, is the writer's from here on.
+    size_t n = recovered.count;
+    image_slot* order = image_order(&recovered);
+    snapshot_entry* entries = allocate(NULL, (n + 1) * sizeof(snapshot_entry));
+    *planes = allocate(NULL, (n + 1) * sizeof(journal_plane));
+    *count = n;
+
+    uint64_t ticket = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        image_entry* e = order[i].entry;
+        if(e->ticket != JOURNAL_NO_TICKET)
+        {
+            e->ticket = ticket++;
+        }
+        e->owner = 0;
+        snapshot_entry_set(&entries[i], e);
+
+        journal_plane* p = &(*planes)[i];
+        p->id = e->id;
+        p->ticket = e->ticket;
+    }
+    free(order);
+    journal.state = recovered;
+    write_snapshot(entries, n, lsn);
+    free(entries);
+    if(ftruncate(journal.fd, 0) != 0)
+    {
+        fail("ftruncate " JOURNAL_FILE);
+    }
+
+    journal.next_lsn = lsn + 1;
+    journal.committed_lsn = journal.durable_lsn = lsn;
+    journal.journal_records = 0;
+    journal.stopping = false;
+    journal.staged_cap = journal.pending_cap = journal.writing_cap = STAGE_MIN_CAPACITY;
+    journal.staged = allocate(NULL, STAGE_MIN_CAPACITY * sizeof(journal_record));
+    journal.pending = allocate(NULL, STAGE_MIN_CAPACITY * sizeof(journal_record));
+    journal.writing = allocate(NULL, STAGE_MIN_CAPACITY * sizeof(journal_record));
+    journal.staged_count = journal.pending_count = 0;
+
+    journal.commit_histogram = metrics_histogram("journal_commit", NULL,
+        "Time to write and sync one group of journal records");
+
+    if(pthread_mutex_init(&journal.lock, NULL) != 0 ||
+        pthread_cond_init(&journal.work, NULL) != 0 ||
+        pthread_cond_init(&journal.durable, NULL) != 0)
+    {
+        fprintf(stderr, "Could not initialize journal locks");
+        exit(1);
+    }
+    if(pthread_create(&journal.writer, NULL, writer_start, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create journal thread");
+        exit(1);
+    }
+    return 0;
+}
+
+/*
+ Adds a record. It is only handed to the writer by journal_commit. Only
+ one thread may append.
+*/
+void journal_append(int type, const flight_id* id, uint64_t value)
+{
+    if(journal.staged_count == journal.staged_cap)
+    {
+        journal.staged_cap *= 2;
+        journal.staged = allocate(journal.staged, journal.staged_cap * sizeof(journal_record));
+    }
+
+    journal_record* r = &journal.staged[journal.staged_count++];
+    r->lsn = journal.next_lsn++;
+    r->value = value;
+    memcpy(r->id, id->text, FLIGHT_ID_SIZE);
+    r->type = type;
+    r->id_len = id->len;
+    r->checksum = record_checksum(r);
+}
+
+/*
+ Hands the records appended so far to the writer, which syncs them
+ together with anything else it has. Does not wait for the sync.
+*/
+void journal_commit(void)
+{
+    if(journal.staged_count == 0)
+    {
+        return;
+    }
+
+    lock();
+    if(journal.pending_count + journal.staged_count > journal.pending_cap)
+    {
+        while(journal.pending_count + journal.staged_count > journal.pending_cap)
+        {
+            journal.pending_cap *= 2;
+        }
+        journal.pending = allocate(journal.pending, journal.pending_cap * sizeof(journal_record));
+    }
+    memcpy(journal.pending + journal.pending_count, journal.staged,
+        journal.staged_count * sizeof(journal_record));
+    journal.pending_count += journal.staged_count;
+    journal.committed_lsn = journal.next_lsn - 1;
+    pthread_cond_signal(&journal.work);
+    unlock();
+
+    journal.staged_count = 0;
+}
+
+// Commits, then waits until every record appended so far is on disk
+void journal_sync(void)
+{
+    journal_commit();
+    lock();
+    while(journal.durable_lsn < journal.committed_lsn)
+    {
+        pthread_cond_wait(&journal.durable, &journal.lock);
+    }
+    unlock();
+}
+
+/*
+ Syncs what is left and stops the writer. Called by the appending thread
+ once it has stopped appending.
+*/
+void journal_close(void)
+{
+    journal_commit();
+    lock();
+    journal.stopping = true;
+    pthread_cond_signal(&journal.work);
+    unlock();
+    pthread_join(journal.writer, NULL);
+
+    close(journal.fd);
+    close(journal.dir_fd);
+    free(journal.staged);
+    free(journal.pending);
+    free(journal.writing);
+    image_destroy(&journal.state);
+    pthread_cond_destroy(&journal.work);
+    pthread_cond_destroy(&journal.durable);
+    pthread_mutex_destroy(&journal.lock);
+}
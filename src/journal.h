@@ -0,0 +1,58 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flightid.h"
+
+// Write-ahead journal of registrations and the taxi queue, so a restart
+// keeps every plane's place in line. The durable state is one record per
+// registered flight id: the plane that owns it (its plane number, 0 for
+// one recovered at startup) and its taxi ticket, if it has one.
+//
+// Records are appended by one thread (the takeoff scheduler) and handed
+// to a writer thread with journal_commit. The writer does one write and
+// one fdatasync for everything handed over since its last one, so under
+// load many records share each sync. Once the journal is long enough the
+// writer compacts it: the current state goes to a snapshot file and the
+// journal starts over.
+//
+// Both files are arrays of fixed-size little-endian records, so the
+// snapshot can be mapped and read in place. At startup journal_open loads
+// the snapshot, replays the journal after it (stopping at the first torn
+// or corrupt record), numbers the waiting tickets again from 0 in their
+// old order and writes that out as a fresh snapshot.
+
+#define JOURNAL_REGISTER 1     // "id" registered by plane number "value"
+#define JOURNAL_ENQUEUE 2      // "id" joined the taxi queue as ticket "value"
+#define JOURNAL_DEQUEUE 3      // Ticket "value" ("id") left the queue
+#define JOURNAL_DISCONNECT 4   // Plane number "value" ("id") disconnected
+
+#define JOURNAL_NO_TICKET UINT64_MAX
+
+typedef struct {
+    uint64_t lsn;              // Sequence number, one more than the last record's
+    uint64_t value;            // Ticket or plane number, by type
+    char id[FLIGHT_ID_SIZE];   // Zero-padded, as in flight_id
+    uint16_t type;
+    uint16_t id_len;
+    uint32_t checksum;         // Over everything before it
+} journal_record;
+
+_Static_assert(sizeof(journal_record) == 48, "journal records are 48 bytes on disk");
+
+// A registration found at startup, in ticket order
+typedef struct {
+    flight_id id;
+    uint64_t ticket;           // JOURNAL_NO_TICKET if it wasn't taxiing
+} journal_plane;
+
+int journal_open(const char* dir, journal_plane** planes, size_t* count);
+void journal_append(int type, const flight_id* id, uint64_t value);
+void journal_commit(void);
+void journal_sync(void);
+void journal_close(void);
+
+#endif
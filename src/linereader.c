@@ -0,0 +1,91 @@
+// Splits a socket's byte stream into lines in place.
+
+#include <string.h>
+#include <sys/socket.h>
+
+#include "linereader.h"
+
+void linereader_init(linereader* r)
+{
+    r->start = 0;
+    r->used = 0;
+    r->discarding = false;
+}
+
+/*
+ Slides a leftover partial line down to the front of the buffer and
+ returns how many bytes can be added after it.
+*/
+size_t linereader_space(linereader* r)
+{
+    if(r->start > 0)
+    {
+        memmove(r->buffer, r->buffer + r->start, r->used - r->start);
+        r->used -= r->start;
+        r->start = 0;
+    }
+    return LINEREADER_SIZE - r->used;
+}
+
+/*
+ Receives whatever the socket has into the free end of the buffer.
+ Returns what recv returned: the byte count, 0 on orderly shutdown, or
+ -1 with errno set (EAGAIN if nothing was waiting).
+*/
+ssize_t linereader_fill(linereader* r, int fd)
+{
+    linereader_space(r);
+    ssize_t received = recv(fd, r->buffer + r->used,
+        LINEREADER_SIZE - r->used, MSG_DONTWAIT);
+    if(received > 0)
+    {
+        r->used += received;
+    }
+    return received;
+}
+
+/*
+ Adds bytes received some other way (into an io_uring buffer). At most
+ linereader_space bytes fit.
+*/
+void linereader_feed(linereader* r, const char* data, size_t len)
+{
+    linereader_space(r);
+    memcpy(r->buffer + r->used, data, len);
+    r->used += len;
+}
+
+/*
+ Hands out the next complete line without its '\n'. The line stays valid,
+ and writable, until bytes are next added; line[len] is the byte that
+ held the '\n', so the caller may overwrite it with a NUL.
+*/
+int linereader_next(linereader* r, char** line, size_t* len)
+{
+    char* begin = r->buffer + r->start;
+    char* newline = memchr(begin, '\n', r->used - r->start);
+
+    if(newline == NULL)
+    {
+        if(r->discarding || (r->start == 0 && r->used == LINEREADER_SIZE))
+        {
+            // Full buffer and still no end of line: drop it and keep
+            // dropping until the newline shows up
+            r->discarding = true;
+            r->start = 0;
+            r->used = 0;
+        }
+        return LINE_NONE;
+    }
+
+    r->start = newline + 1 - r->buffer;
+    if(r->discarding)
+    {
+        r->discarding = false;
+        return LINE_TOO_LONG;
+    }
+
+    *line = begin;
+    *len = newline - begin;
+    return LINE_READY;
+}
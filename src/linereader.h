@@ -0,0 +1,36 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "linescan.h"
+
+// Per-connection line reader over a fixed receive buffer. Bytes are
+// received straight into the buffer and lines are handed out as a pointer
+// and length into it, so there is no copy and no allocation per line. A
+// partial line stays in the buffer until the rest of it arrives. A line
+// that cannot fit is discarded up to its newline and reported once as
+// LINE_TOO_LONG.
+
+#define LINEREADER_SIZE 1024   // Longest line, including its '\n'
+
+#define LINE_NONE 0       // No complete line buffered yet
+#define LINE_READY 1      // *line / *len hold the next line
+#define LINE_TOO_LONG 2   // An oversized line was dropped
+
+typedef struct {
+    size_t start;       // First byte not handed out yet
+    size_t used;        // Bytes in buffer
+    bool discarding;    // Skipping the rest of an oversized line
+    char buffer[LINEREADER_SIZE + LINESCAN_SLACK];   // Lines are scanned in place
+} linereader;
+
+void linereader_init(linereader* r);
+size_t linereader_space(linereader* r);
+ssize_t linereader_fill(linereader* r, int fd);
+void linereader_feed(linereader* r, const char* data, size_t len);
+int linereader_next(linereader* r, char** line, size_t* len);
+
+#endif
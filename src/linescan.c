@@ -0,0 +1,216 @@
+// The line scanner behind docommand.
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "linescan.h"
+
+#define BLOCK 64    // Bytes per bitmap word
+
+#ifdef __SSE2__
+
+// Lanes where lo <= v <= lo + span, as unsigned bytes
+static inline __m128i in_range(__m128i v, char lo, char span)
+{
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(span)), d);
+}
+
+static inline void classify16(const char* p, uint64_t* space, uint64_t* alnum)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i s = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+        in_range(v, '\t', '\r' - '\t'));
+    __m128i a = _mm_or_si128(in_range(v, '0', 9),
+        in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 25));
+    *space = (uint16_t)_mm_movemask_epi8(s);
+    *alnum = (uint16_t)_mm_movemask_epi8(a);
+}
+
+#else
+
+static inline void classify16(const char* p, uint64_t* space, uint64_t* alnum)
+{
+    *space = 0;
+    *alnum = 0;
+    for(int i = 0; i < 16; ++i)
+    {
+        unsigned char c = p[i];
+        unsigned char lower = c | 0x20;
+        *space |= (uint64_t)(c == ' ' || (c >= '\t' && c <= '\r')) << i;
+        *alnum |= (uint64_t)((c >= '0' && c <= '9') || (lower >= 'a' && lower <= 'z')) << i;
+    }
+}
+
+#endif
+
+/*
+ Fills one bitmap word per BLOCK bytes. Bytes past the end of the line
+ count as whitespace and alphanumeric, so they never end a word or spoil
+ an id.
+*/
+static inline void classify(const char* line, size_t len, uint64_t* space, uint64_t* alnum)
+{
+    size_t words = (len + BLOCK - 1) / BLOCK;
+    for(size_t w = 0; w < words; ++w)
+    {
+        space[w] = 0;
+        alnum[w] = 0;
+        for(size_t at = 0; at < BLOCK && w * BLOCK + at < len; at += 16)
+        {
+            uint64_t s, a;
+            classify16(line + w * BLOCK + at, &s, &a);
+            space[w] |= s << at;
+            alnum[w] |= a << at;
+        }
+    }
+
+    size_t rest = len % BLOCK;
+    if(rest != 0)
+    {
+        uint64_t past = ~0ull << rest;
+        space[words - 1] |= past;
+        alnum[words - 1] |= past;
+    }
+}
+
+// First position at or after "from" whose bit is "want", or len if none
+static size_t next_bit(const uint64_t* bits, bool want, size_t from, size_t len)
+{
+    size_t words = (len + BLOCK - 1) / BLOCK;
+    for(size_t w = from / BLOCK; w < words; ++w)
+    {
+        uint64_t word = want ? bits[w] : ~bits[w];
+        if(w == from / BLOCK)
+        {
+            word &= ~0ull << (from % BLOCK);
+        }
+        if(word != 0)
+        {
+            size_t at = w * BLOCK + __builtin_ctzll(word);
+            return at < len ? at : len;
+        }
+    }
+    return len;
+}
+
+// One past the last position whose bit is clear, or 0 if none
+static size_t last_clear(const uint64_t* bits, size_t len)
+{
+    for(size_t w = (len + BLOCK - 1) / BLOCK; w-- > 0; )
+    {
+        if(~bits[w] != 0)
+        {
+            return w * BLOCK + (BLOCK - __builtin_clzll(~bits[w]));
+        }
+    }
+    return 0;
+}
+
+/*
+ Finds the word boundaries in the bitmaps. Whatever length the line is,
+ a position is found with one bit scan per bitmap word.
+*/
+static bool split(linescan* scan, char* line, size_t len,
+    const uint64_t* space, const uint64_t* alnum)
+{
+    size_t cmd = next_bit(space, false, 0, len);
+    if(cmd == len)
+    {
+        return false;
+    }
+    size_t cmd_end = next_bit(space, true, cmd, len);
+    scan->cmd = line + cmd;
+    scan->cmd_len = cmd_end - cmd;
+
+    if(cmd_end == len)
+    {
+        scan->args = NULL;
+        scan->args_len = 0;
+        scan->args_alnum = false;
+        return true;
+    }
+
+    size_t args = next_bit(space, false, cmd_end, len);
+    size_t args_end = last_clear(space, len);
+    if(args_end < args)
+    {
+        args_end = args;    // Only whitespace after the command
+    }
+    scan->args = line + args;
+    scan->args_len = args_end - args;
+    scan->args_alnum = next_bit(alnum, false, args, args_end) == args_end;
+    line[args_end] = '\0';
+    return true;
+}
+
+/*
+ split for a line of at most one bitmap word, with the scans done on the
+ word directly.
+*/
+static inline bool split_short(linescan* scan, char* line, size_t len,
+    uint64_t space, uint64_t alnum)
+{
+    uint64_t text = ~space;    // Bits past len are already clear
+    if(text == 0)
+    {
+        return false;
+    }
+    size_t cmd = __builtin_ctzll(text);
+    uint64_t after = space & (~0ull << cmd);
+    size_t cmd_end = after != 0 ? (size_t)__builtin_ctzll(after) : BLOCK;
+    if(cmd_end > len)
+    {
+        cmd_end = len;
+    }
+    scan->cmd = line + cmd;
+    scan->cmd_len = cmd_end - cmd;
+
+    if(cmd_end == len)
+    {
+        scan->args = NULL;
+        scan->args_len = 0;
+        scan->args_alnum = false;
+        return true;
+    }
+
+    // cmd_end < len <= BLOCK, so every shift below is in range
+    uint64_t rest = text & (~0ull << cmd_end);
+    size_t args = rest != 0 ? (size_t)__builtin_ctzll(rest) : len;
+    size_t args_end = rest != 0 ? BLOCK - (size_t)__builtin_clzll(rest) : len;
+    scan->args = line + args;
+    scan->args_len = args_end - args;
+    uint64_t inside = rest != 0 ? (~0ull << args) & (~0ull >> (BLOCK - args_end)) : 0;
+    scan->args_alnum = (~alnum & inside) == 0;
+    line[args_end] = '\0';
+    return true;
+}
+
+/*
+ Splits the "len" bytes at "line" into scan. Returns false for a line
+ that is all whitespace. When there are arguments, their end is
+ overwritten with a NUL, which may be line[len].
+*/
+bool linescan_parse(linescan* scan, char* line, size_t len)
+{
+    // Commands are short: one bitmap word covers nearly every line
+    if(len <= BLOCK)
+    {
+        uint64_t space, alnum;
+        if(len == 0)
+        {
+            return false;
+        }
+        classify(line, len, &space, &alnum);
+        return split_short(scan, line, len, space, alnum);
+    }
+
+    size_t words = (len + BLOCK - 1) / BLOCK;
+    uint64_t space[words];
+    uint64_t alnum[words];
+    classify(line, len, space, alnum);
+    return split(scan, line, len, space, alnum);
+}
@@ -0,0 +1,30 @@
+#ifndef LINE_SCAN_H
+#define LINE_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Splits a command line into its command word and trimmed arguments, and
+// checks whether the arguments could be a flight id, in one pass over
+// the line. Every byte is classified once (16 at a time with SSE2, one
+// at a time otherwise) into whitespace and alphanumeric bitmaps, and the
+// word boundaries are then found with bit scans. Whitespace and
+// alphanumerics are the ASCII ones, as isspace and isalnum give them in
+// the "C" locale.
+//
+// The scanner reads whole 16-byte chunks, so the LINESCAN_SLACK bytes
+// from line[len] on must be readable; what they hold doesn't matter.
+
+#define LINESCAN_SLACK 16
+
+typedef struct {
+    const char* cmd;      // The first word
+    size_t cmd_len;
+    char* args;           // The rest, trimmed and NUL-terminated, or NULL
+    size_t args_len;      // when nothing follows the first word
+    bool args_alnum;      // args is all [0-9A-Za-z]
+} linescan;
+
+bool linescan_parse(linescan* scan, char* line, size_t len);
+
+#endif
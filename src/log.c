@@ -0,0 +1,261 @@
+// The logging module. Each thread appends to a ring of its own; one
+// background thread formats and writes everything.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+static pthread_t flusher;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(log_ring*) rings;   // Every thread's ring; never shrinks
+static int ring_count;            // Guarded by rings_mutex
+static atomic_bool stopping;
+
+static _Thread_local log_ring* my_ring;
+
+static const char* const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/*
+ Gives the calling thread its ring the first time it logs. Rings stay
+ registered for the life of the process, so a thread's last records are
+ written even after it has exited.
+*/
+static log_ring* register_ring(void)
+{
+    log_ring* ring = calloc(1, sizeof(log_ring));
+    if(ring == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if(pthread_mutex_lock(&rings_mutex) != 0)
+    {
+        fprintf(stderr, "Could not lock log rings");
+        exit(1);
+    }
+    ring->thread = ++ring_count;
+    ring->next = atomic_load(&rings);
+    atomic_store(&rings, ring);
+    pthread_mutex_unlock(&rings_mutex);
+
+    my_ring = ring;
+    return ring;
+}
+
+void log_record(int level, const char* subject, const char* format,
+    const long long* args, int argc)
+{
+    log_ring* ring = my_ring != NULL ? my_ring : register_ring();
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_CAPACITY)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_record_t* record = &ring->records[tail & (LOG_RING_CAPACITY - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->nanoseconds = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->format = format;
+    record->level = level;
+    record->argc = argc;
+    for(int i = 0; i < argc; ++i)
+    {
+        record->args[i] = args[i];
+    }
+
+    size_t i = 0;
+    if(subject != NULL)
+    {
+        for(; i < LOG_SUBJECT_MAX - 1 && subject[i] != '\0'; ++i)
+        {
+            record->subject[i] = subject[i];
+        }
+    }
+    record->subject[i] = '\0';
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/*
+ Formats a record's event into "out". Each conversion is rebuilt with the
+ "ll" length so the stored long long is printed the way the format asked
+ for it (width, sign, base).
+*/
+static void format_event(const log_record_t* record, char* out, size_t cap)
+{
+    const char* f = record->format;
+    size_t len = 0;
+    int arg = 0;
+
+    while(*f != '\0' && len + 1 < cap)
+    {
+        if(*f != '%')
+        {
+            out[len++] = *f++;
+            continue;
+        }
+        if(f[1] == '%')
+        {
+            out[len++] = '%';
+            f += 2;
+            continue;
+        }
+
+        // Flags, width and precision are kept; length modifiers dropped
+        char spec[32];
+        size_t n = 0;
+        spec[n++] = *f++;
+        while(*f != '\0' && strchr("-+ #0123456789.", *f) != NULL && n < sizeof(spec) - 4)
+        {
+            spec[n++] = *f++;
+        }
+        while(*f != '\0' && strchr("hlLqjzt", *f) != NULL)
+        {
+            f++;
+        }
+        if(*f == '\0')
+        {
+            break;
+        }
+        spec[n++] = 'l';
+        spec[n++] = 'l';
+        spec[n++] = *f++;
+        spec[n] = '\0';
+
+        long long value = arg < record->argc ? record->args[arg] : 0;
+        arg++;
+        int written = snprintf(out + len, cap - len, spec, value);
+        if(written > 0)
+        {
+            len += (size_t)written < cap - len ? (size_t)written : cap - len - 1;
+        }
+    }
+    out[len] = '\0';
+}
+
+static void write_record(const log_record_t* record, int thread)
+{
+    char event[256];
+    format_event(record, event, sizeof(event));
+
+    time_t seconds = record->nanoseconds / 1000000000;
+    struct tm local;
+    char when[32];
+    localtime_r(&seconds, &local);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+
+    printf("%s.%06lu T%d %-5s %s: %s\n", when,
+        (unsigned long)(record->nanoseconds % 1000000000 / 1000), thread,
+        level_names[record->level], record->subject[0] != '\0' ? record->subject : "-",
+        event);
+}
+
+/*
+ Writes out everything logged so far. Records from different threads are
+ merged by timestamp; each ring is only read up to where its tail stood
+ when the drain began, so a busy thread can't keep the flusher here.
+*/
+static void drain(void)
+{
+    // Rings are only ever added at the front, so the ones seen here stay
+    // the same list while it is walked
+    log_ring* first = atomic_load(&rings);
+    int count = 0;
+    for(log_ring* r = first; r != NULL; r = r->next)
+    {
+        count++;
+    }
+    if(count == 0)
+    {
+        return;
+    }
+
+    size_t heads[count];
+    size_t ends[count];
+    int index = 0;
+    for(log_ring* r = first; r != NULL; r = r->next, ++index)
+    {
+        heads[index] = atomic_load_explicit(&r->head, memory_order_relaxed);
+        ends[index] = atomic_load_explicit(&r->tail, memory_order_acquire);
+    }
+
+    while(true)
+    {
+        log_ring* oldest = NULL;
+        int oldest_index = 0;
+        uint64_t oldest_time = 0;
+        index = 0;
+        for(log_ring* r = first; r != NULL; r = r->next, ++index)
+        {
+            if(heads[index] == ends[index])
+            {
+                continue;
+            }
+            uint64_t stamp = r->records[heads[index] & (LOG_RING_CAPACITY - 1)].nanoseconds;
+            if(oldest == NULL || stamp < oldest_time)
+            {
+                oldest = r;
+                oldest_index = index;
+                oldest_time = stamp;
+            }
+        }
+        if(oldest == NULL)
+        {
+            break;
+        }
+
+        size_t head = heads[oldest_index]++;
+        write_record(&oldest->records[head & (LOG_RING_CAPACITY - 1)], oldest->thread);
+        atomic_store_explicit(&oldest->head, head + 1, memory_order_release);
+    }
+
+    for(log_ring* r = first; r != NULL; r = r->next)
+    {
+        size_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        if(dropped > 0)
+        {
+            printf("T%d dropped %zu log records\n", r->thread, dropped);
+        }
+    }
+    fflush(stdout);
+}
+
+static void* flusher_start(void* arg)
+{
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    while(!atomic_load(&stopping))
+    {
+        nanosleep(&interval, NULL);
+        drain();
+    }
+    drain();
+    return NULL;
+}
+
+void log_init(void)
+{
+    atomic_store(&stopping, false);
+    if(pthread_create(&flusher, NULL, flusher_start, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create log thread");
+        exit(1);
+    }
+}
+
+/*
+ Stops the flusher after it has written everything logged so far.
+*/
+void log_destroy(void)
+{
+    atomic_store(&stopping, true);
+    pthread_join(flusher, NULL);
+}
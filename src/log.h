@@ -0,0 +1,98 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous logging. A record is a timestamp, the thread that logged
+// it, a subject (the plane id, or the peer address before a plane has
+// one), an event format and up to LOG_MAX_ARGS integer arguments. Logging
+// copies those into the calling thread's own ring: no formatting, no
+// lock, no system call. A background thread drains the rings every
+// LOG_FLUSH_MS, formats the records in time order and writes them to
+// stdout. A full ring drops records and the flusher reports how many.
+//
+// Levels below LOG_LEVEL are compiled out, arguments and all; build with
+// -DLOG_LEVEL=0 to get the debug records. Formats are checked like
+// printf's, but only integer conversions may be used.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_MAX_ARGS 4
+#define LOG_SUBJECT_MAX 24      // Including the NUL; fits a plane id or IPv4 address
+#define LOG_RING_CAPACITY 1024  // Records per thread; must be a power of two
+#define LOG_FLUSH_MS 20
+
+typedef struct {
+    uint64_t nanoseconds;       // CLOCK_REALTIME
+    const char* format;         // Must outlive the process (a literal)
+    int level;
+    int argc;
+    long long args[LOG_MAX_ARGS];
+    char subject[LOG_SUBJECT_MAX];
+} log_record_t;
+
+typedef struct log_ring {
+    log_record_t records[LOG_RING_CAPACITY];
+    _Alignas(64) atomic_size_t tail;      // Next record the owner fills
+    _Alignas(64) atomic_size_t head;      // Next record the flusher reads
+    atomic_size_t dropped;
+    int thread;                           // Small number naming the owner
+    struct log_ring* next;
+} log_ring;
+
+void log_init(void);
+void log_record(int level, const char* subject, const char* format,
+    const long long* args, int argc);
+void log_destroy(void);
+
+// Never called; lets the compiler check a format against its arguments.
+static inline __attribute__((format(printf, 1, 2)))
+void log_check_format(const char* format, ...)
+{
+}
+
+#define LOG_ARGS(...) ((const long long[]){ 0, ##__VA_ARGS__ })
+#define LOG_ARGC(...) ((int)(sizeof(LOG_ARGS(__VA_ARGS__)) / sizeof(long long)) - 1)
+
+#define LOG_RECORD(level, subject, fmt, ...) \
+do { \
+    _Static_assert(LOG_ARGC(__VA_ARGS__) <= LOG_MAX_ARGS, "too many log arguments"); \
+    if(0) log_check_format(fmt, ##__VA_ARGS__); \
+    log_record(level, subject, fmt, LOG_ARGS(__VA_ARGS__) + 1, LOG_ARGC(__VA_ARGS__)); \
+} while (0)
+
+#define LOG_DISCARD(subject, fmt, ...) \
+do { \
+    if(0) log_check_format(fmt, ##__VA_ARGS__); \
+} while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(subject, fmt, ...) LOG_RECORD(LOG_LEVEL_DEBUG, subject, fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(subject, fmt, ...) LOG_DISCARD(subject, fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(subject, fmt, ...) LOG_RECORD(LOG_LEVEL_INFO, subject, fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(subject, fmt, ...) LOG_DISCARD(subject, fmt, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(subject, fmt, ...) LOG_RECORD(LOG_LEVEL_WARN, subject, fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(subject, fmt, ...) LOG_DISCARD(subject, fmt, ##__VA_ARGS__)
+#endif
+
+#define LOG_ERROR(subject, fmt, ...) LOG_RECORD(LOG_LEVEL_ERROR, subject, fmt, ##__VA_ARGS__)
+
+#endif
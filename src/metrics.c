@@ -0,0 +1,352 @@
+// The metrics module. Each thread records into a block of its own; a
+// report walks every block and adds them up.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+typedef struct {
+    const char* name;
+    const char* label;    // Prometheus label pair, or NULL
+    const char* help;
+} histogram_info;
+
+static const char* const counter_names[] = {
+#define METRIC_TEXT(name, text, help) text,
+    METRICS_COUNTERS(METRIC_TEXT)
+};
+static const char* const counter_help[] = {
+#define METRIC_HELP(name, text, help) help,
+    METRICS_COUNTERS(METRIC_HELP)
+};
+static const char* const gauge_names[] = {
+    METRICS_GAUGES(METRIC_TEXT)
+#undef METRIC_TEXT
+};
+static const char* const gauge_help[] = {
+    METRICS_GAUGES(METRIC_HELP)
+#undef METRIC_HELP
+};
+
+static histogram_info histogram_infos[METRICS_MAX_HISTOGRAMS];
+static int histogram_count;
+static atomic_int_fast64_t gauges[GAUGE_COUNT];
+
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(metrics_block*) blocks;   // Every thread's block; never shrinks
+
+static _Thread_local metrics_block* my_block;
+
+// Prometheus buckets are every other power of two from 1024 ns, which
+// line up with the edges of the fine buckets
+#define EXPORT_FIRST_SHIFT 10
+#define EXPORT_LAST_SHIFT 40
+
+/*
+ Adds a histogram and returns its number. Only called while the server
+ starts up, before anything is recorded.
+*/
+int metrics_histogram(const char* name, const char* label, const char* help)
+{
+    if(histogram_count == METRICS_MAX_HISTOGRAMS)
+    {
+        fprintf(stderr, "Too many histograms\n");
+        exit(1);
+    }
+    histogram_infos[histogram_count].name = name;
+    histogram_infos[histogram_count].label = label;
+    histogram_infos[histogram_count].help = help;
+    return histogram_count++;
+}
+
+static metrics_block* register_block(void)
+{
+    metrics_block* block = calloc(1, sizeof(metrics_block));
+    if(block == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if(pthread_mutex_lock(&blocks_mutex) != 0)
+    {
+        fprintf(stderr, "Could not lock metrics blocks");
+        exit(1);
+    }
+    block->next = atomic_load(&blocks);
+    atomic_store(&blocks, block);
+    pthread_mutex_unlock(&blocks_mutex);
+
+    my_block = block;
+    return block;
+}
+
+static inline metrics_block* block(void)
+{
+    return my_block != NULL ? my_block : register_block();
+}
+
+// Only the owning thread writes a block, so no read-modify-write is needed
+static inline void bump(atomic_uint_fast64_t* value, uint64_t by)
+{
+    atomic_store_explicit(value,
+        atomic_load_explicit(value, memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+void metrics_count(int counter)
+{
+    bump(&block()->counters[counter], 1);
+}
+
+static size_t bucket_index(uint64_t value)
+{
+    if(value < HISTOGRAM_SUB_BUCKETS)
+    {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    size_t group = msb - HISTOGRAM_SUB_BITS + 1;
+    return group * HISTOGRAM_SUB_BUCKETS +
+        ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Largest value that lands in a bucket
+static uint64_t bucket_top(size_t index)
+{
+    if(index < HISTOGRAM_SUB_BUCKETS)
+    {
+        return index;
+    }
+    size_t group = index / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    int shift = group - 1;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void metrics_record(int which, uint64_t nanoseconds)
+{
+    histogram* h = &block()->histograms[which];
+    bump(&h->count, 1);
+    bump(&h->sum, nanoseconds);
+    bump(&h->buckets[bucket_index(nanoseconds)], 1);
+    if(nanoseconds > atomic_load_explicit(&h->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->max, nanoseconds, memory_order_relaxed);
+    }
+}
+
+void metrics_set(int gauge, int64_t value)
+{
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+static uint64_t load(atomic_uint_fast64_t* value)
+{
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+static void sum_counters(uint64_t* totals)
+{
+    memset(totals, 0, COUNTER_COUNT * sizeof(uint64_t));
+    for(metrics_block* b = atomic_load(&blocks); b != NULL; b = b->next)
+    {
+        for(int i = 0; i < COUNTER_COUNT; ++i)
+        {
+            totals[i] += load(&b->counters[i]);
+        }
+    }
+}
+
+// Adds up one histogram across every thread's block
+static void sum_histogram(int which, uint64_t* count, uint64_t* sum,
+    uint64_t* max, uint64_t* buckets)
+{
+    *count = *sum = *max = 0;
+    memset(buckets, 0, HISTOGRAM_BUCKETS * sizeof(uint64_t));
+    for(metrics_block* b = atomic_load(&blocks); b != NULL; b = b->next)
+    {
+        histogram* h = &b->histograms[which];
+        *count += load(&h->count);
+        *sum += load(&h->sum);
+        uint64_t m = load(&h->max);
+        if(m > *max)
+        {
+            *max = m;
+        }
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        {
+            buckets[i] += load(&h->buckets[i]);
+        }
+    }
+}
+
+static uint64_t percentile(const uint64_t* buckets, uint64_t count,
+    uint64_t max, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * count + 0.5);
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if(seen >= rank)
+        {
+            uint64_t top = bucket_top(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+static void render_text(FILE* out)
+{
+    uint64_t totals[COUNTER_COUNT];
+    sum_counters(totals);
+
+    for(int i = 0; i < COUNTER_COUNT; ++i)
+    {
+        fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long)totals[i]);
+    }
+    fprintf(out, "connected_planes %lld\n",
+        (long long)(totals[COUNTER_CONNECTS] - totals[COUNTER_DISCONNECTS]));
+    for(int i = 0; i < GAUGE_COUNT; ++i)
+    {
+        fprintf(out, "%s %lld\n", gauge_names[i], (long long)atomic_load(&gauges[i]));
+    }
+
+    // Latencies in microseconds
+    uint64_t* buckets = malloc(HISTOGRAM_BUCKETS * sizeof(uint64_t));
+    if(buckets == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(int i = 0; i < histogram_count; ++i)
+    {
+        uint64_t count, sum, max;
+        sum_histogram(i, &count, &sum, &max, buckets);
+        fprintf(out, "%s", histogram_infos[i].name);
+        if(histogram_infos[i].label != NULL)
+        {
+            fprintf(out, "{%s}", histogram_infos[i].label);
+        }
+        fprintf(out, " count=%llu", (unsigned long long)count);
+        if(count > 0)
+        {
+            fprintf(out, " mean=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f",
+                sum / 1000.0 / count,
+                percentile(buckets, count, max, 0.5) / 1000.0,
+                percentile(buckets, count, max, 0.9) / 1000.0,
+                percentile(buckets, count, max, 0.99) / 1000.0,
+                percentile(buckets, count, max, 0.999) / 1000.0,
+                max / 1000.0);
+        }
+        fprintf(out, "\n");
+    }
+    free(buckets);
+    fprintf(out, "END\n");
+}
+
+static void render_prometheus(FILE* out)
+{
+    uint64_t totals[COUNTER_COUNT];
+    sum_counters(totals);
+
+    for(int i = 0; i < COUNTER_COUNT; ++i)
+    {
+        fprintf(out, "# HELP gndcontrol_%s %s\n# TYPE gndcontrol_%s counter\n"
+            "gndcontrol_%s %llu\n", counter_names[i], counter_help[i],
+            counter_names[i], counter_names[i], (unsigned long long)totals[i]);
+    }
+    fprintf(out, "# HELP gndcontrol_connected_planes Planes connected now\n"
+        "# TYPE gndcontrol_connected_planes gauge\n"
+        "gndcontrol_connected_planes %lld\n",
+        (long long)(totals[COUNTER_CONNECTS] - totals[COUNTER_DISCONNECTS]));
+    for(int i = 0; i < GAUGE_COUNT; ++i)
+    {
+        fprintf(out, "# HELP gndcontrol_%s %s\n# TYPE gndcontrol_%s gauge\n"
+            "gndcontrol_%s %lld\n", gauge_names[i], gauge_help[i],
+            gauge_names[i], gauge_names[i], (long long)atomic_load(&gauges[i]));
+    }
+
+    uint64_t* buckets = malloc(HISTOGRAM_BUCKETS * sizeof(uint64_t));
+    if(buckets == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(int i = 0; i < histogram_count; ++i)
+    {
+        const histogram_info* info = &histogram_infos[i];
+        // Histograms sharing a name (one per command) share one header
+        if(i == 0 || strcmp(histogram_infos[i - 1].name, info->name) != 0)
+        {
+            fprintf(out, "# HELP gndcontrol_%s_seconds %s\n# TYPE gndcontrol_%s_seconds histogram\n",
+                info->name, info->help, info->name);
+        }
+
+        const char* label = info->label != NULL ? info->label : "";
+        const char* comma = info->label != NULL ? "," : "";
+        uint64_t count, sum, max;
+        sum_histogram(i, &count, &sum, &max, buckets);
+
+        uint64_t seen = 0;
+        size_t b = 0;
+        for(int shift = EXPORT_FIRST_SHIFT; shift <= EXPORT_LAST_SHIFT; shift += 2)
+        {
+            uint64_t bound = (uint64_t)1 << shift;
+            while(b < HISTOGRAM_BUCKETS && bucket_top(b) < bound)
+            {
+                seen += buckets[b++];
+            }
+            fprintf(out, "gndcontrol_%s_seconds_bucket{%s%sle=\"%g\"} %llu\n", info->name,
+                label, comma, bound / 1e9, (unsigned long long)seen);
+        }
+        fprintf(out, "gndcontrol_%s_seconds_bucket{%s%sle=\"+Inf\"} %llu\n", info->name,
+            label, comma, (unsigned long long)count);
+        fprintf(out, "gndcontrol_%s_seconds_sum%s%s%s %.9f\n", info->name,
+            info->label != NULL ? "{" : "", label, info->label != NULL ? "}" : "",
+            sum / 1e9);
+        fprintf(out, "gndcontrol_%s_seconds_count%s%s%s %llu\n", info->name,
+            info->label != NULL ? "{" : "", label, info->label != NULL ? "}" : "",
+            (unsigned long long)count);
+    }
+    free(buckets);
+    fprintf(out, "# EOF\n");
+}
+
+/*
+ Renders every metric in the given format (METRICS_TEXT or
+ METRICS_PROMETHEUS). Returns a buffer the caller frees, and its length
+ in "len".
+*/
+char* metrics_render(int format, size_t* len)
+{
+    char* text = NULL;
+    FILE* out = open_memstream(&text, len);
+    if(out == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if(format == METRICS_PROMETHEUS)
+    {
+        render_prometheus(out);
+    }
+    else
+    {
+        render_text(out);
+    }
+
+    fclose(out);
+    return text;
+}
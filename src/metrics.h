@@ -0,0 +1,79 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Server metrics: counters, gauges and latency histograms. Counters and
+// histograms are kept per thread, so recording is a few plain stores to
+// memory no other thread writes; a report sums every thread's copy.
+// Gauges have a single writer and are stored directly.
+//
+// Histograms are HDR-style: values (nanoseconds) are bucketed by power of
+// two, and each power of two is split into HISTOGRAM_SUB_BUCKETS linear
+// steps, so any value is known to within about 6%. Histograms are
+// registered by name at startup, before any thread records.
+
+#define METRICS_COUNTERS(X) \
+    X(COUNTER_CONNECTS, "connects_total", "Plane connections accepted") \
+    X(COUNTER_DISCONNECTS, "disconnects_total", "Plane connections closed") \
+    X(COUNTER_UNKNOWN_COMMANDS, "unknown_commands_total", "Lines that were not a command") \
+    X(COUNTER_REJECTED_COMMANDS, "rejected_commands_total", "Commands refused in the plane's state") \
+    X(COUNTER_TAKEOFFS, "takeoffs_total", "TAKEOFF clearances sent") \
+    X(COUNTER_STEALS, "work_steals_total", "Connections run by a worker that stole them") \
+    X(COUNTER_JOURNAL_RECORDS, "journal_records_total", "Records written to the journal") \
+    X(COUNTER_JOURNAL_SYNCS, "journal_syncs_total", "Journal syncs, each covering a group of records")
+
+#define METRICS_GAUGES(X) \
+    X(GAUGE_TAXI_QUEUE, "taxi_queue_depth", "Planes in the taxi queue")
+
+enum {
+#define METRIC_NAME(name, text, help) name,
+    METRICS_COUNTERS(METRIC_NAME)
+    COUNTER_COUNT
+};
+
+enum {
+    METRICS_GAUGES(METRIC_NAME)
+#undef METRIC_NAME
+    GAUGE_COUNT
+};
+
+#define METRICS_MAX_HISTOGRAMS 16
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+#define METRICS_TEXT 0
+#define METRICS_PROMETHEUS 1
+
+typedef struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+typedef struct metrics_block {
+    atomic_uint_fast64_t counters[COUNTER_COUNT];
+    histogram histograms[METRICS_MAX_HISTOGRAMS];
+    struct metrics_block* next;
+} metrics_block;
+
+int metrics_histogram(const char* name, const char* label, const char* help);
+void metrics_count(int counter);
+void metrics_record(int histogram, uint64_t nanoseconds);
+void metrics_set(int gauge, int64_t value);
+char* metrics_render(int format, size_t* len);
+
+// Nanoseconds on the monotonic clock, for timing what gets recorded
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
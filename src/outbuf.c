@@ -0,0 +1,375 @@
+// Gathers replies for a connection and writes them in as few system
+// calls as possible.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "outbuf.h"
+
+#define OUTBUF_MIN_CAPACITY 512
+#define OUTBUF_MAX_PARTS 8
+
+static void lock(outbuf* out)
+{
+    if(pthread_mutex_lock(&out->lock) != 0)
+    {
+        fprintf(stderr, "Could not lock output buffer");
+        exit(1);
+    }
+}
+
+static void unlock(outbuf* out)
+{
+    if(pthread_mutex_unlock(&out->lock) != 0)
+    {
+        fprintf(stderr, "Could not unlock output buffer");
+        exit(1);
+    }
+}
+
+void outbuf_init(outbuf* out, int fd)
+{
+    if(pthread_mutex_init(&out->lock, NULL) != 0)
+    {
+        fprintf(stderr, "Could not initialize output buffer mutex");
+        exit(1);
+    }
+    out->fd = fd;
+    out->data = NULL;
+    out->start = 0;
+    out->used = 0;
+    out->cap = 0;
+    out->blocked = false;
+    out->failed = false;
+    out->on_blocked = NULL;
+    out->send = NULL;
+    out->context = NULL;
+    out->sending = false;
+    out->sending_cap = 0;
+    out->spare = NULL;
+    out->spare_cap = 0;
+}
+
+void outbuf_set_blocked_hook(outbuf* out, OutbufBlocked hook, void* context)
+{
+    lock(out);
+    out->on_blocked = hook;
+    out->context = context;
+    unlock(out);
+}
+
+/*
+ Has "send" send the buffer from now on, instead of writing the socket.
+ Set before anything is written.
+*/
+void outbuf_set_sender(outbuf* out, OutbufSend send, void* context)
+{
+    lock(out);
+    out->send = send;
+    out->context = context;
+    unlock(out);
+}
+
+// Adds bytes to the end of the buffer. The caller holds the lock.
+static void buffer(outbuf* out, const char* bytes, size_t len)
+{
+    if(out->used + len > out->cap)
+    {
+        // Reclaim what has been written before growing
+        if(out->start > 0)
+        {
+            memmove(out->data, out->data + out->start, out->used - out->start);
+            out->used -= out->start;
+            out->start = 0;
+        }
+
+        size_t cap = out->cap < OUTBUF_MIN_CAPACITY ? OUTBUF_MIN_CAPACITY : out->cap;
+        while(out->used + len > cap)
+        {
+            cap *= 2;
+        }
+        if(cap != out->cap)
+        {
+            char* data = realloc(out->data, cap);
+            if(data == NULL)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+            out->data = data;
+            out->cap = cap;
+        }
+    }
+
+    memcpy(out->data + out->used, bytes, len);
+    out->used += len;
+}
+
+/*
+ Sender mode: hands everything buffered to the sender if nothing is in
+ flight, and starts a fresh buffer in the spare. The caller holds the
+ lock. Returns true if nothing is left waiting.
+*/
+static bool hand_off(outbuf* out)
+{
+    if(!out->sending && out->used > out->start)
+    {
+        // Nothing is ever partly written here, so start is 0
+        char* data = out->data;
+        size_t len = out->used;
+        out->sending = true;
+        out->sending_cap = out->cap;
+        out->data = out->spare;
+        out->cap = out->spare_cap;
+        out->spare = NULL;
+        out->spare_cap = 0;
+        out->start = out->used = 0;
+        out->send(out->context, data, len);
+    }
+    return out->used == out->start;
+}
+
+/*
+ Writes the buffered bytes followed by "parts" with one writev, and
+ buffers whatever the socket didn't take. The caller holds the lock.
+ Returns true once nothing is left.
+*/
+static bool write_out(outbuf* out, const struct iovec* parts, int count)
+{
+    if(out->failed)
+    {
+        return true;
+    }
+
+    if(out->send != NULL)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            buffer(out, parts[i].iov_base, parts[i].iov_len);
+        }
+        return hand_off(out);
+    }
+
+    struct iovec iov[OUTBUF_MAX_PARTS + 1];
+    int n = 0;
+    size_t total = 0;
+
+    if(out->used > out->start)
+    {
+        iov[n].iov_base = out->data + out->start;
+        iov[n].iov_len = out->used - out->start;
+        total += iov[n++].iov_len;
+    }
+    for(int i = 0; i < count; ++i)
+    {
+        iov[n++] = parts[i];
+        total += parts[i].iov_len;
+    }
+
+    ssize_t written = 0;
+    if(total > 0)
+    {
+        do
+        {
+            written = writev(out->fd, iov, n);
+        } while(written < 0 && errno == EINTR);
+
+        if(written < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                // The reader will see the connection go away
+                out->failed = true;
+                out->start = out->used = 0;
+                return true;
+            }
+            written = 0;
+        }
+    }
+
+    // Drop what went out, then keep the rest in order
+    size_t skip = written;
+    size_t buffered = out->used - out->start;
+    if(skip >= buffered)
+    {
+        skip -= buffered;
+        out->start = out->used = 0;
+    }
+    else
+    {
+        out->start += skip;
+        skip = 0;
+    }
+
+    for(int i = 0; i < count; ++i)
+    {
+        if(skip >= parts[i].iov_len)
+        {
+            skip -= parts[i].iov_len;
+            continue;
+        }
+        buffer(out, (const char*)parts[i].iov_base + skip, parts[i].iov_len - skip);
+        skip = 0;
+    }
+
+    // Tell the owner when it has to start or can stop waiting for the
+    // socket. Doing it under the lock keeps the calls in order.
+    bool blocked = out->used > out->start;
+    if(blocked != out->blocked)
+    {
+        out->blocked = blocked;
+        if(out->on_blocked != NULL)
+        {
+            out->on_blocked(out->context, blocked);
+        }
+    }
+    return !blocked;
+}
+
+/*
+ Buffers one message made of "count" parts (at most OUTBUF_MAX_PARTS).
+ Nothing is written until the next flush.
+*/
+void outbuf_append(outbuf* out, const struct iovec* parts, int count)
+{
+    lock(out);
+    if(!out->failed)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            buffer(out, parts[i].iov_base, parts[i].iov_len);
+        }
+    }
+    unlock(out);
+}
+
+/*
+ Sends one message right away, after anything already buffered.
+*/
+void outbuf_write_now(outbuf* out, const struct iovec* parts, int count)
+{
+    lock(out);
+    write_out(out, parts, count);
+    unlock(out);
+}
+
+/*
+ Moves "flag" from "from" to "to" and sends one message right away, with
+ the buffer locked throughout: whatever a thread that saw the new value
+ appends goes after the message. Returns false, sending nothing, if the
+ flag no longer held "from".
+*/
+bool outbuf_write_now_setting(outbuf* out, const struct iovec* parts, int count,
+    atomic_int* flag, int from, int to)
+{
+    lock(out);
+    bool moved = atomic_compare_exchange_strong(flag, &from, to);
+    if(moved)
+    {
+        write_out(out, parts, count);
+    }
+    unlock(out);
+    return moved;
+}
+
+/*
+ Writes out everything buffered. Returns true if it all went, false if
+ some is still waiting for the socket to become writable.
+*/
+bool outbuf_flush(outbuf* out)
+{
+    lock(out);
+    bool done = write_out(out, NULL, 0);
+    unlock(out);
+    return done;
+}
+
+/*
+ Sender mode: the owner reports that the bytes handed over in "data"
+ have gone, or with "failed" that the peer is gone. The buffer takes
+ "data" back and hands over whatever was buffered meanwhile. Returns
+ true if nothing is left waiting.
+*/
+bool outbuf_sent(outbuf* out, char* data, bool failed)
+{
+    lock(out);
+    out->sending = false;
+    if(out->spare == NULL)
+    {
+        out->spare = data;
+        out->spare_cap = out->sending_cap;
+    }
+    else
+    {
+        free(data);
+    }
+
+    bool done;
+    if(failed || out->failed)
+    {
+        out->failed = true;
+        out->start = out->used = 0;
+        done = true;
+    }
+    else
+    {
+        done = hand_off(out);
+    }
+    unlock(out);
+    return done;
+}
+
+/*
+ Calls the blocked hook with whether bytes are still waiting, so the owner
+ can redo what it decided there.
+*/
+void outbuf_notify(outbuf* out)
+{
+    lock(out);
+    if(out->on_blocked != NULL)
+    {
+        out->on_blocked(out->context, out->blocked);
+    }
+    unlock(out);
+}
+
+size_t outbuf_pending(outbuf* out)
+{
+    lock(out);
+    size_t pending = out->used - out->start;
+    unlock(out);
+    return pending;
+}
+
+/*
+ Points "data" at the bytes buffered and not written yet, and returns how
+ many there are. They stay put only while nothing else uses the buffer.
+*/
+size_t outbuf_peek(outbuf* out, const char** data)
+{
+    lock(out);
+    *data = out->data + out->start;
+    size_t pending = out->used - out->start;
+    unlock(out);
+    return pending;
+}
+
+/*
+ Frees the buffer. In sender mode, bytes still in flight belong to the
+ owner.
+*/
+void outbuf_destroy(outbuf* out)
+{
+    free(out->data);
+    out->data = NULL;
+    free(out->spare);
+    out->spare = NULL;
+    if(pthread_mutex_destroy(&out->lock) != 0)
+    {
+        fprintf(stderr, "Could not destroy output buffer mutex");
+        exit(1);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef OUT_BUF_H
+#define OUT_BUF_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Per-connection output buffer. Replies produced while a batch of input
+// is handled are gathered here and go out together with one write when
+// the batch is done (outbuf_flush). Urgent messages can be written
+// straight away with outbuf_write_now, which sends whatever is already
+// gathered and the new message in a single writev. The socket is
+// non-blocking: what the kernel won't take stays buffered, and the
+// blocked hook tells the owner to call outbuf_flush again once the socket
+// is writable (and, with blocked false, that it can stop). The hook runs
+// with the buffer locked; outbuf_notify runs it again with the current
+// state for an owner whose answer to it has changed. Safe to use from
+// several threads.
+//
+// An owner that sends by completion (io_uring) sets a sender instead,
+// and the buffer never writes the socket itself. Whenever nothing is in
+// flight and bytes are buffered, they are handed to the sender in one
+// piece; the owner reports the send done with outbuf_sent, and what was
+// buffered meanwhile goes next. The sender runs with the buffer locked,
+// on whichever thread flushed.
+
+typedef void (*OutbufBlocked)(void* context, bool blocked);
+typedef void (*OutbufSend)(void* context, char* data, size_t len);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int fd;
+    char* data;
+    size_t start;         // First byte not written yet
+    size_t used;          // End of the buffered bytes
+    size_t cap;
+    bool blocked;         // Bytes are waiting for the socket
+    bool failed;          // The peer is gone; drop everything
+    OutbufBlocked on_blocked;
+    OutbufSend send;
+    void* context;
+    bool sending;         // The sender has bytes in flight
+    size_t sending_cap;   // Size of the buffer they are in
+    char* spare;          // The last buffer sent, kept for reuse
+    size_t spare_cap;
+} outbuf;
+
+void outbuf_init(outbuf* out, int fd);
+void outbuf_set_blocked_hook(outbuf* out, OutbufBlocked hook, void* context);
+void outbuf_set_sender(outbuf* out, OutbufSend send, void* context);
+bool outbuf_sent(outbuf* out, char* data, bool failed);
+void outbuf_append(outbuf* out, const struct iovec* parts, int count);
+void outbuf_write_now(outbuf* out, const struct iovec* parts, int count);
+bool outbuf_write_now_setting(outbuf* out, const struct iovec* parts, int count,
+    atomic_int* flag, int from, int to);
+bool outbuf_flush(outbuf* out);
+void outbuf_notify(outbuf* out);
+size_t outbuf_pending(outbuf* out);
+size_t outbuf_peek(outbuf* out, const char** data);
+void outbuf_destroy(outbuf* out);
+
+#endif
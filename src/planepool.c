@@ -0,0 +1,74 @@
+// The plane pool. Each slab holds its planes in one array and their cold
+// halves in another, so walking or hashing over planes only pulls in the
+// hot fields, one cache line per plane.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "planepool.h"
+
+_Static_assert(sizeof(airplane) == 64, "the hot part of a plane should fill one cache line");
+
+typedef struct planeslab {
+    airplane planes[PLANEPOOL_SLAB];
+    airplane_cold cold[PLANEPOOL_SLAB];
+    struct planeslab* next;
+} planeslab;
+
+static planeslab* slabs;
+static airplane* free_planes;   // Chained through cold->next_free
+
+static void add_slab(void)
+{
+    planeslab* slab = aligned_alloc(_Alignof(planeslab), sizeof(planeslab));
+    if(slab == NULL)
+    {
+        perror("planepool - adding slab");
+        exit(1);
+    }
+    slab->next = slabs;
+    slabs = slab;
+
+    // Chained in reverse so planes are handed out in address order
+    for(int i = PLANEPOOL_SLAB - 1; i >= 0; --i)
+    {
+        slab->planes[i].cold = &slab->cold[i];
+        slab->cold[i].next_free = free_planes;
+        free_planes = &slab->planes[i];
+    }
+}
+
+/*
+ Returns an unused plane with its cold half attached. Nothing else is
+ set up; that is airplane_init's job.
+*/
+airplane* planepool_alloc(void)
+{
+    if(free_planes == NULL)
+    {
+        add_slab();
+    }
+    airplane* plane = free_planes;
+    free_planes = plane->cold->next_free;
+    return plane;
+}
+
+/*
+ Puts a plane back for reuse. It must have been destroyed already.
+*/
+void planepool_free(airplane* plane)
+{
+    plane->cold->next_free = free_planes;
+    free_planes = plane;
+}
+
+void planepool_destroy(void)
+{
+    while(slabs != NULL)
+    {
+        planeslab* next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    free_planes = NULL;
+}
@@ -0,0 +1,18 @@
+#ifndef PLANE_POOL_H
+#define PLANE_POOL_H
+
+#include "airplane.h"
+
+// Slab allocator for airplane records. Planes are handed out from slabs
+// that are never moved or given back, so a plane keeps its address for as
+// long as it is in use, and a freed plane is reused by the next
+// connection without going to malloc. Not thread-safe on its own; the
+// flight list calls it under flightlist_lock.
+
+#define PLANEPOOL_SLAB 256
+
+airplane* planepool_alloc(void);
+void planepool_free(airplane* plane);
+void planepool_destroy(void);
+
+#endif
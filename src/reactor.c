@@ -0,0 +1,620 @@
+// The reactor module dispatches readiness events from an epoll instance,
+// or completions from an io_uring.
+// One thread services all of the descriptors registered with a reactor,
+// so the number of planes no longer dictates the number of threads.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "reactor.h"
+#include "uring.h"
+#include "metrics.h"
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_WORK_BATCH 64   // Work items run between polls
+
+#define REACTOR_URING_ENTRIES 1024
+#define REACTOR_BUFFER_COUNT 1024   // Provided receive buffers, a power of two
+#define REACTOR_BUFFER_SIZE 1024
+
+_Static_assert(REACTOR_MORE == IORING_CQE_F_MORE, "REACTOR_MORE must match io_uring");
+
+struct reactor {
+    int backend;
+    int epoll_fd;
+    int wake_fd;                // eventfd that ends a sleeping epoll_wait
+    reactor_handler wake_handler;
+    atomic_bool sleeping;       // Blocked in epoll_wait with no work
+    _Atomic(work_item*) retired;
+    int index;
+    workdeque work;
+    uring ring;                 // REACTOR_URING only
+    reactor_op epoll_op;        // Multishot poll of epoll_fd through the ring
+    bool epoll_again;           // The last look at epoll_fd found events
+    work_item park_item;        // Holds the thread in reactor_pause_all
+};
+
+// Every reactor, for stealing and waking. Reactors are all created while
+// the server starts, before any of them runs.
+static reactor** reactors;
+static int reactor_count;
+
+static _Thread_local reactor* current;
+
+// reactor_pause_all waits on park_condition for every reactor to be
+// parked; parked reactors wait on it for "parking" to end
+static pthread_mutex_t park_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_condition = PTHREAD_COND_INITIALIZER;
+static bool parking;
+static int parked;
+
+static void on_wake(void* context, uint32_t events)
+{
+    reactor* r = context;
+    uint64_t count;
+    if(read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("read wake");
+    }
+}
+
+/*
+ Sets up the reactor's io_uring. Returns false, having said why, if the
+ kernel can't provide one.
+*/
+static bool create_ring(reactor* r)
+{
+    static bool warned;
+    int ret = uring_init(&r->ring, REACTOR_URING_ENTRIES, REACTOR_BUFFER_COUNT,
+        REACTOR_BUFFER_SIZE);
+    if(ret < 0)
+    {
+        if(!warned)
+        {
+            fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(-ret));
+            warned = true;
+        }
+        return false;
+    }
+    return true;
+}
+
+/*
+ Creates a reactor with the given backend (REACTOR_EPOLL or
+ REACTOR_URING). A reactor asked for io_uring falls back to epoll when
+ the kernel lacks it; reactor_backend tells which it got.
+*/
+reactor* reactor_create(int backend)
+{
+    reactor* r = aligned_alloc(_Alignof(reactor), sizeof(reactor));
+    reactor** grown = realloc(reactors, (reactor_count + 1) * sizeof(reactor*));
+    if(r == NULL || grown == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(r->epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->wake_fd < 0)
+    {
+        perror("eventfd");
+        exit(1);
+    }
+    r->wake_handler.callback = on_wake;
+    r->wake_handler.context = r;
+    if(reactor_watch(r, r->wake_fd, EPOLLIN, &r->wake_handler) != 0)
+    {
+        exit(1);
+    }
+
+    atomic_init(&r->sleeping, false);
+    atomic_init(&r->retired, NULL);
+    workdeque_init(&r->work);
+
+    r->backend = REACTOR_EPOLL;
+    r->epoll_again = false;
+    if(backend == REACTOR_URING && create_ring(r))
+    {
+        r->backend = REACTOR_URING;
+    }
+
+    r->index = reactor_count;
+    reactors = grown;
+    reactors[reactor_count++] = r;
+    return r;
+}
+
+int reactor_backend(reactor* r)
+{
+    return r->backend;
+}
+
+int reactor_watch(reactor* r, int fd, uint32_t events, reactor_handler* handler)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handler;
+
+    if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        perror("epoll_ctl add");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ Changes the events a watched descriptor is waited for. Any thread may
+ call this.
+*/
+int reactor_modify(reactor* r, int fd, uint32_t events, reactor_handler* handler)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handler;
+
+    if(epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0)
+    {
+        perror("epoll_ctl mod");
+        return -1;
+    }
+
+    return 0;
+}
+
+void reactor_unwatch(reactor* r, int fd)
+{
+    if(epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0)
+    {
+        perror("epoll_ctl del");
+    }
+}
+
+/*
+ Wakes one sleeping reactor so it can steal. The fence pairs with the
+ one a reactor goes through between raising its sleeping flag and its
+ last look for work, so either it sees the new work or we see the flag.
+*/
+static void wake_idle(reactor* self)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    for(int i = 1; i < reactor_count; ++i)
+    {
+        reactor* r = reactors[(self->index + i) % reactor_count];
+        bool expected = true;
+        if(atomic_load_explicit(&r->sleeping, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&r->sleeping, &expected, false))
+        {
+            uint64_t one = 1;
+            if(write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            {
+                perror("write wake");
+            }
+            return;
+        }
+    }
+}
+
+/*
+ Queues work on the calling thread's reactor. Must be called from a
+ reactor thread (from an event callback or a work item). If the deque is
+ full the work runs right away instead.
+*/
+void reactor_submit(work_item* item)
+{
+    reactor* r = current;
+    if(!workdeque_push(&r->work, item))
+    {
+        item->run(item->context);
+        return;
+    }
+
+    // The owner will get to one item itself; anything beyond that is
+    // worth another thread
+    if(workdeque_size(&r->work) > 1)
+    {
+        wake_idle(r);
+    }
+}
+
+/*
+ Has the reactor's own thread run "item" before it next waits for
+ events. Any thread may call this.
+*/
+void reactor_retire(reactor* r, work_item* item)
+{
+    item->next = atomic_load(&r->retired);
+    while(!atomic_compare_exchange_weak(&r->retired, &item->next, item))
+    {
+    }
+}
+
+/*
+ Like reactor_retire, but also wakes the reactor if it is waiting, so
+ "item" runs soon. Any thread may call this.
+*/
+void reactor_post(reactor* r, work_item* item)
+{
+    reactor_retire(r, item);
+    if(r != current)
+    {
+        uint64_t one = 1;
+        if(write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            perror("write wake");
+        }
+    }
+}
+
+// Whether the calling thread is the one running "r"
+bool reactor_is_current(reactor* r)
+{
+    return current == r;
+}
+
+/*
+ Accepts connections on "listener" until cancelled; each completion's
+ result is a new non-blocking socket or -errno. The operation stays
+ armed while completions carry REACTOR_MORE. io_uring only, and like the
+ other operations, only on the reactor's thread (or before it runs).
+*/
+void reactor_accept(reactor* r, int listener, reactor_op* op)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&r->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+}
+
+/*
+ Receives up to "len" bytes from "fd" into one of the reactor's
+ buffers. The completion's result is the byte count (0 at end of
+ stream); reactor_recv_buffer finds the bytes, and reactor_recv_release
+ must give the buffer back. Fails with -ENOBUFS if the reactor has no
+ buffer free.
+*/
+void reactor_recv(reactor* r, int fd, size_t len, reactor_op* op)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&r->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = len < REACTOR_BUFFER_SIZE ? len : REACTOR_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+}
+
+char* reactor_recv_buffer(reactor* r, uint32_t flags)
+{
+    return uring_buffer(&r->ring, flags);
+}
+
+void reactor_recv_release(reactor* r, uint32_t flags)
+{
+    uring_buffer_return(&r->ring, flags);
+}
+
+/*
+ Sends "len" bytes from "data", which must stay put until the
+ completion. The result may be a short count.
+*/
+void reactor_send(reactor* r, int fd, const char* data, size_t len, reactor_op* op)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&r->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+}
+
+/*
+ Cancels the operation started with "op", if it is still waiting. It
+ completes with -ECANCELED.
+*/
+void reactor_cancel(reactor* r, reactor_op* op)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&r->ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)op;
+    sqe->user_data = 0;   // Nobody waits for the cancel itself
+}
+
+/*
+ Submits the operations started so far without waiting for the loop.
+ Needed before closing a descriptor they name: the kernel looks the
+ descriptor up when it takes the submission.
+*/
+void reactor_flush(reactor* r)
+{
+    if(r->backend == REACTOR_URING)
+    {
+        int ret;
+        while((ret = uring_enter(&r->ring, 0)) == -EINTR)
+        {
+        }
+    }
+}
+
+// Work item: holds a reactor's thread until reactor_resume_all
+static void park(void* context)
+{
+    pthread_mutex_lock(&park_mutex);
+    parked++;
+    pthread_cond_broadcast(&park_condition);
+    while(parking)
+    {
+        pthread_cond_wait(&park_condition, &park_mutex);
+    }
+    parked--;
+    pthread_mutex_unlock(&park_mutex);
+}
+
+/*
+ Stops every reactor thread between two pieces of work and returns once
+ all of them have. Until reactor_resume_all nothing dispatches events or
+ runs work: no connection runs, and work queued meanwhile waits. Must be
+ called from a thread that isn't a reactor's.
+*/
+void reactor_pause_all(void)
+{
+    pthread_mutex_lock(&park_mutex);
+    parking = true;
+    pthread_mutex_unlock(&park_mutex);
+
+    for(int i = 0; i < reactor_count; ++i)
+    {
+        reactors[i]->park_item.run = park;
+        reactors[i]->park_item.context = reactors[i];
+        reactor_post(reactors[i], &reactors[i]->park_item);
+    }
+
+    pthread_mutex_lock(&park_mutex);
+    while(parked < reactor_count)
+    {
+        pthread_cond_wait(&park_condition, &park_mutex);
+    }
+    pthread_mutex_unlock(&park_mutex);
+}
+
+void reactor_resume_all(void)
+{
+    pthread_mutex_lock(&park_mutex);
+    parking = false;
+    pthread_cond_broadcast(&park_condition);
+    pthread_mutex_unlock(&park_mutex);
+}
+
+static void run_retired(reactor* r)
+{
+    work_item* item = atomic_exchange(&r->retired, NULL);
+    while(item != NULL)
+    {
+        work_item* next = item->next;
+        item->run(item->context);
+        item = next;
+    }
+}
+
+// Takes the oldest item from the first other reactor that has one
+static work_item* steal_work(reactor* self)
+{
+    for(int i = 1; i < reactor_count; ++i)
+    {
+        reactor* r = reactors[(self->index + i) % reactor_count];
+        if(workdeque_size(&r->work) > 0)
+        {
+            work_item* item = workdeque_steal(&r->work);
+            if(item != NULL)
+            {
+                metrics_count(COUNTER_STEALS);
+                return item;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void run_work(reactor* r)
+{
+    // Newest first, then back to the sockets
+    for(int i = 0; i < REACTOR_WORK_BATCH; ++i)
+    {
+        work_item* item = workdeque_pop(&r->work);
+        if(item == NULL)
+        {
+            break;
+        }
+        item->run(item->context);
+    }
+}
+
+static void run_epoll(reactor* r)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while(1)
+    {
+        run_retired(r);
+
+        // With work of its own the reactor only polls. Without, it helps
+        // another reactor, and sleeps only if there was nothing to take.
+        int timeout = 0;
+        if(workdeque_size(&r->work) == 0)
+        {
+            work_item* stolen = steal_work(r);
+            if(stolen == NULL)
+            {
+                atomic_store(&r->sleeping, true);
+                stolen = steal_work(r);
+                if(stolen == NULL)
+                {
+                    timeout = -1;
+                }
+                else
+                {
+                    atomic_store(&r->sleeping, false);
+                }
+            }
+            if(stolen != NULL)
+            {
+                stolen->run(stolen->context);
+            }
+        }
+
+        int ready = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+        atomic_store(&r->sleeping, false);
+        if(ready < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for(int i = 0; i < ready; ++i)
+        {
+            reactor_handler* handler = events[i].data.ptr;
+            handler->callback(handler->context, events[i].events);
+        }
+
+        run_work(r);
+    }
+}
+
+/*
+ Dispatches what the epoll instance has ready without waiting. A ready
+ descriptor that isn't drained stays ready without waking the poll
+ again, so the loop keeps looking until a look finds nothing.
+*/
+static void dispatch_epoll(reactor* r)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int ready = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, 0);
+    if(ready < 0 && errno != EINTR)
+    {
+        perror("epoll_wait");
+        exit(1);
+    }
+
+    r->epoll_again = ready != 0;
+    for(int i = 0; i < ready; ++i)
+    {
+        reactor_handler* handler = events[i].data.ptr;
+        handler->callback(handler->context, events[i].events);
+    }
+}
+
+static void arm_epoll_poll(reactor* r)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&r->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->epoll_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uint64_t)(uintptr_t)&r->epoll_op;
+}
+
+static void on_epoll_ready(void* context, int result, uint32_t flags)
+{
+    reactor* r = context;
+    if(!(flags & REACTOR_MORE))
+    {
+        arm_epoll_poll(r);
+    }
+    dispatch_epoll(r);
+}
+
+/*
+ The io_uring loop. Each pass submits everything started since the last
+ one and reaps every completion with a single system call, and only
+ blocks when there is nothing else to do. Connections run this way stay
+ on their owner, so there is nothing to steal.
+*/
+static void run_uring(reactor* r)
+{
+    r->epoll_op.callback = on_epoll_ready;
+    r->epoll_op.context = r;
+    arm_epoll_poll(r);
+
+    while(1)
+    {
+        run_retired(r);
+        if(r->epoll_again)
+        {
+            dispatch_epoll(r);
+        }
+        run_work(r);
+
+        bool idle = !r->epoll_again && workdeque_size(&r->work) == 0 &&
+            atomic_load(&r->retired) == NULL;
+        int ret = uring_enter(&r->ring, idle ? 1 : 0);
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+        {
+            fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+            exit(1);
+        }
+
+        struct io_uring_cqe* cqe;
+        while((cqe = uring_peek(&r->ring)) != NULL)
+        {
+            reactor_op* op = (reactor_op*)(uintptr_t)cqe->user_data;
+            int result = cqe->res;
+            uint32_t flags = cqe->flags;
+            uring_seen(&r->ring);
+            if(op != NULL)
+            {
+                op->callback(op->context, result, flags);
+            }
+        }
+    }
+}
+
+/*
+ Runs the event loop in the calling thread. Does not return.
+*/
+void reactor_run(reactor* r)
+{
+    current = r;
+    if(r->backend == REACTOR_URING)
+    {
+        run_uring(r);
+    }
+    else
+    {
+        run_epoll(r);
+    }
+}
+
+void reactor_destroy(reactor* r)
+{
+    run_retired(r);
+    if(r->backend == REACTOR_URING)
+    {
+        uring_destroy(&r->ring);
+    }
+    close(r->wake_fd);
+    close(r->epoll_fd);
+    free(r);
+}
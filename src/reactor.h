@@ -0,0 +1,86 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "workdeque.h"
+
+// Callback invoked from the reactor thread when a watched descriptor
+// becomes ready. "events" is the epoll event mask that fired.
+typedef void (*ReactorCallback)(void* context, uint32_t events);
+
+// Owned by the caller and passed to reactor_watch. It must stay valid
+// until the descriptor has been removed with reactor_unwatch.
+typedef struct {
+    ReactorCallback callback;
+    void* context;
+} reactor_handler;
+
+// Callback invoked from the reactor thread when an operation started on
+// the reactor's io_uring completes. "result" is what the operation
+// returned: a byte count, a new descriptor, or -errno. "flags" are the
+// completion's flags; REACTOR_MORE says a multishot operation is still
+// armed.
+typedef void (*ReactorCompletion)(void* context, int result, uint32_t flags);
+
+// Owned by the caller and passed when an operation is started. It must
+// stay valid until the operation's last completion.
+typedef struct {
+    ReactorCompletion callback;
+    void* context;
+} reactor_op;
+
+#define REACTOR_EPOLL 0
+#define REACTOR_URING 1
+
+#define REACTOR_MORE (1U << 1)   // IORING_CQE_F_MORE
+
+// A reactor is one epoll instance plus the thread that runs it. Each
+// worker shard owns exactly one.
+//
+// The reactor threads are also the server's worker pool. Besides
+// dispatching events, each has a deque of work items (reactor_submit)
+// that it runs between polls. A reactor with nothing to do steals work
+// from the others before it goes to sleep in epoll_wait, and a reactor
+// that queues more than it can start right away wakes a sleeping one.
+// Work can therefore run on any reactor thread, not only the one that
+// owns the socket. Memory that events of a socket may still point to is
+// freed with reactor_retire, on the owning reactor's thread after it has
+// dispatched every event it already has. reactor_pause_all holds every
+// reactor thread still, for handing the server over to a new instance
+// (see upgrade.h).
+//
+// A reactor created with REACTOR_URING waits on an io_uring instead, if
+// the kernel has one recent enough, and can also run sockets by
+// completion: accepts, receives into buffers it provides and sends
+// started with the reactor_ calls below, which are all submitted
+// together when the reactor next waits. Such operations may only be
+// started on the reactor's own thread, so a connection run this way
+// stays with its owner. Watched descriptors still work; the epoll
+// instance is itself polled through the ring.
+typedef struct reactor reactor;
+
+reactor* reactor_create(int backend);
+int reactor_backend(reactor* r);
+int reactor_watch(reactor* r, int fd, uint32_t events, reactor_handler* handler);
+int reactor_modify(reactor* r, int fd, uint32_t events, reactor_handler* handler);
+void reactor_unwatch(reactor* r, int fd);
+void reactor_submit(work_item* item);
+void reactor_retire(reactor* r, work_item* item);
+void reactor_post(reactor* r, work_item* item);
+bool reactor_is_current(reactor* r);
+void reactor_accept(reactor* r, int listener, reactor_op* op);
+void reactor_recv(reactor* r, int fd, size_t len, reactor_op* op);
+char* reactor_recv_buffer(reactor* r, uint32_t flags);
+void reactor_recv_release(reactor* r, uint32_t flags);
+void reactor_send(reactor* r, int fd, const char* data, size_t len, reactor_op* op);
+void reactor_cancel(reactor* r, reactor_op* op);
+void reactor_flush(reactor* r);
+void reactor_pause_all(void);
+void reactor_resume_all(void);
+void reactor_run(reactor* r);
+void reactor_destroy(reactor* r);
+
+#endif
@@ -0,0 +1,146 @@
+// Runway separation rules: how long a runway has to stay empty after one
+// departure before the next plane may be cleared. The time depends on the
+// wake turbulence category of the plane that left (the leader) and the one
+// about to go (the follower).
+
+// The protocol doesn't carry an aircraft type, so categories come from
+// flight id prefixes listed in the separation file. Unlisted flights are
+// WAKE_MEDIUM. The file has one rule per line:
+//
+//   # leader follower seconds
+//   HEAVY LIGHT 8
+//   # category for flight ids starting with a prefix
+//   prefix HEAVY ba
+//
+// Blank lines and lines starting with '#' are ignored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "separation.h"
+#include "airplane.h"
+
+#define MAX_PREFIXES 64
+
+typedef struct {
+    char prefix[PLANE_MAXID+1];
+    size_t length;
+    int category;
+} prefix_rule;
+
+static uint64_t matrix[WAKE_CATEGORIES][WAKE_CATEGORIES];
+static prefix_rule prefixes[MAX_PREFIXES];
+static int prefix_count;
+
+static const char* category_names[WAKE_CATEGORIES] = {
+    "LIGHT", "MEDIUM", "HEAVY", "SUPER"
+};
+
+static int parse_category(const char* name)
+{
+    for(int i = 0; i < WAKE_CATEGORIES; ++i)
+    {
+        if(strcmp(name, category_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ Sets every leader/follower pair to the same separation and drops any
+ prefix rules.
+*/
+void separation_init(uint64_t uniform_ms)
+{
+    for(int i = 0; i < WAKE_CATEGORIES; ++i)
+    {
+        for(int j = 0; j < WAKE_CATEGORIES; ++j)
+        {
+            matrix[i][j] = uniform_ms;
+        }
+    }
+    prefix_count = 0;
+}
+
+/*
+ Reads rules from a separation file on top of the current settings.
+ Returns 0 on success or -1 (with a message) if the file is unusable.
+*/
+int separation_load(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        lineno++;
+
+        char first[32], second[32], third[32];
+        int fields = sscanf(line, "%31s %31s %31s", first, second, third);
+        if(fields <= 0 || first[0] == '#')
+        {
+            continue;
+        }
+
+        if(fields == 3 && strcmp(first, "prefix") == 0)
+        {
+            int category = parse_category(second);
+            size_t length = strlen(third);
+            if(category < 0 || length > PLANE_MAXID || prefix_count == MAX_PREFIXES)
+            {
+                fprintf(stderr, "%s:%d: bad prefix rule\n", path, lineno);
+                fclose(f);
+                return -1;
+            }
+            strcpy(prefixes[prefix_count].prefix, third);
+            prefixes[prefix_count].length = length;
+            prefixes[prefix_count].category = category;
+            prefix_count++;
+            continue;
+        }
+
+        int leader = parse_category(first);
+        int follower = parse_category(second);
+        char* end;
+        double seconds = strtod(third, &end);
+        if(fields != 3 || leader < 0 || follower < 0 || *end != '\0' || seconds < 0)
+        {
+            fprintf(stderr, "%s:%d: expected LEADER FOLLOWER SECONDS\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        matrix[leader][follower] = (uint64_t)(seconds * 1000);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+uint64_t separation_ms(int leader, int follower)
+{
+    return matrix[leader][follower];
+}
+
+/*
+ Returns the wake category of a flight. The first matching prefix wins.
+*/
+int separation_category(const char* id)
+{
+    for(int i = 0; i < prefix_count; ++i)
+    {
+        if(strncmp(id, prefixes[i].prefix, prefixes[i].length) == 0)
+        {
+            return prefixes[i].category;
+        }
+    }
+    return WAKE_MEDIUM;
+}
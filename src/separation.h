@@ -0,0 +1,20 @@
+#ifndef SEPARATION_H
+#define SEPARATION_H
+
+#include <stdint.h>
+
+// Wake turbulence categories. Like the plane states, these are plain
+// numbers; they index the separation matrix.
+
+#define WAKE_LIGHT 0
+#define WAKE_MEDIUM 1
+#define WAKE_HEAVY 2
+#define WAKE_SUPER 3
+#define WAKE_CATEGORIES 4
+
+void separation_init(uint64_t uniform_ms);
+int separation_load(const char* path);
+uint64_t separation_ms(int leader, int follower);
+int separation_category(const char* id);
+
+#endif
@@ -1,278 +1,884 @@
+#define _GNU_SOURCE
+
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 
-#include "alist.h"
+#include "taxiqueue.h"
 #include "flightlist.h"
 #include "airs_protocol.h"
-#include "debug.h"
+#include "log.h"
+#include "timers.h"
+#include "separation.h"
+#include "eventring.h"
+#include "metrics.h"
+#include "journal.h"
 
 //static files are not included in the header
-static alist takeOff_queue;
+static taxiqueue takeOff_queue;
+
+// One scheduler thread owns the taxi queue and runs every runway as a
+// small state machine:
+//
+//   RUNWAY_OPEN     nothing on the runway. Once there is a plane in line
+//                   and the separation since the last departure is over,
+//                   the scheduler claims it and sends TAKEOFF.
+//   RUNWAY_CLEARED  waiting for the claimed plane. INAIR (report_inair)
+//                   or a disconnect (leave_queue) ends the turn and
+//                   reopens the runway.
+//
+// Connection threads never touch the queue to change it. enqueue,
+// report_inair and leave_queue push an event onto a lock-free ring and
+// return; the scheduler drains the ring in batches and applies each batch
+// under the write side of queue_lock. REQPOS and REQAHEAD only read, so
+// they share the read side. Tickets are handed out by enqueue itself, so
+// a plane can ask for its position before the scheduler has seen it join;
+// it is told the place its ticket would take if it joined now, and the
+// connection thread never waits on the scheduler.
+//
+// Runways claim planes in ticket order: next_clear is the first ticket
+// no runway has taken yet. Tickets between the head of the queue and
+// next_clear belong to planes that are cleared and still on the ground,
+// so they keep counting towards REQPOS and REQAHEAD until they are in air.
+//
+// With a journal (takeoff_recover), the scheduler also records every
+// registration, join, departure and disconnect as it applies them, and
+// hands each pass's records to the journal writer when the pass is done.
+// Planes recovered from it wait in line detached from any connection
+// until a plane registers their flight id again; a detached plane at the
+// front holds the runways until it is back or the grace period ends.
+//
+// For an upgrade (see upgrade.h) takeoff_pause stops the scheduler
+// between passes, once every event posted before it has been applied and
+// journaled. The new instance puts the planes it is handed back in line
+// with takeoff_adopt, and cleared ones get their runway back when the
+// scheduler starts.
+
+#define RUNWAY_OPEN 0
+#define RUNWAY_CLEARED 1
+
+// Events applied per write-lock hold, so readers get a turn in a flood
+#define EVENT_BATCH 256
+
+typedef struct {
+    int number;
+    int state;
+    uint64_t ticket;          // Plane on the runway when RUNWAY_CLEARED
+    int wake;                 // ...and its wake category
+    timer separation_timer;
+    int leader_wake;          // Category of the last departure, -1 if none
+    uint64_t last_departure;  // timers_now() when it went INAIR
+} runway;
+
+// A runway claim, handed from the locked part of a pass to send_takeoff
+typedef struct {
+    uint64_t ticket;
+    flight_id id;
+    plane_handle plane;
+    int runway_number;
+} claim;
+
+static runway* runways;
+static int runway_count;
+static claim* claims;
+static uint64_t next_clear;
+static pthread_t scheduler_thread;
+
+static eventring events;
+static atomic_uint_fast64_t next_ticket;
+
+static bool journaling;
+static timer grace_timer;
+static journal_plane* recovered;
+static size_t recovered_count;
+
+// Tickets of adopted planes that had been cleared, in order
+static uint64_t* adopted_cleared;
+static size_t adopted_cleared_count;
+
+// takeoff_pause waits on pause_condition for "parked"; the scheduler
+// waits on it for "parked" to be cleared again
+static pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_condition = PTHREAD_COND_INITIALIZER;
+static bool pausing;
+static bool parked;
+
+static int clearance_wait_histogram;
+static int scheduler_pass_histogram;
+
+static pthread_rwlock_t queue_lock;
+
+// The scheduler sleeps on wakeup_condition when the ring is empty.
+// Producers only take wakeup_mutex when "sleeping" says it is waiting.
+static pthread_mutex_t wakeup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup_condition = PTHREAD_COND_INITIALIZER;
+static atomic_bool sleeping;
+
+static void lock_mutex(pthread_mutex_t* m)
+{
+    if(pthread_mutex_lock(m) != 0)
+    {
+        fprintf(stderr, "Mutex could not lock");
+        exit(1);
+    }
+}
 
-static pthread_t pthread;
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t thread_condition = PTHREAD_COND_INITIALIZER;
+static void unlock_mutex(pthread_mutex_t* m)
+{
+    if(pthread_mutex_unlock(m) != 0)
+    {
+        fprintf(stderr, "Mutex could not unlock");
+        exit(1);
+    }
+}
 
-//forward declaration for use in pthread_start
-static void dequeue();
+static void read_lock(void)
+{
+    if(pthread_rwlock_rdlock(&queue_lock) != 0)
+    {
+        fprintf(stderr, "Could not read lock the take off queue");
+        exit(1);
+    }
+}
 
-void signal_inair_condition()
+static void write_lock(void)
 {
-    pthread_cond_signal(&thread_condition);
+    if(pthread_rwlock_wrlock(&queue_lock) != 0)
+    {
+        fprintf(stderr, "Could not write lock the take off queue");
+        exit(1);
+    }
 }
 
-static void* pthread_start(void* arg)
+static void queue_unlock(void)
 {
-    while(1)
-    {   
-        DEBUG_PRINT("%s", "ATTEMPTING TO ACQUIRE TAKEOFF MUTEX");
-        if(pthread_mutex_lock(&mutex) != 0)
-        {
-            fprintf(stderr, "Mutex could not lock");
-            exit(1);     
-        }    
-        DEBUG_PRINT("%s", "ACQUIRED TAKEOFF MUTEX");
-        DEBUG_PRINT("%s", "waiting for planes to enter the queue");
+    if(pthread_rwlock_unlock(&queue_lock) != 0)
+    {
+        fprintf(stderr, "Could not unlock the take off queue");
+        exit(1);
+    }
+}
+
+/*
+ Hands an event to the scheduler, waking it if it is asleep. The fence
+ pairs with the one in wait_for_events: either the scheduler sees the
+ event before it sleeps, or we see it sleeping and wake it.
+*/
+static void post_event(const takeoff_event* event)
+{
+    eventring_push(&events, event);
+    atomic_thread_fence(memory_order_seq_cst);
 
-        while(alist_size(&takeOff_queue) == 0)
+    if(atomic_load_explicit(&sleeping, memory_order_relaxed))
+    {
+        lock_mutex(&wakeup_mutex);
+        atomic_store_explicit(&sleeping, false, memory_order_relaxed);
+        pthread_cond_signal(&wakeup_condition);
+        unlock_mutex(&wakeup_mutex);
+    }
+}
+
+static void post(int type, uint64_t ticket)
+{
+    takeoff_event event;
+    event.type = type;
+    event.ticket = ticket;
+    post_event(&event);
+}
+
+// Scheduler side of post_event: sleeps until the ring has something
+static void wait_for_events(void)
+{
+    lock_mutex(&wakeup_mutex);
+
+    atomic_store_explicit(&sleeping, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while(eventring_empty(&events) &&
+        atomic_load_explicit(&sleeping, memory_order_relaxed))
+    {
+        pthread_cond_wait(&wakeup_condition, &wakeup_mutex);
+    }
+    atomic_store_explicit(&sleeping, false, memory_order_relaxed);
+
+    unlock_mutex(&wakeup_mutex);
+}
+
+// Timer callback: a runway's separation time is over
+static void runway_free(void* context)
+{
+    post(EVENT_TICK, 0);
+}
+
+/*
+ Returns the next ticket no runway has claimed, skipping planes that left
+ the queue. Stops at a ticket whose plane hasn't been inserted yet, or
+ is recovered and not back, so planes are still cleared in the order
+ they joined. The caller must hold
+ queue_lock for writing.
+*/
+static bool next_unclaimed(uint64_t* ticket)
+{
+    if(next_clear < takeOff_queue.head)
+    {
+        next_clear = takeOff_queue.head;
+    }
+
+    while(next_clear < takeOff_queue.tail)
+    {
+        taxi_entry* entry = taxiqueue_get(&takeOff_queue, next_clear);
+        if(entry != NULL)
         {
-            pthread_cond_wait(&thread_condition, &mutex);
+            if(entry->detached)
+            {
+                return false;
+            }
+            *ticket = next_clear;
+            return true;
         }
+        if(taxiqueue_is_reserved(&takeOff_queue, next_clear))
+        {
+            return false;
+        }
+        next_clear++;
+    }
 
-        DEBUG_PRINT("%s", "at least one plane is in the queue");
-
+    return false;
+}
 
-        char *cleared_plane = strdup(alist_get(&takeOff_queue, 0));
+/*
+ Ends the turn of a ticket: it leaves the queue, and if it was on a
+ runway that runway opens again. "departed" says whether it took off,
+ which starts the separation clock. The caller must hold queue_lock for
+ writing.
+*/
+static void end_turn(uint64_t ticket, bool departed)
+{
+    taxi_entry* entry = taxiqueue_get(&takeOff_queue, ticket);
+    if(journaling && entry != NULL)
+    {
+        journal_append(JOURNAL_DEQUEUE, &entry->id, ticket);
+    }
+    taxiqueue_remove(&takeOff_queue, ticket);
 
-        if(pthread_mutex_unlock(&mutex) != 0)
+    for(int i = 0; i < runway_count; ++i)
+    {
+        runway* r = &runways[i];
+        if(r->state == RUNWAY_CLEARED && r->ticket == ticket)
         {
-            fprintf(stderr, "Mutex unlock failed. You have done something incorrect.");
-            exit(1);
+            r->state = RUNWAY_OPEN;
+            if(departed)
+            {
+                r->leader_wake = r->wake;
+                r->last_departure = timers_now();
+            }
+            break;
         }
+    }
+}
 
-        DEBUG_PRINT("%s", "ATTEMPTING TO ACQUIRE FLIGHTLIST LOCK");
-        
-        if(pthread_mutex_lock(&flightlist_lock) != 0)
+/*
+ If the runway is open, the separation is over and a plane is waiting,
+ claims that plane for it and returns true. Arms the separation timer
+ when a plane is waiting but the runway isn't free yet. The caller must
+ hold queue_lock for writing.
+*/
+static bool try_claim(runway* r)
+{
+    uint64_t ticket;
+    if(r->state != RUNWAY_OPEN || !next_unclaimed(&ticket))
+    {
+        return false;
+    }
+
+    int wake = taxiqueue_get(&takeOff_queue, ticket)->wake;
+    if(r->leader_wake >= 0)
+    {
+        uint64_t due = r->last_departure + separation_ms(r->leader_wake, wake);
+        if(timers_now() < due)
         {
-            fprintf(stderr, "Could not lock flightlist mutex in take off queue");
-            exit(1);
+            timers_schedule_at(&r->separation_timer, due, runway_free, r);
+            return false;
         }
+    }
+
+    next_clear = ticket + 1;
+    r->state = RUNWAY_CLEARED;
+    r->ticket = ticket;
+    r->wake = wake;
+    return true;
+}
+
+/*
+ Sends TAKEOFF to the plane that made a claim. Called without queue_lock
+ held; only flightlist_lock is taken, and only for the lookup and the
+ message. Returns false if the plane is gone.
+*/
+static bool send_takeoff(const claim* c)
+{
+    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "Could not lock flightlist mutex in take off queue");
+        exit(1);
+    }
 
-        DEBUG_PRINT("%s", "ACQUIRED FLIGHTLIST LOCK");
-        airplane* plane = find_plane(&hasPlaneID, cleared_plane);
-        if(plane == NULL)
+    // A BYE can come in at any time, so the move to PLANE_CLEAR only
+    // happens if the plane is still taxiing
+    airplane* plane = flightlist_get(c->plane);
+    bool cleared = plane != NULL
+        && send_reply_now(plane, PLANE_TAXIING, PLANE_CLEAR, REPLY_TAKEOFF);
+    if(cleared)
+    {
+        metrics_count(COUNTER_TAKEOFFS);
+        LOG_INFO(c->id.text, "cleared for takeoff on runway %d", c->runway_number);
+    }
+
+    if(pthread_mutex_unlock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "Could not unlock flightlist mutex in take off queue");
+        exit(1);
+    }
+
+    return cleared;
+}
+
+/*
+ Applies one event to the queue and runways. Returns false for
+ EVENT_STOP. The caller must hold queue_lock for writing.
+*/
+static bool apply_event(takeoff_event* event)
+{
+    taxi_entry* entry;
+
+    switch(event->type)
+    {
+    case EVENT_ENQUEUE:
+        taxiqueue_insert(&takeOff_queue, event->ticket, &event->id, event->plane,
+            event->wake);
+        entry = taxiqueue_get(&takeOff_queue, event->ticket);
+        if(entry != NULL)
         {
-            printf("Plane %s has either disconnected or does not exist", cleared_plane);
-            free(cleared_plane);
+            entry->joined = event->joined;
         }
-        else
+        if(journaling)
+        {
+            journal_append(JOURNAL_ENQUEUE, &event->id, event->ticket);
+        }
+        break;
+    case EVENT_REGISTER:
+        journal_append(JOURNAL_REGISTER, &event->id, event->plane_number);
+        break;
+    case EVENT_DISCONNECT:
+        journal_append(JOURNAL_DISCONNECT, &event->id, event->plane_number);
+        break;
+    case EVENT_ATTACH:
+        entry = taxiqueue_get(&takeOff_queue, event->ticket);
+        if(entry != NULL && entry->detached)
+        {
+            entry->plane = event->plane;
+            entry->detached = false;
+        }
+        break;
+    case EVENT_INAIR:
+        end_turn(event->ticket, true);
+        break;
+    case EVENT_LEAVE:
+        end_turn(event->ticket, false);
+        break;
+    case EVENT_PAUSE:
+        pausing = true;
+        break;
+    case EVENT_STOP:
+        return false;
+    }
+    return true;
+}
+
+// Scheduler side of takeoff_pause: waits, with everything applied and on disk
+static void park(void)
+{
+    if(journaling)
+    {
+        journal_sync();
+    }
+
+    lock_mutex(&pause_mutex);
+    parked = true;
+    pthread_cond_broadcast(&pause_condition);
+    while(parked)
+    {
+        pthread_cond_wait(&pause_condition, &pause_mutex);
+    }
+    unlock_mutex(&pause_mutex);
+    pausing = false;
+}
+
+static void* pthread_start(void* arg)
+{
+    bool running = true;
+
+    while(running)
+    {
+        takeoff_event event;
+        int applied = 0;
+        int claimed = 0;
+        uint64_t started = metrics_now();
+
+        write_lock();
+
+        while(applied < EVENT_BATCH && eventring_pop(&events, &event))
         {
-            //free before waiting
-            free(cleared_plane);
-            set_state(plane, PLANE_CLEAR);
-            fprintf(plane->fp_send, "TAKEOFF\n");
-            printf("Plane %s has been cleared for take off\n", plane->id);
-            DEBUG_PRINT("Waiting for plane %s to go INAIR", plane->id);
-            while(read_state(plane) != PLANE_INAIR)
+            applied++;
+            if(!apply_event(&event))
             {
-                if(pthread_cond_wait(&thread_condition, &flightlist_lock) != 0)
-                {
-                    fprintf(stderr, "Thread condition wait failed in pthread_start");
-                    exit(1);
-                }
+                running = false;
+                break;
             }
-            printf("Plane %s is now in air\n", plane->id);
+        }
 
-            if(pthread_mutex_lock(&mutex) != 0)
+        for(int i = 0; running && i < runway_count; ++i)
+        {
+            runway* r = &runways[i];
+            if(try_claim(r))
             {
-                fprintf(stderr, "Could not lock flightlist mutex in take off queue");
-                exit(1);
+                claim* c = &claims[claimed++];
+                taxi_entry* entry = taxiqueue_get(&takeOff_queue, r->ticket);
+                c->ticket = r->ticket;
+                c->id = entry->id;
+                c->plane = entry->plane;
+                metrics_record(clearance_wait_histogram, metrics_now() - entry->joined);
+                c->runway_number = r->number;
+                LOG_DEBUG(c->id.text, "claimed runway %d", r->number);
             }
-            
-            dequeue();
+        }
+
+        metrics_set(GAUGE_TAXI_QUEUE, taxiqueue_size(&takeOff_queue));
+        queue_unlock();
 
-            if(pthread_mutex_unlock(&mutex) != 0)
+        for(int i = 0; i < claimed; ++i)
+        {
+            claim* c = &claims[i];
+            if(!send_takeoff(c))
             {
-                fprintf(stderr, "Could not unlock flightlist mutex in take off queue");
-                exit(1);
+                LOG_INFO(c->id.text, "disconnected or gone before takeoff");
+                write_lock();
+                end_turn(c->ticket, false);
+                queue_unlock();
             }
+        }
 
-
-            set_state(plane, PLANE_DONE);
-            printf("Plane %s is done\n", plane->id);
+        if(journaling)
+        {
+            journal_commit();
         }
 
-        if(pthread_mutex_unlock(&flightlist_lock) != 0)
+        if(pausing)
         {
-            fprintf(stderr, "Could not unlock flightlist mutex in take off queue");
-            exit(1);
+            park();
         }
-        DEBUG_PRINT("%s", "RELINQUISHING FLIGHTLIST LOCK");
 
-        DEBUG_PRINT("%s", "Going to sleep.");
-        sleep(4);
-        DEBUG_PRINT("%s", "Waking up.");
+        if(applied > 0 || claimed > 0)
+        {
+            metrics_record(scheduler_pass_histogram, metrics_now() - started);
+        }
+        else if(running)
+        {
+            wait_for_events();
+        }
     }
+
+    return NULL;
 }
 
-void takeoff_thread_init()
+// Timer callback: planes recovered from the journal that aren't back by now leave
+static void grace_over(void* context)
 {
-    if(pthread_create(&pthread, NULL, pthread_start, NULL) != 0)
+    for(size_t i = 0; i < recovered_count; ++i)
     {
-        fprintf(stderr, "Failed to create take off thread");
-        exit(1);
-    }
+        journal_plane* p = &recovered[i];
+        if(!flightlist_drop_recovered(&p->id))
+        {
+            continue;
+        }
+
+        LOG_INFO(p->id.text, "did not come back after restart");
+        if(p->ticket != JOURNAL_NO_TICKET)
+        {
+            post(EVENT_LEAVE, p->ticket);
+        }
 
-    pthread_detach(pthread);
+        takeoff_event event;
+        event.type = EVENT_DISCONNECT;
+        event.id = p->id;
+        event.plane_number = 0;
+        post_event(&event);
+    }
 
+    free(recovered);
+    recovered = NULL;
+    recovered_count = 0;
 }
 
-static void takeOffQueueCleaner(void* flightIdString)
+/*
+ Opens the journal in "dir" and puts every plane it recovers back: as a
+ registered plane with no connection, and in the taxi queue in its old
+ order if it was waiting. A plane that registers the same flight id within
+ "grace_seconds" takes its place; the rest are dropped then. Called after
+ init_takeOff and before takeoff_thread_init. Returns 0, or -1 if the
+ journal can't be opened.
+*/
+int takeoff_recover(const char* dir, int grace_seconds)
 {
-    free(flightIdString);
-}
+    if(journal_open(dir, &recovered, &recovered_count) != 0)
+    {
+        return -1;
+    }
+    journaling = true;
 
-void init_takeOff()
-{
-    alist_init(&takeOff_queue, &takeOffQueueCleaner); 
+    uint64_t waiting = 0;
+    uint64_t now = metrics_now();
+    for(size_t i = 0; i < recovered_count; ++i)
+    {
+        journal_plane* p = &recovered[i];
+        plane_handle handle = flightlist_add_recovered(&p->id, p->ticket);
+        if(p->ticket == JOURNAL_NO_TICKET)
+        {
+            continue;
+        }
+
+        // Recovered tickets run from 0 in order, so they land where they were
+        uint64_t ticket = taxiqueue_push(&takeOff_queue, &p->id, handle,
+            separation_category(p->id.text));
+        taxi_entry* entry = taxiqueue_get(&takeOff_queue, ticket);
+        entry->detached = true;
+        entry->joined = now;
+        waiting++;
+    }
+    atomic_store(&next_ticket, waiting);
+    metrics_set(GAUGE_TAXI_QUEUE, taxiqueue_size(&takeOff_queue));
+
+    fprintf(stderr, "journal: recovered %zu planes, %llu waiting to take off\n",
+        recovered_count, (unsigned long long)waiting);
+    if(recovered_count > 0)
+    {
+        timers_schedule(&grace_timer, (uint64_t)grace_seconds * 1000, grace_over, NULL);
+    }
+    return 0;
 }
 
-void enqueue(const char* planeID)
+/*
+ Puts a plane handed over by the instance this one replaced back where it
+ was: in line if it was taxiing or cleared, and in the journal if it has
+ registered. Called in the old instance's ticket order, after
+ takeoff_recover and before takeoff_thread_init. A plane that took over
+ one recovered from the journal already has its ticket; any other gets
+ the next one.
+*/
+void takeoff_adopt(airplane* plane)
 {
-    char* duplicate = strdup(planeID);
-    if(duplicate == NULL)
+    if(journaling && !flight_id_empty(&plane->id))
     {
-        fprintf(stderr, "Take off queue->enqueue: Out of memory.");
-        exit(1);
+        journal_append(JOURNAL_REGISTER, &plane->id, plane->plane_number);
     }
 
-    if(pthread_mutex_lock(&mutex) != 0)
+    int state = read_state(plane);
+    if(state != PLANE_TAXIING && state != PLANE_CLEAR)
     {
-        fprintf(stderr, "Mutex could not lock");
-        exit(1);     
+        return;
     }
 
-    alist_add(&takeOff_queue, duplicate);
-    printf("Enqueued plane: %s\n", duplicate);
-
-    if(pthread_mutex_unlock(&mutex) != 0)
+    taxi_entry* entry = NULL;
+    if(plane->taxi_ticket != PLANE_NO_TICKET)
     {
-        fprintf(stderr, "Mutex could not unlock");
-        exit(1);     
+        entry = taxiqueue_get(&takeOff_queue, plane->taxi_ticket);
+    }
+    if(entry == NULL)
+    {
+        plane->taxi_ticket = taxiqueue_push(&takeOff_queue, &plane->id, plane->handle,
+            separation_category(plane->id.text));
+        entry = taxiqueue_get(&takeOff_queue, plane->taxi_ticket);
+        atomic_store(&next_ticket, plane->taxi_ticket + 1);
+        if(journaling)
+        {
+            journal_append(JOURNAL_ENQUEUE, &plane->id, plane->taxi_ticket);
+        }
     }
+    entry->plane = plane->handle;
+    entry->detached = false;
+    entry->joined = metrics_now();
 
-    pthread_cond_signal(&thread_condition);
+    if(state == PLANE_CLEAR)
+    {
+        uint64_t* grown = realloc(adopted_cleared,
+            (adopted_cleared_count + 1) * sizeof(uint64_t));
+        if(grown == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        adopted_cleared = grown;
+        adopted_cleared[adopted_cleared_count++] = plane->taxi_ticket;
+    }
 }
 
-int find_position(const char* planeID)
+void takeoff_thread_init(int count)
 {
-    if(pthread_mutex_lock(&mutex) != 0)
+    runway_count = count;
+    runways = calloc(count, sizeof(runway));
+    claims = calloc(count, sizeof(claim));
+    if(runways == NULL || claims == NULL)
     {
-        fprintf(stderr, "Could not lock mutex in find position");
+        fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
 
-    int size = alist_size(&takeOff_queue);
-    for(int i = 0; i < size; ++i)
+    for(int i = 0; i < count; ++i)
     {
-        const char* element = alist_get(&takeOff_queue, i);
-        if(strcmp(element, planeID) == 0)
+        runways[i].number = i + 1;
+        runways[i].state = RUNWAY_OPEN;
+        runways[i].leader_wake = -1;
+    }
+
+    // Adopted planes that were cleared hold runways again. Any beyond the
+    // runways there are now still won't be cleared twice.
+    for(size_t i = 0; i < adopted_cleared_count; ++i)
+    {
+        uint64_t ticket = adopted_cleared[i];
+        if(i < (size_t)count)
         {
-            if(pthread_mutex_unlock(&mutex) != 0)
-            {
-                fprintf(stderr, "Could not unlock mutex in find position");
-                exit(1);
-            }  
-            DEBUG_PRINT("Found %s at %d", element, i);
-            return i;
+            runways[i].state = RUNWAY_CLEARED;
+            runways[i].ticket = ticket;
+            runways[i].wake = taxiqueue_get(&takeOff_queue, ticket)->wake;
+        }
+        if(ticket + 1 > next_clear)
+        {
+            next_clear = ticket + 1;
         }
     }
+    free(adopted_cleared);
+    adopted_cleared = NULL;
+    adopted_cleared_count = 0;
+    metrics_set(GAUGE_TAXI_QUEUE, taxiqueue_size(&takeOff_queue));
 
-    if(pthread_mutex_unlock(&mutex) != 0)
+    if(pthread_create(&scheduler_thread, NULL, pthread_start, NULL) != 0)
     {
-        fprintf(stderr, "Could not unlock mutex in find position");
+        fprintf(stderr, "Failed to create take off thread");
         exit(1);
-    } 
+    }
+}
 
-    return -1; // Not found   
+void init_takeOff()
+{
+    taxiqueue_init(&takeOff_queue);
+    eventring_init(&events);
+    atomic_init(&next_ticket, 0);
+    atomic_init(&sleeping, false);
+
+    clearance_wait_histogram = metrics_histogram("clearance_wait", NULL,
+        "Time from joining the taxi queue to being cleared");
+    scheduler_pass_histogram = metrics_histogram("scheduler_pass", NULL,
+        "Time for one pass of the takeoff scheduler that had work");
+
+    // Writers first: a steady stream of REQPOS must not starve the scheduler
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    if(pthread_rwlock_init(&queue_lock, &attr) != 0)
+    {
+        fprintf(stderr, "Could not create take off queue lock");
+        exit(1);
+    }
+    pthread_rwlockattr_destroy(&attr);
 }
 
-char* find_taxi_list(const char* planeID)
+uint64_t enqueue(const airplane* plane)
 {
-    char*  buffer = NULL;
-    size_t size;
+    takeoff_event event;
+    event.type = EVENT_ENQUEUE;
+    event.ticket = atomic_fetch_add_explicit(&next_ticket, 1, memory_order_relaxed);
+    event.wake = separation_category(plane->id.text);
+    event.joined = metrics_now();
+    event.id = plane->id;
+    event.plane = plane->handle;
+
+    LOG_INFO(plane->id.text, "enqueued");
+    post_event(&event);
+
+    return event.ticket;
+}
 
-    FILE* f = open_memstream(&buffer, &size);
-    if(f == NULL)
+/*
+ Called once a plane has registered its flight id. If it took over a
+ plane recovered from the journal, its connection now holds that place
+ in line.
+*/
+void report_registered(const airplane* plane)
+{
+    takeoff_event event;
+    if(plane->taxi_ticket != PLANE_NO_TICKET)
     {
-        perror("Could not open memory stream in find taxi list");
-        return NULL;
+        event.type = EVENT_ATTACH;
+        event.ticket = plane->taxi_ticket;
+        event.plane = plane->handle;
+        post_event(&event);
     }
 
-    if(pthread_mutex_lock(&mutex) != 0)
+    if(journaling)
     {
-        fprintf(stderr, "Could not lock mutex in find position");
-        exit(1);
+        event.type = EVENT_REGISTER;
+        event.id = plane->id;
+        event.plane_number = plane->plane_number;
+        post_event(&event);
     }
+}
 
-    int queue_size = alist_size(&takeOff_queue);
-    for(int i = 0; i < queue_size; ++i)
+/*
+ Called when a registered plane disconnects, after leave_queue if it was
+ in line, so the journal forgets its flight id.
+*/
+void report_disconnected(const flight_id* id, int plane_number)
+{
+    if(!journaling)
     {
-        const char* element = alist_get(&takeOff_queue, i);
-        if(strcmp(element, planeID) == 0)
-        {
-            if(pthread_mutex_unlock(&mutex) != 0)
-            {
-                fprintf(stderr, "Could not unlock mutex in find position");
-                exit(1);
-            }   
+        return;
+    }
 
-            fclose(f);
-            return buffer;
-        }
+    takeoff_event event;
+    event.type = EVENT_DISCONNECT;
+    event.id = *id;
+    event.plane_number = plane_number;
+    post_event(&event);
+}
 
-        if(i != 0)
-        {
-            fprintf(f, ", %s", element);
-        }
-        else
-        {
-            fprintf(f, "%s", element);
-        }
+/*
+ Called from the plane's connection when it reports INAIR: its turn is
+ over and the runway starts its separation time.
+*/
+void report_inair(uint64_t ticket)
+{
+    post(EVENT_INAIR, ticket);
+}
+
+/*
+ Takes a plane that is disconnecting out of the line, and off its runway
+ if it had already been cleared.
+*/
+void leave_queue(uint64_t ticket)
+{
+    post(EVENT_LEAVE, ticket);
+}
+
+/*
+ Stops the scheduler once it has applied every event posted so far, sent
+ the clearances that follow from them and synced the journal. Returns
+ when it has stopped; nothing changes the queue until takeoff_resume.
+*/
+void takeoff_pause(void)
+{
+    post(EVENT_PAUSE, 0);
+
+    lock_mutex(&pause_mutex);
+    while(!parked)
+    {
+        pthread_cond_wait(&pause_condition, &pause_mutex);
     }
+    unlock_mutex(&pause_mutex);
+}
+
+void takeoff_resume(void)
+{
+    lock_mutex(&pause_mutex);
+    parked = false;
+    pthread_cond_broadcast(&pause_condition);
+    unlock_mutex(&pause_mutex);
+}
+
+// True if enqueue has handed the ticket out
+static bool issued(uint64_t ticket)
+{
+    return ticket < atomic_load(&next_ticket);
+}
 
-    if(pthread_mutex_unlock(&mutex) != 0)
+/*
+ Returns the 0-based place in line of a ticket, or -1 if it isn't queued.
+ A ticket the scheduler hasn't inserted yet gets the place it would take
+ if it joined now (see taxiqueue.h), so this never waits for a batch.
+*/
+int find_position(uint64_t ticket)
+{
+    if(!issued(ticket))
     {
-        fprintf(stderr, "Could not unlock mutex in find position");
-        exit(1);
-    } 
+        return -1;
+    }
 
-    fclose(f);
-    free(buffer);
-    return NULL;
+    read_lock();
+    long position = taxiqueue_position(&takeOff_queue, ticket);
+    queue_unlock();
+
+    LOG_DEBUG(NULL, "found ticket %lu at %ld", (unsigned long)ticket, position);
+    return (int)position;
 }
 
-static void dequeue()
+/*
+ Copies the REQAHEAD list for a ticket into "out" (see taxiqueue_ahead).
+ The list is already rendered, so this is a single copy under the read
+ lock.
+*/
+long find_taxi_list(uint64_t ticket, char* out, size_t cap)
 {
-    alist_remove(&takeOff_queue, 0);
+    if(!issued(ticket))
+    {
+        return -1;
+    }
+
+    read_lock();
+    long len = taxiqueue_ahead(&takeOff_queue, ticket, out, cap);
+    queue_unlock();
+
+    return len;
 }
 
 void takeOffDestroy()
 {
-    alist_destroy(&takeOff_queue);
-    if(pthread_cond_destroy(&thread_condition) != 0)
+    post(EVENT_STOP, 0);
+
+    pthread_join(scheduler_thread, NULL);
+    timers_cancel(&grace_timer);
+    if(journaling)
+    {
+        journal_close();
+        free(recovered);
+    }
+    for(int i = 0; i < runway_count; ++i)
+    {
+        timers_cancel(&runways[i].separation_timer);
+    }
+    free(runways);
+    free(claims);
+
+    taxiqueue_destroy(&takeOff_queue);
+    if(pthread_rwlock_destroy(&queue_lock) != 0)
+    {
+        fprintf(stderr, "Could not destroy take off queue lock");
+        exit(1);
+    }
+
+    if(pthread_cond_destroy(&wakeup_condition) != 0 ||
+        pthread_cond_destroy(&pause_condition) != 0)
     {
         fprintf(stderr, "Could not destroy condition variable in take off queue");
         exit(1);
     }
 
-    if(pthread_mutex_destroy(&mutex) != 0)
+    if(pthread_mutex_destroy(&wakeup_mutex) != 0 ||
+        pthread_mutex_destroy(&pause_mutex) != 0)
     {
         fprintf(stderr, "Could not destroy mutex in Take off queue");
         exit(1);
     }
-}
\ No newline at end of file
+}
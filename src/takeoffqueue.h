@@ -1,12 +1,27 @@
 #ifndef TAKE_OFF_QUEUE
 #define TAKE_OFF_QUEUE
 
-void signal_inair_condition();
+#include <stddef.h>
+#include <stdint.h>
+
+#include "airplane.h"
+
+// Planes join the queue with enqueue and get back a ticket that stays
+// valid until they take off or leave; the other calls look them up by it.
+
 void init_takeOff();
-void takeoff_thread_init();
-void enqueue(const char* planeID);
-int find_position(const char* planeID);
-char* find_taxi_list(const char* planeID);
+int takeoff_recover(const char* dir, int grace_seconds);
+void takeoff_adopt(airplane* plane);
+void takeoff_thread_init(int runways);
+uint64_t enqueue(const airplane* plane);
+int find_position(uint64_t ticket);
+long find_taxi_list(uint64_t ticket, char* out, size_t cap);
+void report_inair(uint64_t ticket);
+void leave_queue(uint64_t ticket);
+void report_registered(const airplane* plane);
+void report_disconnected(const flight_id* id, int plane_number);
+void takeoff_pause(void);
+void takeoff_resume(void);
 void takeOffDestroy();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,438 @@
+// Ring buffer of taxiing planes with O(1) push and pop at the front and
+// O(log n) removal and position lookup anywhere else. Keeping the REQAHEAD
+// text adds O(log n) and a move within one block to any change.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "taxiqueue.h"
+
+#define TAXIQUEUE_MIN_CAPACITY 64
+
+// Each entry is rendered with this in front of its id
+#define SEPARATOR ", "
+#define SEPARATOR_LEN 2
+
+// Tickets per block of text, and the room that takes
+#define BLOCK_TICKETS 64
+#define BLOCK_SIZE (BLOCK_TICKETS * (SEPARATOR_LEN + PLANE_MAXID))
+
+_Static_assert(TAXIQUEUE_MIN_CAPACITY % BLOCK_TICKETS == 0,
+    "a block never wraps around the ring");
+
+static size_t slot_of(taxiqueue* q, uint64_t ticket)
+{
+    return ticket & (q->capacity - 1);
+}
+
+/*
+ Fenwick tree helpers, for either tree. fenwick_add updates ring slot
+ "slot"; fenwick_prefix sums slots [0, slot).
+*/
+static void fenwick_add(taxiqueue* q, int* tree, size_t slot, int delta)
+{
+    for(size_t i = slot + 1; i <= q->capacity; i += i & (~i + 1))
+    {
+        tree[i - 1] += delta;
+    }
+}
+
+static long fenwick_prefix(int* tree, size_t slot)
+{
+    long sum = 0;
+    for(size_t i = slot; i > 0; i -= i & (~i + 1))
+    {
+        sum += tree[i - 1];
+    }
+    return sum;
+}
+
+// Turns per-slot counts into a Fenwick tree in linear time
+static void fenwick_build(taxiqueue* q, int* tree)
+{
+    for(size_t i = 1; i <= q->capacity; ++i)
+    {
+        size_t parent = i + (i & (~i + 1));
+        if(parent <= q->capacity)
+        {
+            tree[parent - 1] += tree[i - 1];
+        }
+    }
+}
+
+// Sum of a tree over tickets [head, ticket), given its sum over the ring
+static long sum_before(taxiqueue* q, int* tree, long total, uint64_t ticket)
+{
+    size_t from = slot_of(q, q->head);
+    size_t to = slot_of(q, ticket);
+    if(from <= to)
+    {
+        return fenwick_prefix(tree, to) - fenwick_prefix(tree, from);
+    }
+    return total - (fenwick_prefix(tree, from) - fenwick_prefix(tree, to));
+}
+
+// Non-live entries with tickets in [head, ticket)
+static long holes_before(taxiqueue* q, uint64_t ticket)
+{
+    return q->holes == 0 ? 0 : sum_before(q, q->dead, (long)q->holes, ticket);
+}
+
+// Bytes of text for the live entries with tickets in [head, ticket)
+static size_t bytes_before(taxiqueue* q, uint64_t ticket)
+{
+    return (size_t)sum_before(q, q->bytes, (long)q->text_len, ticket);
+}
+
+static int text_size(const taxi_entry* e)
+{
+    return SEPARATOR_LEN + (int)e->id.len;
+}
+
+static taxi_text_block* block_of(taxiqueue* q, uint64_t ticket)
+{
+    size_t count = q->capacity / BLOCK_TICKETS;
+    return &q->blocks[(ticket / BLOCK_TICKETS) & (count - 1)];
+}
+
+// Bytes of text for the tickets ahead of this one in its block
+static size_t block_bytes_before(taxiqueue* q, uint64_t ticket)
+{
+    size_t slot = slot_of(q, ticket);
+    size_t first = slot & ~(size_t)(BLOCK_TICKETS - 1);
+    return (size_t)(fenwick_prefix(q->bytes, slot) - fenwick_prefix(q->bytes, first));
+}
+
+static void alloc_arrays(taxiqueue* q, size_t capacity)
+{
+    q->entries = malloc(capacity * sizeof(taxi_entry));
+    q->dead = calloc(capacity, sizeof(int));
+    q->bytes = calloc(capacity, sizeof(int));
+    q->blocks = calloc(capacity / BLOCK_TICKETS, sizeof(taxi_text_block));
+    if(q->entries == NULL || q->dead == NULL || q->bytes == NULL || q->blocks == NULL)
+    {
+        perror("taxiqueue - allocating ring");
+        exit(1);
+    }
+    q->capacity = capacity;
+}
+
+static void grow(taxiqueue* q, size_t needed)
+{
+    taxi_entry* old = q->entries;
+    taxi_text_block* old_blocks = q->blocks;
+    size_t old_mask = q->capacity - 1;
+    size_t capacity = q->capacity;
+    while(capacity < needed)
+    {
+        capacity *= 2;
+    }
+    free(q->dead);
+    free(q->bytes);
+
+    alloc_arrays(q, capacity);
+    for(uint64_t t = q->head; t < q->tail; ++t)
+    {
+        taxi_entry* e = &q->entries[slot_of(q, t)];
+        *e = old[t & old_mask];
+        if(e->live)
+        {
+            q->bytes[slot_of(q, t)] = text_size(e);
+        }
+        else
+        {
+            q->dead[slot_of(q, t)] = 1;
+        }
+    }
+    free(old);
+
+    size_t old_block_mask = (old_mask + 1) / BLOCK_TICKETS - 1;
+    for(uint64_t t = q->head & ~(uint64_t)(BLOCK_TICKETS - 1); t < q->tail; t += BLOCK_TICKETS)
+    {
+        *block_of(q, t) = old_blocks[(t / BLOCK_TICKETS) & old_block_mask];
+    }
+    free(old_blocks);
+
+    fenwick_build(q, q->dead);
+    fenwick_build(q, q->bytes);
+}
+
+/*
+ Puts an entry's ", id" in its block, after the tickets ahead of it.
+*/
+static void text_insert(taxiqueue* q, uint64_t ticket, const taxi_entry* e)
+{
+    taxi_text_block* b = block_of(q, ticket);
+    if(b->text == NULL)
+    {
+        b->text = q->spare_block != NULL ? q->spare_block : malloc(BLOCK_SIZE);
+        q->spare_block = NULL;
+        if(b->text == NULL)
+        {
+            perror("taxiqueue - allocating text");
+            exit(1);
+        }
+        b->used = 0;
+    }
+
+    size_t at = block_bytes_before(q, ticket);
+    int len = text_size(e);
+    memmove(b->text + at + len, b->text + at, b->used - at);
+    memcpy(b->text + at, SEPARATOR, SEPARATOR_LEN);
+    memcpy(b->text + at + SEPARATOR_LEN, e->id.text, e->id.len);
+    b->used += len;
+    q->text_len += len;
+    fenwick_add(q, q->bytes, slot_of(q, ticket), len);
+}
+
+// Takes an entry's text out of its block
+static void text_erase(taxiqueue* q, uint64_t ticket, const taxi_entry* e)
+{
+    taxi_text_block* b = block_of(q, ticket);
+    size_t at = block_bytes_before(q, ticket);
+    int len = text_size(e);
+    memmove(b->text + at, b->text + at + len, b->used - at - len);
+    b->used -= len;
+    q->text_len -= len;
+    fenwick_add(q, q->bytes, slot_of(q, ticket), -len);
+
+    if(b->used == 0)
+    {
+        free(q->spare_block);
+        q->spare_block = b->text;
+        b->text = NULL;
+    }
+}
+
+void taxiqueue_init(taxiqueue* q)
+{
+    alloc_arrays(q, TAXIQUEUE_MIN_CAPACITY);
+    q->head = 0;
+    q->tail = 0;
+    q->live = 0;
+    q->holes = 0;
+    q->spare_block = NULL;
+    q->text_len = 0;
+}
+
+/*
+ Appends a plane to the end of the line under the next ticket.
+*/
+uint64_t taxiqueue_push(taxiqueue* q, const flight_id* id, plane_handle plane, int wake)
+{
+    uint64_t ticket = q->tail;
+    taxiqueue_insert(q, ticket, id, plane, wake);
+    return ticket;
+}
+
+/*
+ Puts a plane in line under a ticket handed out earlier. The ticket must
+ be at or past the tail, or a slot reserved by an earlier insert.
+*/
+void taxiqueue_insert(taxiqueue* q, uint64_t ticket, const flight_id* id,
+    plane_handle plane, int wake)
+{
+    taxi_entry* e;
+
+    if(ticket >= q->tail)
+    {
+        // Room from the start of the head's block, so no two blocks in
+        // use share a place in the ring
+        uint64_t first = q->head & ~(uint64_t)(BLOCK_TICKETS - 1);
+        if(ticket - first + 1 > q->capacity)
+        {
+            grow(q, ticket - first + 1);
+        }
+
+        // Hold the place of tickets that haven't been inserted yet
+        for(uint64_t t = q->tail; t < ticket; ++t)
+        {
+            e = &q->entries[slot_of(q, t)];
+            e->live = false;
+            e->reserved = true;
+            fenwick_add(q, q->dead, slot_of(q, t), 1);
+            q->holes++;
+        }
+        q->tail = ticket + 1;
+
+        e = &q->entries[slot_of(q, ticket)];
+        e->reserved = false;
+    }
+    else
+    {
+        e = &q->entries[slot_of(q, ticket)];
+        if(ticket < q->head || !e->reserved)
+        {
+            return;
+        }
+
+        e->reserved = false;
+        fenwick_add(q, q->dead, slot_of(q, ticket), -1);
+        q->holes--;
+    }
+
+    e->id = *id;
+    e->plane = plane;
+    e->live = true;
+    e->detached = false;
+    e->wake = wake;
+    e->joined = 0;
+    q->live++;
+
+    text_insert(q, ticket, e);
+}
+
+/*
+ Takes a ticket out of the line. Returns false if it was not in the
+ queue (already removed, or never inserted).
+*/
+bool taxiqueue_remove(taxiqueue* q, uint64_t ticket)
+{
+    taxi_entry* e = taxiqueue_get(q, ticket);
+    if(e == NULL)
+    {
+        return false;
+    }
+
+    e->live = false;
+    q->live--;
+
+    text_erase(q, ticket, e);
+
+    if(ticket != q->head)
+    {
+        fenwick_add(q, q->dead, slot_of(q, ticket), 1);
+        q->holes++;
+        return true;
+    }
+
+    // Leaving from the front: step over it and any holes behind it, up to
+    // a reserved ticket that is still to be inserted
+    q->head++;
+    while(q->head < q->tail)
+    {
+        taxi_entry* next = &q->entries[slot_of(q, q->head)];
+        if(next->live || next->reserved)
+        {
+            break;
+        }
+        fenwick_add(q, q->dead, slot_of(q, q->head), -1);
+        q->holes--;
+        q->head++;
+    }
+    return true;
+}
+
+bool taxiqueue_is_reserved(taxiqueue* q, uint64_t ticket)
+{
+    return ticket >= q->head && ticket < q->tail &&
+        q->entries[slot_of(q, ticket)].reserved;
+}
+
+// A ticket handed out whose plane hasn't been inserted yet
+static bool pending(taxiqueue* q, uint64_t ticket)
+{
+    return ticket >= q->tail || taxiqueue_is_reserved(q, ticket);
+}
+
+/*
+ Returns the 0-based place in line of a ticket, or -1 if it isn't queued.
+ A pending ticket (reserved, or past the tail) gets the place it would
+ take if its plane were inserted now.
+*/
+long taxiqueue_position(taxiqueue* q, uint64_t ticket)
+{
+    if(ticket >= q->tail)
+    {
+        return (long)q->live;
+    }
+    if(taxiqueue_get(q, ticket) == NULL && !pending(q, ticket))
+    {
+        return -1;
+    }
+    return (long)(ticket - q->head) - holes_before(q, ticket);
+}
+
+/*
+ Returns the live entry for a ticket, or NULL.
+*/
+taxi_entry* taxiqueue_get(taxiqueue* q, uint64_t ticket)
+{
+    if(ticket < q->head || ticket >= q->tail)
+    {
+        return NULL;
+    }
+
+    taxi_entry* e = &q->entries[slot_of(q, ticket)];
+    return e->live ? e : NULL;
+}
+
+size_t taxiqueue_size(taxiqueue* q)
+{
+    return q->live;
+}
+
+/*
+ Copies the comma-separated ids of the planes ahead of a ticket into
+ "out", up to "cap" bytes (not NUL-terminated). Returns the full length
+ of the list, which may be more than cap, or -1 if the ticket isn't queued.
+ A pending ticket gets the planes that would be ahead of it if it were
+ inserted now. This never modifies the queue, so concurrent readers are
+ safe.
+*/
+long taxiqueue_ahead(taxiqueue* q, uint64_t ticket, char* out, size_t cap)
+{
+    if(taxiqueue_get(q, ticket) == NULL && !pending(q, ticket))
+    {
+        return -1;
+    }
+
+    size_t before = ticket >= q->tail ? q->text_len : bytes_before(q, ticket);
+    if(before == 0)
+    {
+        return 0;  // Front of the line
+    }
+
+    // The text ahead is the start of the run of blocks from the head's,
+    // less the first separator
+    size_t skip = SEPARATOR_LEN;
+    size_t left = before;
+    size_t copied = 0;
+    for(uint64_t t = q->head; left > 0 && copied < cap; t += BLOCK_TICKETS)
+    {
+        const taxi_text_block* b = block_of(q, t);
+        size_t take = b->used < left ? b->used : left;
+        if(take == 0)
+        {
+            continue;
+        }
+        left -= take;
+
+        size_t n = take - skip;
+        n = n < cap - copied ? n : cap - copied;
+        memcpy(out + copied, b->text + skip, n);
+        copied += n;
+        skip = 0;
+    }
+    return (long)(before - SEPARATOR_LEN);
+}
+
+void taxiqueue_destroy(taxiqueue* q)
+{
+    for(size_t i = 0; i < q->capacity / BLOCK_TICKETS; ++i)
+    {
+        free(q->blocks[i].text);
+    }
+    free(q->entries);
+    free(q->dead);
+    free(q->bytes);
+    free(q->blocks);
+    free(q->spare_block);
+    q->entries = NULL;
+    q->dead = NULL;
+    q->bytes = NULL;
+    q->blocks = NULL;
+    q->spare_block = NULL;
+    q->capacity = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef TAXI_QUEUE_H
+#define TAXI_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "airplane.h"
+
+// The taxi queue data structure behind the takeoff module. Every plane
+// that joins gets a sequence number ("ticket") that never changes, and
+// the queue is a ring buffer indexed by ticket. Planes can leave from
+// anywhere in the line; a Fenwick tree over the ring counts those holes
+// so a ticket's position is a couple of prefix sums away.
+//
+// Tickets may be handed out before the plane is inserted, so inserts can
+// arrive out of order. Inserting past the tail reserves the skipped
+// tickets; a reserved slot counts as a hole until its plane shows up.
+// Such a pending ticket can still be asked for its position and the
+// planes ahead of it: the answer is where it would go if inserted now.
+//
+// The queue also keeps the REQAHEAD answer pre-rendered: ", id" for every
+// plane in line, in ticket order, in blocks of 64 tickets that each have
+// room for all of theirs. The planes ahead of a ticket are the start of
+// the run of blocks from the head's, and a second Fenwick tree counts
+// each entry's bytes, so where that text ends is a prefix sum. A plane
+// joining or leaving anywhere, or filling a reserved slot, moves the
+// text of at most one block. Not thread-safe on its own.
+
+typedef struct {
+    flight_id id;
+    plane_handle plane;   // The plane itself, for clearing it
+    bool live;
+    bool reserved;        // Ticket issued, plane not inserted yet
+    bool detached;        // Recovered from the journal, plane not back yet
+    int wake;             // Wake turbulence category, see separation.h
+    uint64_t joined;      // When the plane joined, for the clearance wait
+} taxi_entry;
+
+typedef struct {
+    char* text;           // NULL while none of its tickets is in line
+    size_t used;
+} taxi_text_block;
+
+typedef struct {
+    taxi_entry* entries;  // Ring indexed by ticket & (capacity-1)
+    int* dead;            // Fenwick tree: non-live entries still in the ring
+    int* bytes;           // Fenwick tree: each live entry's bytes of text
+    size_t capacity;      // Always a power of two
+    uint64_t head;        // First ticket still in the ring
+    uint64_t tail;        // One past the highest ticket inserted
+    size_t live;          // Number of live entries
+    size_t holes;         // Number of non-live entries between head and tail
+
+    taxi_text_block* blocks;  // Ring of capacity / 64, indexed by ticket / 64
+    char* spare_block;    // The last block emptied, kept for reuse
+    size_t text_len;      // Bytes of text in every block
+} taxiqueue;
+
+void taxiqueue_init(taxiqueue* q);
+uint64_t taxiqueue_push(taxiqueue* q, const flight_id* id, plane_handle plane, int wake);
+void taxiqueue_insert(taxiqueue* q, uint64_t ticket, const flight_id* id,
+    plane_handle plane, int wake);
+bool taxiqueue_remove(taxiqueue* q, uint64_t ticket);
+long taxiqueue_position(taxiqueue* q, uint64_t ticket);
+taxi_entry* taxiqueue_get(taxiqueue* q, uint64_t ticket);
+bool taxiqueue_is_reserved(taxiqueue* q, uint64_t ticket);
+size_t taxiqueue_size(taxiqueue* q);
+long taxiqueue_ahead(taxiqueue* q, uint64_t ticket, char* out, size_t cap);
+void taxiqueue_destroy(taxiqueue* q);
+
+#endif
@@ -0,0 +1,151 @@
+// The timer service. Any module that needs a timeout arms a timer here
+// instead of sleeping in its own thread.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timers.h"
+
+static timerwheel wheel;
+static pthread_t pthread;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condition;
+static bool stopping;
+
+/*
+ Milliseconds on the monotonic clock; the unit all timers are armed in.
+*/
+uint64_t timers_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void* pthread_start(void* arg)
+{
+    if(pthread_mutex_lock(&mutex) != 0)
+    {
+        fprintf(stderr, "Could not lock timer mutex");
+        exit(1);
+    }
+
+    while(!stopping)
+    {
+        timer* expired = timerwheel_expire(&wheel, timers_now());
+        if(expired != NULL)
+        {
+            pthread_mutex_unlock(&mutex);
+            while(expired != NULL)
+            {
+                timer* next = expired->next;
+                expired->next = NULL;
+                expired->callback(expired->context);
+                expired = next;
+            }
+            pthread_mutex_lock(&mutex);
+            continue;
+        }
+
+        uint64_t next = timerwheel_next_expiry(&wheel);
+        if(next == UINT64_MAX)
+        {
+            pthread_cond_wait(&condition, &mutex);
+        }
+        else
+        {
+            struct timespec deadline;
+            deadline.tv_sec = next / 1000;
+            deadline.tv_nsec = (next % 1000) * 1000000;
+            int rc = pthread_cond_timedwait(&condition, &mutex, &deadline);
+            if(rc != 0 && rc != ETIMEDOUT)
+            {
+                fprintf(stderr, "Timer wait failed");
+                exit(1);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+void timers_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if(pthread_cond_init(&condition, &attr) != 0)
+    {
+        fprintf(stderr, "Could not initialize timer condition");
+        exit(1);
+    }
+    pthread_condattr_destroy(&attr);
+
+    timerwheel_init(&wheel, timers_now());
+    stopping = false;
+
+    if(pthread_create(&pthread, NULL, pthread_start, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to create timer thread");
+        exit(1);
+    }
+}
+
+/*
+ Arms (or re-arms) a timer for an absolute time from timers_now.
+*/
+void timers_schedule_at(timer* t, uint64_t when_ms, TimerCallback callback, void* context)
+{
+    if(pthread_mutex_lock(&mutex) != 0)
+    {
+        fprintf(stderr, "Could not lock timer mutex");
+        exit(1);
+    }
+
+    uint64_t before = timerwheel_next_expiry(&wheel);
+    t->callback = callback;
+    t->context = context;
+    timerwheel_add(&wheel, t, when_ms);
+
+    // Only wake the timer thread if it now has to get up earlier
+    if(when_ms < before)
+    {
+        pthread_cond_signal(&condition);
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void timers_schedule(timer* t, uint64_t delay_ms, TimerCallback callback, void* context)
+{
+    timers_schedule_at(t, timers_now() + delay_ms, callback, context);
+}
+
+void timers_cancel(timer* t)
+{
+    if(pthread_mutex_lock(&mutex) != 0)
+    {
+        fprintf(stderr, "Could not lock timer mutex");
+        exit(1);
+    }
+
+    timerwheel_remove(&wheel, t);
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void timers_destroy(void)
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&condition);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(pthread, NULL);
+    pthread_cond_destroy(&condition);
+}
@@ -0,0 +1,21 @@
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdint.h>
+
+#include "timerwheel.h"
+
+// Process-wide timer service: one thread drives a millisecond timer wheel
+// and runs callbacks as timers come due. Callbacks run on the timer
+// thread without any lock held, so they should be short (typically a
+// signal or a flag) and may re-arm timers. A callback that was already
+// due can still run once after timers_cancel returns.
+
+void timers_init(void);
+uint64_t timers_now(void);
+void timers_schedule_at(timer* t, uint64_t when_ms, TimerCallback callback, void* context);
+void timers_schedule(timer* t, uint64_t delay_ms, TimerCallback callback, void* context);
+void timers_cancel(timer* t);
+void timers_destroy(void);
+
+#endif
@@ -0,0 +1,212 @@
+// Hierarchical timer wheel: O(1) add and remove, and expiry work
+// proportional to the ticks that pass plus the timers that fire.
+
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+
+// Furthest a timer can be placed from now; later ones wait in the last
+// level and are re-placed when they cascade.
+#define WHEEL_SPAN ((uint64_t)1 << (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOT_BITS))
+
+/*
+ Puts a timer in the slot matching its expiry. "expires" must not be in
+ the past; a timer due exactly now lands in the current level 0 slot,
+ which is only still pending while the wheel is cascading into it.
+*/
+static void place(timerwheel* w, timer* t, uint64_t expires)
+{
+    uint64_t delta = expires - w->now;
+    if(delta >= WHEEL_SPAN)
+    {
+        expires = w->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while(delta >= ((uint64_t)1 << ((level + 1) * TIMERWHEEL_SLOT_BITS)))
+    {
+        level++;
+    }
+
+    timer** head = &w->slots[level][(expires >> (level * TIMERWHEEL_SLOT_BITS)) & SLOT_MASK];
+    t->slot = head;
+    t->prev = NULL;
+    t->next = *head;
+    if(*head != NULL)
+    {
+        (*head)->prev = t;
+    }
+    *head = t;
+}
+
+void timerwheel_init(timerwheel* w, uint64_t now)
+{
+    memset(w->slots, 0, sizeof(w->slots));
+    w->now = now;
+    w->count = 0;
+}
+
+/*
+ Arms a timer to expire at tick "expires". Re-arming an armed timer
+ moves it.
+*/
+void timerwheel_add(timerwheel* w, timer* t, uint64_t expires)
+{
+    if(t->armed)
+    {
+        timerwheel_remove(w, t);
+    }
+
+    // The slot for "now" has already been handled, so anything due goes
+    // in the next one.
+    t->expires = expires;
+    t->armed = true;
+    place(w, t, expires > w->now ? expires : w->now + 1);
+    w->count++;
+}
+
+void timerwheel_remove(timerwheel* w, timer* t)
+{
+    if(!t->armed)
+    {
+        return;
+    }
+
+    if(t->prev != NULL)
+    {
+        t->prev->next = t->next;
+    }
+    else
+    {
+        *t->slot = t->next;
+    }
+
+    if(t->next != NULL)
+    {
+        t->next->prev = t->prev;
+    }
+
+    t->armed = false;
+    t->next = t->prev = NULL;
+    t->slot = NULL;
+    w->count--;
+}
+
+static void cascade(timerwheel* w, int level)
+{
+    timer** head = &w->slots[level][(w->now >> (level * TIMERWHEEL_SLOT_BITS)) & SLOT_MASK];
+    timer* t = *head;
+    *head = NULL;
+
+    while(t != NULL)
+    {
+        timer* next = t->next;
+        place(w, t, t->expires > w->now ? t->expires : w->now);
+        t = next;
+    }
+}
+
+/*
+ Turns the wheel forward to "now" and returns the timers that expired,
+ as a list linked through "next". They are no longer armed, and it is
+ up to the caller to run their callbacks.
+*/
+timer* timerwheel_expire(timerwheel* w, uint64_t now)
+{
+    timer* expired = NULL;
+
+    if(w->count == 0)
+    {
+        if(now > w->now)
+        {
+            w->now = now;
+        }
+        return NULL;
+    }
+
+    while(w->now < now)
+    {
+        w->now++;
+
+        // Higher levels first, so nothing is cascaded into a slot that
+        // was already emptied this tick
+        int top = 0;
+        while(top + 1 < TIMERWHEEL_LEVELS &&
+            (w->now & (((uint64_t)1 << ((top + 1) * TIMERWHEEL_SLOT_BITS)) - 1)) == 0)
+        {
+            top++;
+        }
+        for(int level = top; level > 0; --level)
+        {
+            cascade(w, level);
+        }
+
+        timer** head = &w->slots[0][w->now & SLOT_MASK];
+        timer* t = *head;
+        *head = NULL;
+        while(t != NULL)
+        {
+            timer* next = t->next;
+            if(t->expires <= w->now)
+            {
+                t->armed = false;
+                t->slot = NULL;
+                t->prev = NULL;
+                t->next = expired;
+                expired = t;
+                w->count--;
+            }
+            else
+            {
+                place(w, t, t->expires);  // A clamped far timer, not due yet
+            }
+            t = next;
+        }
+
+        if(w->count == 0)
+        {
+            w->now = now;
+        }
+    }
+
+    return expired;
+}
+
+/*
+ Returns the tick the wheel next needs attention, or UINT64_MAX if no
+ timer is armed. For level 0 that is exactly when a timer is due; for
+ the levels above it is when their first occupied slot cascades, which
+ is never later than the timers in it.
+*/
+uint64_t timerwheel_next_expiry(timerwheel* w)
+{
+    uint64_t earliest = UINT64_MAX;
+    if(w->count == 0)
+    {
+        return earliest;
+    }
+
+    for(int level = 0; level < TIMERWHEEL_LEVELS; ++level)
+    {
+        // The current slot holds timers a whole turn away, so it is last
+        int shift = level * TIMERWHEEL_SLOT_BITS;
+        uint64_t current = w->now >> shift;
+        for(uint64_t i = 1; i <= TIMERWHEEL_SLOTS; ++i)
+        {
+            if(w->slots[level][(current + i) & SLOT_MASK] != NULL)
+            {
+                uint64_t at = (current + i) << shift;
+                if(at < earliest)
+                {
+                    earliest = at;
+                }
+                break;
+            }
+        }
+    }
+
+    return earliest;
+}
@@ -0,0 +1,44 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel. Time is measured in ticks chosen by the
+// caller (the timer service uses milliseconds). Level 0 has one slot per
+// tick; each level above covers 64 times the span of the one below, and
+// its timers are cascaded down as the wheel turns. Timers are intrusive:
+// the caller owns the timer struct, zero-initializes it before first use,
+// and keeps it valid while armed.
+// Not thread-safe on its own.
+
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+
+typedef void (*TimerCallback)(void* context);
+
+typedef struct timer {
+    struct timer* next;
+    struct timer* prev;
+    struct timer** slot;   // Head of the slot list this timer is on
+    uint64_t expires;
+    TimerCallback callback;
+    void* context;
+    bool armed;
+} timer;
+
+typedef struct {
+    uint64_t now;
+    size_t count;
+    timer* slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+} timerwheel;
+
+void timerwheel_init(timerwheel* w, uint64_t now);
+void timerwheel_add(timerwheel* w, timer* t, uint64_t expires);
+void timerwheel_remove(timerwheel* w, timer* t);
+timer* timerwheel_expire(timerwheel* w, uint64_t now);
+uint64_t timerwheel_next_expiry(timerwheel* w);
+
+#endif
@@ -0,0 +1,615 @@
+// The upgrade module: hands the listeners and every plane's connection to
+// a new instance of the server, or takes them over from the old one.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "upgrade.h"
+#include "clienthandler.h"
+#include "flightlist.h"
+#include "takeoffqueue.h"
+#include "log.h"
+
+#define UPGRADE_MAGIC "GCUPGR01"
+#define UPGRADE_FD_OPTION "--upgrade-fd"
+
+// How long the old instance waits for the new one to come up, and then
+// for it to take everything over
+#define UPGRADE_START_MS 10000
+#define UPGRADE_TAKEOVER_MS 30000
+
+// Listeners go over in one message
+#define UPGRADE_MAX_LISTENERS 250
+
+// Sent once, with the shard listeners and then the admin listener
+typedef struct {
+    char magic[8];
+    uint32_t listener_count;   // Including the admin listener
+    uint32_t reserved;
+    uint64_t plane_count;
+} upgrade_header;
+
+// Sent with each plane's socket, followed by its input and then its output
+typedef struct {
+    char id[FLIGHT_ID_SIZE];
+    uint32_t id_len;
+    uint32_t state;
+    uint64_t ticket;
+    char peer[INET_ADDRSTRLEN];
+    uint32_t input_len;
+    uint32_t output_len;
+    uint8_t paused;
+    uint8_t discarding;
+    uint8_t reserved[6];
+} upgrade_plane;
+
+_Static_assert(sizeof(upgrade_header) == 24, "upgrade header is 24 bytes");
+_Static_assert(sizeof(upgrade_plane) == 72, "upgrade plane record is 72 bytes");
+
+// The command line to start the new instance with: ours without any
+// --upgrade-fd, and room to add one
+static char** next_argv;
+static int next_argc;
+
+static int* listeners;
+static int listener_count;
+static int admin_listener_fd;
+static bool upgrade_supported;
+
+static int signal_fd = -1;
+static reactor_handler signal_handler;
+static atomic_bool upgrading;
+
+// What the new instance was handed, until upgrade_adopt
+typedef struct {
+    client_state state;
+    char* buffer;              // Holds the input and then the output
+} received_plane;
+
+static received_plane* received;
+static size_t received_count;
+static int received_fd = -1;
+
+/*
+ Sends all of "data", with "fds" attached to its first byte if "count"
+ isn't 0. Returns false if the other end has gone.
+*/
+static bool send_all(int fd, const void* data, size_t len, const int* fds, int count)
+{
+    const char* next = data;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+
+    while(len > 0)
+    {
+        struct iovec iov = { (void*)next, len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if(count > 0)
+        {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+        }
+
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("upgrade: send");
+            return false;
+        }
+        next += sent;
+        len -= (size_t)sent;
+        count = 0;
+    }
+    return true;
+}
+
+/*
+ Receives exactly "len" bytes, and up to "max" descriptors with them into
+ "fds", setting "count" to how many came. Returns false at end of stream
+ or on an error.
+*/
+static bool recv_all(int fd, void* data, size_t len, int* fds, int max, int* count)
+{
+    char* next = data;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+
+    if(count != NULL)
+    {
+        *count = 0;
+    }
+    while(len > 0)
+    {
+        struct iovec iov = { next, len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if(max > 0)
+        {
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * max);
+        }
+
+        ssize_t got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if(got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(got <= 0)
+        {
+            if(got < 0)
+            {
+                perror("upgrade: receive");
+            }
+            return false;
+        }
+
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            int n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds + *count, CMSG_DATA(cmsg), sizeof(int) * n);
+            *count += n;
+        }
+        if(msg.msg_flags & MSG_CTRUNC)
+        {
+            fprintf(stderr, "upgrade: too many descriptors\n");
+            return false;
+        }
+        next += got;
+        len -= (size_t)got;
+        max = 0;
+    }
+    return true;
+}
+
+/*
+ Waits up to "timeout" milliseconds for the other instance to send the
+ magic. It says it is up, from the new instance, and that it has taken
+ everything over, from the old one.
+*/
+static bool expect_magic(int fd, int timeout)
+{
+    struct pollfd ready = { .fd = fd, .events = POLLIN };
+    int ret;
+    while((ret = poll(&ready, 1, timeout)) < 0 && errno == EINTR)
+    {
+    }
+    if(ret <= 0)
+    {
+        return false;
+    }
+
+    char magic[sizeof(UPGRADE_MAGIC) - 1];
+    return recv_all(fd, magic, sizeof(magic), NULL, 0, NULL) &&
+        memcmp(magic, UPGRADE_MAGIC, sizeof(magic)) == 0;
+}
+
+/*
+ Sends the listeners and every connected plane. Everything is paused, so
+ the connections stay as exported until this instance exits or resumes.
+ Recovered planes waiting for their flight id to come back have no
+ connection; the journal carries them over.
+*/
+static bool send_state(int fd)
+{
+    size_t capacity = 256;
+    size_t count = 0;
+    client_state* states = malloc(capacity * sizeof(client_state));
+    if(states == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if(pthread_mutex_lock(&flightlist_lock) != 0)
+    {
+        fprintf(stderr, "Could not lock in send_state\n");
+        exit(1);
+    }
+    uint32_t cursor = 0;
+    airplane* plane;
+    while((plane = flightlist_next(&cursor)) != NULL)
+    {
+        if(count == capacity)
+        {
+            capacity *= 2;
+            client_state* grown = realloc(states, capacity * sizeof(client_state));
+            if(grown == NULL)
+            {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+            states = grown;
+        }
+        if(client_export(plane, &states[count]))
+        {
+            ++count;
+        }
+    }
+    pthread_mutex_unlock(&flightlist_lock);
+
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    memcpy(fds, listeners, sizeof(int) * listener_count);
+    fds[listener_count] = admin_listener_fd;
+
+    upgrade_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UPGRADE_MAGIC, sizeof(header.magic));
+    header.listener_count = (uint32_t)listener_count + 1;
+    header.plane_count = count;
+    bool ok = send_all(fd, &header, sizeof(header), fds, listener_count + 1);
+
+    for(size_t i = 0; ok && i < count; ++i)
+    {
+        const client_state* state = &states[i];
+        upgrade_plane record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.id, state->id.text, sizeof(record.id));
+        record.id_len = state->id.len;
+        record.state = (uint32_t)state->state;
+        record.ticket = state->ticket;
+        memcpy(record.peer, state->peer, sizeof(record.peer));
+        record.input_len = (uint32_t)state->input_len;
+        record.output_len = (uint32_t)state->output_len;
+        record.paused = state->paused;
+        record.discarding = state->discarding;
+
+        ok = send_all(fd, &record, sizeof(record), &state->fd, 1) &&
+            send_all(fd, state->input, state->input_len, NULL, 0) &&
+            send_all(fd, state->output, state->output_len, NULL, 0);
+    }
+
+    free(states);
+    return ok;
+}
+
+// Gives up on a new instance that didn't come up or take over
+static void abandon(pid_t pid, int fd)
+{
+    close(fd);
+    kill(pid, SIGKILL);
+    while(waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+    {
+    }
+    atomic_store(&upgrading, false);
+}
+
+static void* upgrade_thread(void* arg)
+{
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+    {
+        perror("upgrade: socketpair");
+        atomic_store(&upgrading, false);
+        return NULL;
+    }
+
+    char fd_text[16];
+    snprintf(fd_text, sizeof(fd_text), "%d", pair[1]);
+    next_argv[next_argc] = UPGRADE_FD_OPTION;
+    next_argv[next_argc + 1] = fd_text;
+    next_argv[next_argc + 2] = NULL;
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        // The new instance starts with SIGUSR2 blocked, as this one did
+        if(fcntl(pair[1], F_SETFD, 0) == 0)
+        {
+            execvp(next_argv[0], next_argv);
+        }
+        perror("upgrade: exec");
+        _exit(127);
+    }
+    close(pair[1]);
+    if(pid < 0)
+    {
+        perror("upgrade: fork");
+        close(pair[0]);
+        atomic_store(&upgrading, false);
+        return NULL;
+    }
+
+    if(!expect_magic(pair[0], UPGRADE_START_MS))
+    {
+        fprintf(stderr, "upgrade: new instance (process %d) did not start\n", (int)pid);
+        abandon(pid, pair[0]);
+        return NULL;
+    }
+
+    reactor_pause_all();
+    takeoff_pause();
+    if(send_state(pair[0]) && expect_magic(pair[0], UPGRADE_TAKEOVER_MS))
+    {
+        fprintf(stderr, "upgrade: handed over to process %d\n", (int)pid);
+        log_destroy();
+        exit(0);
+    }
+
+    fprintf(stderr, "upgrade: new instance (process %d) failed, carrying on\n", (int)pid);
+    takeoff_resume();
+    reactor_resume_all();
+    abandon(pid, pair[0]);
+    return NULL;
+}
+
+static void on_signal(void* context, uint32_t events)
+{
+    struct signalfd_siginfo info;
+    while(read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        if(!upgrade_supported)
+        {
+            fprintf(stderr, "upgrade: needs --io epoll\n");
+            continue;
+        }
+        if(atomic_exchange(&upgrading, true))
+        {
+            continue;
+        }
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, upgrade_thread, NULL) != 0)
+        {
+            fprintf(stderr, "upgrade: failed to create thread\n");
+            atomic_store(&upgrading, false);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/*
+ Remembers the command line for the new instance and blocks SIGUSR2, so
+ only upgrade_listen's signalfd sees it. Must be called before any thread
+ is created, so every thread inherits the mask.
+*/
+void upgrade_init(int argc, char* argv[])
+{
+    next_argv = calloc(argc + 3, sizeof(char*));
+    if(next_argv == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for(int i = 0; i < argc; ++i)
+    {
+        if(i > 0 && strcmp(argv[i], UPGRADE_FD_OPTION) == 0)
+        {
+            ++i;
+            continue;
+        }
+        if(i > 0 && strncmp(argv[i], UPGRADE_FD_OPTION "=",
+            sizeof(UPGRADE_FD_OPTION)) == 0)
+        {
+            continue;
+        }
+        next_argv[next_argc++] = argv[i];
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to block SIGUSR2\n");
+        exit(1);
+    }
+}
+
+/*
+ Starts taking SIGUSR2 on reactor "r" as the signal to upgrade, handing
+ over the "count" shard listeners in "listeners" (in shard order) and the
+ admin listener. If "supported" is false the signal is refused.
+*/
+void upgrade_listen(reactor* r, const int* shard_listeners, int count, int admin_listener,
+    bool supported)
+{
+    if(count > UPGRADE_MAX_LISTENERS)
+    {
+        fprintf(stderr, "upgrade: at most %d shards can be handed over\n",
+            UPGRADE_MAX_LISTENERS);
+        supported = false;
+    }
+
+    listeners = malloc(count * sizeof(int));
+    if(listeners == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(listeners, shard_listeners, count * sizeof(int));
+    listener_count = count;
+    admin_listener_fd = admin_listener;
+    upgrade_supported = supported;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(signal_fd < 0)
+    {
+        perror("signalfd");
+        exit(1);
+    }
+    signal_handler.callback = on_signal;
+    signal_handler.context = NULL;
+    if(reactor_watch(r, signal_fd, EPOLLIN, &signal_handler) != 0)
+    {
+        exit(1);
+    }
+}
+
+/*
+ In a new instance started with --upgrade-fd, takes everything the old
+ instance hands over on "fd": the listeners go to "listeners" (shard
+ listeners, "count" of them) and "admin_listener", the planes are kept
+ for upgrade_adopt. Called before anything else is set up; once it
+ returns the old instance is on its way out. Returns -1, having said why,
+ if the handover failed, and the old instance carries on.
+*/
+int upgrade_receive(int fd, int** shard_listeners, int* count, int* admin_listener)
+{
+    if(!send_all(fd, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC) - 1, NULL, 0))
+    {
+        return -1;
+    }
+
+    upgrade_header header;
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    int fd_count;
+    if(!recv_all(fd, &header, sizeof(header), fds, UPGRADE_MAX_LISTENERS + 1, &fd_count) ||
+        memcmp(header.magic, UPGRADE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.listener_count < 2 || fd_count != (int)header.listener_count)
+    {
+        fprintf(stderr, "upgrade: bad listeners from the old instance\n");
+        return -1;
+    }
+
+    *count = fd_count - 1;
+    *shard_listeners = malloc(*count * sizeof(int));
+    received = calloc(header.plane_count + 1, sizeof(received_plane));
+    if(*shard_listeners == NULL || received == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memcpy(*shard_listeners, fds, *count * sizeof(int));
+    *admin_listener = fds[*count];
+
+    for(uint64_t i = 0; i < header.plane_count; ++i)
+    {
+        upgrade_plane record;
+        int plane_fd;
+        int plane_fds;
+        if(!recv_all(fd, &record, sizeof(record), &plane_fd, 1, &plane_fds) ||
+            plane_fds != 1 || record.id_len > PLANE_MAXID)
+        {
+            fprintf(stderr, "upgrade: bad plane from the old instance\n");
+            return -1;
+        }
+
+        received_plane* next = &received[received_count++];
+        next->buffer = malloc((size_t)record.input_len + record.output_len + 1);
+        if(next->buffer == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        if(!recv_all(fd, next->buffer, (size_t)record.input_len + record.output_len,
+            NULL, 0, NULL))
+        {
+            fprintf(stderr, "upgrade: bad plane from the old instance\n");
+            return -1;
+        }
+
+        client_state* state = &next->state;
+        state->fd = plane_fd;
+        memcpy(state->peer, record.peer, sizeof(state->peer));
+        state->peer[sizeof(state->peer) - 1] = '\0';
+        flight_id_set(&state->id, record.id, record.id_len);
+        state->state = (int)record.state;
+        state->ticket = record.ticket;
+        state->input = next->buffer;
+        state->input_len = record.input_len;
+        state->discarding = record.discarding;
+        state->output = next->buffer + record.input_len;
+        state->output_len = record.output_len;
+        state->paused = record.paused;
+    }
+
+    if(!send_all(fd, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC) - 1, NULL, 0))
+    {
+        return -1;
+    }
+    received_fd = fd;
+    return 0;
+}
+
+typedef struct {
+    uint64_t ticket;           // In the old instance
+    airplane* plane;
+} adopted_plane;
+
+static int by_ticket(const void* a, const void* b)
+{
+    uint64_t x = ((const adopted_plane*)a)->ticket;
+    uint64_t y = ((const adopted_plane*)b)->ticket;
+    return (x > y) - (x < y);
+}
+
+/*
+ Gives the planes upgrade_receive took over to the reactors, round robin,
+ and puts them back in line in the old instance's order. Called after
+ takeoff_recover and before takeoff_thread_init.
+*/
+void upgrade_adopt(reactor** reactors, int count)
+{
+    adopted_plane* adopted = malloc((received_count + 1) * sizeof(adopted_plane));
+    if(adopted == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    size_t adopted_count = 0;
+    for(size_t i = 0; i < received_count; ++i)
+    {
+        airplane* plane = client_adopt(reactors[i % count], &received[i].state);
+        if(plane != NULL)
+        {
+            adopted[adopted_count].ticket = received[i].state.ticket;
+            adopted[adopted_count++].plane = plane;
+        }
+        free(received[i].buffer);
+    }
+
+    // Planes that weren't in line have no ticket and sort last
+    qsort(adopted, adopted_count, sizeof(adopted_plane), by_ticket);
+    for(size_t i = 0; i < adopted_count; ++i)
+    {
+        takeoff_adopt(adopted[i].plane);
+    }
+    fprintf(stderr, "upgrade: took over %zu planes\n", adopted_count);
+
+    free(adopted);
+    free(received);
+    received = NULL;
+    received_count = 0;
+    close(received_fd);
+    received_fd = -1;
+}
@@ -0,0 +1,36 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+
+#include "reactor.h"
+
+// Zero-downtime upgrade: a running server hands its listening sockets and
+// every plane's connection over to a new instance of itself, which goes
+// on from where it stopped.
+//
+// SIGUSR2 starts it. The old instance runs the binary it was started as,
+// with the same options plus --upgrade-fd, and waits for it to say it is
+// up. Then it parks every reactor thread and the takeoff scheduler, so no
+// command runs and no clearance goes out while it works, and sends over a
+// Unix socket: the listeners (SCM_RIGHTS), then for each connected plane
+// its socket, flight id, state and ticket, the input it hasn't run yet
+// and the replies it hasn't written. Once the new instance has all of it
+// the old one exits, and since the new one holds the sockets, the planes
+// only see a pause. The new instance rebuilds the flight list and puts
+// the planes back in line in their old order; cleared planes keep their
+// runways.
+//
+// The new instance runs one shard per listener it was handed, whatever
+// --workers says. If it doesn't come up, or fails before it has taken
+// everything, the old instance carries on. Connections on an io_uring
+// reactor can't be paused with operations in flight, so the upgrade needs
+// --io epoll.
+
+void upgrade_init(int argc, char* argv[]);
+void upgrade_listen(reactor* r, const int* listeners, int count, int admin_listener,
+    bool supported);
+int upgrade_receive(int fd, int** listeners, int* count, int* admin_listener);
+void upgrade_adopt(reactor** reactors, int count);
+
+#endif
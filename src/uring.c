@@ -0,0 +1,245 @@
+// The io_uring wrapper. Uses the system calls directly, so the server
+// needs no library beyond libc; the kernel headers describe the rings.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int setup(unsigned entries, struct io_uring_params* params)
+{
+    int fd = syscall(__NR_io_uring_setup, entries, params);
+    return fd < 0 ? -errno : fd;
+}
+
+static int enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    int ret = syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+static int register_ring(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    int ret = syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    return ret < 0 ? -errno : ret;
+}
+
+/*
+ Registers "count" receive buffers of "size" bytes each as buffer group
+ URING_BUFFER_GROUP, all of them initially available. "count" must be a
+ power of two.
+*/
+static int setup_buffers(uring* u, unsigned count, unsigned size)
+{
+    u->buffer_ring_size = count * sizeof(struct io_uring_buf);
+    u->buffer_ring = mmap(NULL, u->buffer_ring_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(u->buffer_ring == MAP_FAILED)
+    {
+        u->buffer_ring = NULL;
+        return -errno;
+    }
+
+    u->buffers = malloc((size_t)count * size);
+    if(u->buffers == NULL)
+    {
+        return -ENOMEM;
+    }
+    u->buffer_count = count;
+    u->buffer_size = size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buffer_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    int ret = register_ring(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if(ret < 0)
+    {
+        return ret;
+    }
+
+    for(unsigned id = 0; id < count; ++id)
+    {
+        struct io_uring_buf* buf = &u->buffer_ring->bufs[id];
+        buf->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)id * size);
+        buf->len = size;
+        buf->bid = id;
+    }
+    __atomic_store_n(&u->buffer_ring->tail, (uint16_t)count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ Sets up a ring with room for "entries" submissions and a receive buffer
+ pool. Returns 0, or -errno if the kernel can't: io_uring missing or
+ disabled, or older than the provided buffer rings (5.19), which are also
+ the oldest feature the reactor uses. A failed ring needs no destroy.
+*/
+int uring_init(uring* u, unsigned entries, unsigned buffer_count, unsigned buffer_size)
+{
+    memset(u, 0, sizeof(*u));
+
+    // Completions outnumber submissions under multishot operations
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    u->fd = setup(entries, &params);
+    if(u->fd < 0)
+    {
+        return u->fd;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        close(u->fd);
+        return -ENOSYS;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->ring == MAP_FAILED)
+    {
+        int error = -errno;
+        close(u->fd);
+        return error;
+    }
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED)
+    {
+        int error = -errno;
+        munmap(u->ring, u->ring_size);
+        close(u->fd);
+        return error;
+    }
+
+    char* ring = u->ring;
+    u->sq_head = (unsigned*)(ring + params.sq_off.head);
+    u->sq_tail = (unsigned*)(ring + params.sq_off.tail);
+    u->sq_mask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned*)(ring + params.cq_off.head);
+    u->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+    u->cq_mask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // SQE i always sits in slot i
+    unsigned* array = (unsigned*)(ring + params.sq_off.array);
+    for(unsigned i = 0; i < params.sq_entries; ++i)
+    {
+        array[i] = i;
+    }
+
+    int ret = setup_buffers(u, buffer_count, buffer_size);
+    if(ret < 0)
+    {
+        uring_destroy(u);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ Hands out a zeroed submission entry. When the submission ring is full
+ what is queued is submitted first.
+*/
+struct io_uring_sqe* uring_sqe(uring* u)
+{
+    while(u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    {
+        uring_enter(u, 0);
+    }
+
+    struct io_uring_sqe* sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local_tail++;
+    return sqe;
+}
+
+/*
+ Submits every queued entry and, if "wait" is more than zero, waits until
+ at least that many completions are ready. Returns 0 or -errno; EINTR is
+ the caller's to retry.
+*/
+int uring_enter(uring* u, unsigned wait)
+{
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if(submit == 0 && wait == 0)
+    {
+        return 0;
+    }
+
+    int ret = enter(u->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    return ret < 0 ? ret : 0;
+}
+
+// The oldest completion not yet seen, or NULL
+struct io_uring_cqe* uring_peek(uring* u)
+{
+    unsigned head = *u->cq_head;
+    if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+// Gives the completion uring_peek returned back to the kernel
+void uring_seen(uring* u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ The provided buffer a receive completion filled, or NULL if it was not
+ given one. It stays the caller's until uring_buffer_return.
+*/
+char* uring_buffer(uring* u, uint32_t cqe_flags)
+{
+    if(!(cqe_flags & IORING_CQE_F_BUFFER))
+    {
+        return NULL;
+    }
+    return u->buffers + (size_t)(cqe_flags >> IORING_CQE_BUFFER_SHIFT) * u->buffer_size;
+}
+
+void uring_buffer_return(uring* u, uint32_t cqe_flags)
+{
+    if(!(cqe_flags & IORING_CQE_F_BUFFER))
+    {
+        return;
+    }
+    unsigned id = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+    uint16_t tail = u->buffer_ring->tail;
+    struct io_uring_buf* buf = &u->buffer_ring->bufs[tail & (u->buffer_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)id * u->buffer_size);
+    buf->len = u->buffer_size;
+    buf->bid = id;
+    __atomic_store_n(&u->buffer_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void uring_destroy(uring* u)
+{
+    close(u->fd);
+    if(u->buffer_ring != NULL)
+    {
+        munmap(u->buffer_ring, u->buffer_ring_size);
+    }
+    free(u->buffers);
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+}
@@ -0,0 +1,52 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// A thin wrapper over the io_uring system calls, with just what the
+// reactor needs: the submission and completion rings, mapped once at
+// setup, and a ring of provided buffers that receives pick from. Not
+// thread-safe; a ring belongs to one reactor thread.
+
+#define URING_BUFFER_GROUP 0
+
+typedef struct {
+    int fd;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;    // SQEs handed out, published at uring_enter
+    unsigned sq_pending;       // Published but not yet taken by the kernel
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring;
+    size_t ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring* buffer_ring;
+    size_t buffer_ring_size;
+    char* buffers;
+    unsigned buffer_count;
+    unsigned buffer_size;
+} uring;
+
+int uring_init(uring* u, unsigned entries, unsigned buffer_count, unsigned buffer_size);
+struct io_uring_sqe* uring_sqe(uring* u);
+int uring_enter(uring* u, unsigned wait);
+struct io_uring_cqe* uring_peek(uring* u);
+void uring_seen(uring* u);
+char* uring_buffer(uring* u, uint32_t cqe_flags);
+void uring_buffer_return(uring* u, uint32_t cqe_flags);
+void uring_destroy(uring* u);
+
+#endif
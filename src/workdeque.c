@@ -0,0 +1,97 @@
+// Work-stealing deque, after Lê, Pop, Cohen and Zappa Nardelli, "Correct
+// and Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+
+#include "workdeque.h"
+
+#define MASK (WORKDEQUE_CAPACITY - 1)
+
+void workdeque_init(workdeque* d)
+{
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    for(int i = 0; i < WORKDEQUE_CAPACITY; ++i)
+    {
+        atomic_init(&d->items[i], NULL);
+    }
+}
+
+/*
+ Adds an item at the bottom. Returns false if the deque is full. Only
+ the owning thread may call this.
+*/
+bool workdeque_push(workdeque* d, work_item* item)
+{
+    int_fast64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int_fast64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if(b - t >= WORKDEQUE_CAPACITY)
+    {
+        return false;
+    }
+
+    atomic_store_explicit(&d->items[b & MASK], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+/*
+ Takes the newest item, or returns NULL if there is none. Only the owning
+ thread may call this.
+*/
+work_item* workdeque_pop(workdeque* d)
+{
+    int_fast64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int_fast64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if(t > b)
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    work_item* item = atomic_load_explicit(&d->items[b & MASK], memory_order_relaxed);
+    if(t == b)
+    {
+        // The last item: a thief may be after it too
+        if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        {
+            item = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/*
+ Takes the oldest item from another thread's deque. Returns NULL if the
+ deque is empty or another thread won the race for the item.
+*/
+work_item* workdeque_steal(workdeque* d)
+{
+    int_fast64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int_fast64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if(t >= b)
+    {
+        return NULL;
+    }
+
+    work_item* item = atomic_load_explicit(&d->items[t & MASK], memory_order_relaxed);
+    if(!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+        memory_order_seq_cst, memory_order_relaxed))
+    {
+        return NULL;
+    }
+    return item;
+}
+
+// Items waiting, as seen from any thread; only a hint while others work
+int64_t workdeque_size(workdeque* d)
+{
+    int_fast64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int_fast64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
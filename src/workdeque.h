@@ -0,0 +1,39 @@
+#ifndef WORK_DEQUE_H
+#define WORK_DEQUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A piece of work a reactor thread can run: "run" is called with
+// "context". Owned by whoever submitted it; "next" is only used while
+// the item waits to be retired (see reactor.h).
+
+typedef struct work_item {
+    void (*run)(void* context);
+    void* context;
+    struct work_item* next;
+} work_item;
+
+// Chase-Lev work-stealing deque of work items. The owning thread pushes
+// and pops at the bottom, last in first out, so it keeps running work
+// whose data is still in its cache; any other thread may steal from the
+// top, taking the oldest item. Fixed capacity: a push to a full deque
+// fails and the caller runs the work itself.
+
+#define WORKDEQUE_CAPACITY 4096   // Must be a power of two
+
+typedef struct {
+    _Alignas(64) atomic_int_fast64_t top;      // Next item a thief takes
+    _Alignas(64) atomic_int_fast64_t bottom;   // Next free slot for the owner
+    _Atomic(work_item*) items[WORKDEQUE_CAPACITY];
+} workdeque;
+
+void workdeque_init(workdeque* d);
+bool workdeque_push(workdeque* d, work_item* item);
+work_item* workdeque_pop(workdeque* d);
+work_item* workdeque_steal(workdeque* d);
+int64_t workdeque_size(workdeque* d);
+
+#endif